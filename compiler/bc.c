@@ -32,6 +32,9 @@ typedef struct {
     ir_var_decl_t temp_var;
     uint8_t min_reg;
     uint8_t max_reg;
+    
+    const ir_inst_t* insts;
+    const ir_inst_t** fused; //See find_fusions()
 } gen_bc_state_t;
 
 static int find_reg(gen_bc_state_t* state) {
@@ -264,6 +267,193 @@ static bool write_sel(gen_bc_state_t* state, const ir_inst_t* inst) {
     return true;
 }
 
+static bool same_var(ir_var_t a, ir_var_t b) {
+    return a.decl==b.decl && a.ver==b.ver && a.comp_idx==b.comp_idx;
+}
+
+static bool reads_var(const ir_inst_t* inst, ir_var_t var) {
+    if (inst->op == IR_OP_DROP) return false;
+    for (size_t i = 0; i < inst->operand_count; i++)
+        if (inst->operands[i].type==IR_OPERAND_VAR && same_var(inst->operands[i].var, var))
+            return true;
+    return false;
+}
+
+static bool is_operand(const ir_inst_t* inst, size_t index, ir_var_t var) {
+    return inst->operands[index].type==IR_OPERAND_VAR && same_var(inst->operands[index].var, var);
+}
+
+static bool contains_var(const ir_var_t* vars, size_t count, ir_var_t var) {
+    for (size_t i = 0; i < count; i++)
+        if (same_var(vars[i], var)) return true;
+    return false;
+}
+
+//Appends the variables which share a register with one in vars because PHIs
+//merge them (see redef()) and returns the new count
+static size_t add_phi_aliases(const ir_inst_t* insts, const ir_inst_t* end, ir_var_t** vars,
+                              size_t count) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (const ir_inst_t* phi = insts; phi != end; phi++) {
+            if (phi->op != IR_OP_PHI) continue;
+            
+            bool merged = false;
+            for (size_t i = 0; i < 3; i++)
+                merged = merged || (phi->operands[i].type==IR_OPERAND_VAR &&
+                                    contains_var(*vars, count, phi->operands[i].var));
+            if (!merged) continue;
+            
+            for (size_t i = 0; i < 3; i++) {
+                ir_var_t var = phi->operands[i].var;
+                if (phi->operands[i].type!=IR_OPERAND_VAR || contains_var(*vars, count, var))
+                    continue;
+                *vars = append_mem(*vars, count++, sizeof(ir_var_t), &var);
+                changed = true;
+            }
+        }
+    }
+    return count;
+}
+
+//Returns true if inst writes a new version of one of the variables or one
+//sharing its register
+static bool writes_var(const ir_inst_t* inst, const ir_var_t* vars, size_t count) {
+    if (inst->op==IR_OP_DROP || !inst->operand_count) return false;
+    if (inst->operands[0].type != IR_OPERAND_VAR) return false;
+    ir_var_t dest = inst->operands[0].var;
+    for (size_t i = 0; i < count; i++)
+        if (dest.decl==vars[i].decl && dest.comp_idx==vars[i].comp_idx) return true;
+    return contains_var(vars, count, dest);
+}
+
+//Returns the instruction that the result of inst can be fused into or NULL.
+//It has to be the only instruction reading the result and there can be no
+//control flow in between. The fused instruction reads the operands of inst,
+//so their registers can not be written in between either.
+static const ir_inst_t* find_fusion(const ir_inst_t* insts, const ir_inst_t* inst,
+                                    const ir_inst_t* end) {
+    ir_var_t res = inst->operands[0].var;
+    
+    const ir_inst_t* user = inst + 1;
+    for (; user != end; user++) {
+        switch (user->op) {
+        case IR_OP_BEGIN_IF:
+        case IR_OP_END_IF:
+        case IR_OP_BEGIN_WHILE:
+        case IR_OP_END_WHILE_COND:
+        case IR_OP_END_WHILE:
+        case IR_OP_PHI: return NULL;
+        default: break;
+        }
+        if (reads_var(user, res)) break;
+    }
+    if (user == end) return NULL;
+    
+    for (const ir_inst_t* other = user + 1; other != end; other++)
+        if (reads_var(other, res)) return NULL;
+    
+    if (inst->op == IR_OP_MUL) {
+        if (user->op!=IR_OP_ADD && user->op!=IR_OP_SUB) return NULL;
+        if (is_operand(user, 1, res) == is_operand(user, 2, res)) return NULL;
+    } else {
+        if (user->op!=IR_OP_SEL || !is_operand(user, 3, res)) return NULL;
+        if (is_operand(user, 1, res) || is_operand(user, 2, res)) return NULL;
+    }
+    
+    ir_var_t* operands = NULL;
+    size_t operand_count = 0;
+    for (size_t i = 1; i < 3; i++) {
+        ir_var_t var = inst->operands[i].var;
+        if (inst->operands[i].type == IR_OPERAND_VAR)
+            operands = append_mem(operands, operand_count++, sizeof(ir_var_t), &var);
+    }
+    operand_count = add_phi_aliases(insts, end, &operands, operand_count);
+    
+    bool written = false;
+    for (const ir_inst_t* other = inst + 1; other != user; other++)
+        written = written || writes_var(other, operands, operand_count);
+    free(operands);
+    
+    return written ? NULL : user;
+}
+
+//Pairs instructions which are written as one superinstruction: a MUL
+//followed by an ADD or SUB and a LESS or GREATER followed by a SEL. The
+//first instruction is written in place of the second. Drops of its operands
+//in between are delayed until after the superinstruction, or the last one if
+//several superinstructions read the operand.
+static void find_fusions(gen_bc_state_t* state, size_t inst_count) {
+    const ir_inst_t* insts = state->insts;
+    const ir_inst_t** fused = state->fused;
+    for (size_t i = 0; i < inst_count; i++) {
+        const ir_inst_t* inst = insts + i;
+        if (inst->op!=IR_OP_MUL && inst->op!=IR_OP_LESS && inst->op!=IR_OP_GREATER)
+            continue;
+        
+        const ir_inst_t* user = find_fusion(insts, inst, insts+inst_count);
+        if (!user || fused[user-insts]) continue;
+        fused[i] = user;
+        fused[user-insts] = inst;
+        
+        for (const ir_inst_t* drop = inst + 1; drop != user; drop++)
+            if (drop->op==IR_OP_DROP && (!fused[drop-insts] || fused[drop-insts]<user) &&
+                (is_operand(inst, 1, drop->operands[0].var) ||
+                 is_operand(inst, 2, drop->operands[0].var)))
+                fused[drop-insts] = user;
+    }
+}
+
+static const ir_inst_t* fused_with(gen_bc_state_t* state, const ir_inst_t* inst) {
+    return state->fused[inst-state->insts];
+}
+
+static bool write_fused(gen_bc_state_t* state, const ir_inst_t* inst, const ir_inst_t* first) {
+    int dest_reg = get_reg(state, inst->operands[0].var);
+    int a_reg = begin_operand(state, 0, first->operands[1]);
+    int b_reg = begin_operand(state, 1, first->operands[2]);
+    if (dest_reg<0 || a_reg<0 || b_reg<0) return false;
+    
+    ir_var_t res = first->operands[0].var;
+    
+    if (first->op == IR_OP_MUL) {
+        bool res_lhs = is_operand(inst, 1, res);
+        int c_reg = begin_operand(state, 2, inst->operands[res_lhs?2:1]);
+        if (c_reg < 0) return false;
+        
+        bc_op_t op = inst->op==IR_OP_ADD ? BC_OP_FMA : (res_lhs ? BC_OP_FMS : BC_OP_FNMA);
+        WRITEB(op);
+        WRITEB(dest_reg);
+        WRITEB(a_reg);
+        WRITEB(b_reg);
+        WRITEB(c_reg);
+        end_operand(state, 2);
+    } else {
+        int true_reg = begin_operand(state, 2, inst->operands[1]);
+        int false_reg = begin_operand(state, 3, inst->operands[2]);
+        if (true_reg<0 || false_reg<0) return false;
+        
+        WRITEB(first->op==IR_OP_LESS ? BC_OP_SEL_LESS : BC_OP_SEL_GREATER);
+        WRITEB(dest_reg);
+        WRITEB(true_reg);
+        WRITEB(false_reg);
+        WRITEB(a_reg);
+        WRITEB(b_reg);
+        end_operand(state, 2);
+        end_operand(state, 3);
+    }
+    
+    end_operand(state, 0);
+    end_operand(state, 1);
+    
+    for (const ir_inst_t* drop = first + 1; drop != inst; drop++)
+        if (drop->op==IR_OP_DROP && fused_with(state, drop)==inst)
+            drop_var(state, drop->operands[0].var);
+    
+    return true;
+}
+
 static bool _gen_bc(gen_bc_state_t* state, const ir_inst_t* insts, size_t inst_count, size_t* end_id) {
     for (size_t i = 0; i < inst_count; i++) {
         const ir_inst_t* inst = insts + i;
@@ -286,6 +476,13 @@ static bool _gen_bc(gen_bc_state_t* state, const ir_inst_t* insts, size_t inst_c
         case IR_OP_EQUAL:
         case IR_OP_BOOL_AND:
         case IR_OP_BOOL_OR: {
+            const ir_inst_t* fused = fused_with(state, inst);
+            if (fused > inst) break; //Written with the instruction it is fused into
+            if (fused) {
+                if (!write_fused(state, inst, fused)) goto error;
+                break;
+            }
+            
             int dest_reg = get_reg(state, inst->operands[0].var);
             if (dest_reg < 0) goto error;
             if (!write_bin(state, dest_reg, inst)) goto error;
@@ -324,10 +521,15 @@ static bool _gen_bc(gen_bc_state_t* state, const ir_inst_t* insts, size_t inst_c
             break;
         }
         case IR_OP_DROP: {
-            drop_var(state, inst->operands[0].var);
+            if (!fused_with(state, inst)) drop_var(state, inst->operands[0].var);
             break;
         }
         case IR_OP_SEL: {
+            const ir_inst_t* fused = fused_with(state, inst);
+            if (fused) {
+                if (!write_fused(state, inst, fused)) goto error;
+                break;
+            }
             if (!write_sel(state, inst)) goto error;
             break;
         }
@@ -516,6 +718,7 @@ bool gen_bc(bc_t* bc) {
     state.min_reg = 255;
     state.max_reg = 0;
     state.res_bc = bc;
+    state.insts = bc->ir->insts;
     
     for (size_t i = 0; i < bc->ir->uni_count; i++) {
         ir_var_t var;
@@ -541,7 +744,13 @@ bool gen_bc(bc_t* bc) {
         }
     }
     
-    if (!_gen_bc(&state, bc->ir->insts, bc->ir->inst_count, NULL)) return false;
+    state.fused = alloc_mem(bc->ir->inst_count*sizeof(const ir_inst_t*));
+    memset(state.fused, 0, bc->ir->inst_count*sizeof(const ir_inst_t*));
+    find_fusions(&state, bc->ir->inst_count);
+    
+    bool success = _gen_bc(&state, bc->ir->insts, bc->ir->inst_count, NULL);
+    free(state.fused);
+    if (!success) return false;
     
     bc->bc_size = state.bc_size;
     bc->bc = state.bc;
@@ -32,7 +32,12 @@ typedef enum {
     BC_OP_EMIT = 21,
     BC_OP_RAND = 22,
     BC_OP_FLOOR = 23,
-    BC_OP_MOV = 24
+    BC_OP_MOV = 24,
+    BC_OP_FMA = 25,
+    BC_OP_FMS = 26,
+    BC_OP_FNMA = 27,
+    BC_OP_SEL_LESS = 28,
+    BC_OP_SEL_GREATER = 29
 } bc_op_t;
 
 typedef struct {
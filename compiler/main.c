@@ -272,6 +272,32 @@ static void print_bc(uint8_t* begin, uint8_t* end) {
             }
             break;
         }
+        case BC_OP_FMA:
+        case BC_OP_FMS:
+        case BC_OP_FNMA: {
+            switch (op) {
+            case BC_OP_FMA: printf("fma "); break;
+            case BC_OP_FMS: printf("fms "); break;
+            case BC_OP_FNMA: printf("fnma "); break;
+            }
+            uint8_t d = *bc++;
+            uint8_t a = *bc++;
+            uint8_t b = *bc++;
+            uint8_t c = *bc++;
+            printf("r%u r%u r%u r%u\n", d, a, b, c);
+            break;
+        }
+        case BC_OP_SEL_LESS:
+        case BC_OP_SEL_GREATER: {
+            printf(op==BC_OP_SEL_LESS ? "selless " : "selgreater ");
+            uint8_t d = *bc++;
+            uint8_t a = *bc++;
+            uint8_t b = *bc++;
+            uint8_t x = *bc++;
+            uint8_t y = *bc++;
+            printf("r%u r%u r%u r%u r%u\n", d, a, b, x, y);
+            break;
+        }
         case BC_OP_RAND: {
             printf("rand r%u\n", *bc++);
             break;
@@ -32,16 +32,11 @@ static const char* vertex_source = "#version 120\n"
 "attribute float colr;\n"
 "attribute float colg;\n"
 "attribute float colb;\n"
-"attribute float deleted;\n"
 "uniform mat4 uView;\n"
 "uniform mat4 uProj;\n"
 "varying vec3 color;\n"
 "void main() {\n"
 "    gl_Position = uProj * uView * vec4(posx, posy, posz, 1.0);\n"
-"    if (deleted > 0.9) {\n"
-"        gl_Position.x = 2.0;\n"
-"        gl_Position.w = 1.0;\n"
-"    }"
 "    color = vec3(colr, colg, colb);\n"
 "}\n";
 static const char* fragment_source = "#version 120\n"
@@ -192,25 +187,51 @@ static void _fail(int status) {
     exit(status);
 }
 
-static void init_particle(unsigned int index) {
-    float velx = rand() / (double)RAND_MAX * 2.0 - 1.0;
-    float vely = rand() / (double)RAND_MAX;
-    float velz = rand() / (double)RAND_MAX * 2.0 - 1.0;
-    float vlen = sqrt(velx*velx + vely*vely + velz*velz);
-    velx /= vlen;
-    vely /= vlen;
-    velz /= vlen;
-    
-    ((float*)particles.attributes[posx_index])[index] = 0.0f;
-    ((float*)particles.attributes[posy_index])[index] = 0.0f;
-    ((float*)particles.attributes[posz_index])[index] = 0.0f;
-    ((float*)particles.attributes[velx_index])[index] = velx*0.005f;
-    ((float*)particles.attributes[vely_index])[index] = vely*0.005f;
-    ((float*)particles.attributes[velz_index])[index] = velz*0.005f;
-    ((uint8_t*)particles.attributes[colr_index])[index] = 0;
-    ((uint8_t*)particles.attributes[colg_index])[index] = 0;
-    ((uint8_t*)particles.attributes[colb_index])[index] = 0;
-    ((float*)particles.attributes[time_index])[index] = 0.0;
+//Returns the first index from index to end whose bit is value or end
+static size_t next_bit(const uint64_t* bits, size_t index, size_t end, bool value) {
+    while (index < end) {
+        uint64_t word = value ? bits[index/64] : ~bits[index/64];
+        word &= ~(uint64_t)0 << (index%64);
+        if (word) {
+            index = index/64*64 + __builtin_ctzll(word);
+            return index<end ? index : end;
+        }
+        index = (index/64+1) * 64;
+    }
+    return end;
+}
+
+static bool init_particles(particle_range_t range) {
+    float* vel[3] = {malloc(range.count*sizeof(float)),
+                     malloc(range.count*sizeof(float)),
+                     malloc(range.count*sizeof(float))};
+    float* zero = calloc(range.count, sizeof(float));
+    bool success = vel[0] && vel[1] && vel[2] && zero;
+    if (!success) set_error(&runtime, "Failed to allocate initial attributes");
+    
+    for (size_t i = 0; success && i < range.count; i++) {
+        float velx = rand() / (double)RAND_MAX * 2.0 - 1.0;
+        float vely = rand() / (double)RAND_MAX;
+        float velz = rand() / (double)RAND_MAX * 2.0 - 1.0;
+        float vlen = sqrt(velx*velx + vely*vely + velz*velz);
+        vel[0][i] = velx / vlen * 0.005f;
+        vel[1][i] = vely / vlen * 0.005f;
+        vel[2][i] = velz / vlen * 0.005f;
+    }
+    
+    int zero_indices[] = {posx_index, posy_index, posz_index,
+                          colr_index, colg_index, colb_index, time_index};
+    for (size_t i = 0; success && i < sizeof(zero_indices)/sizeof(int); i++)
+        success = write_attribute(&particles, zero_indices[i], range, ATTR_FLOAT32, zero);
+    success = success && write_attribute(&particles, velx_index, range, ATTR_FLOAT32, vel[0]);
+    success = success && write_attribute(&particles, vely_index, range, ATTR_FLOAT32, vel[1]);
+    success = success && write_attribute(&particles, velz_index, range, ATTR_FLOAT32, vel[2]);
+    
+    free(vel[0]);
+    free(vel[1]);
+    free(vel[2]);
+    free(zero);
+    return success;
 }
 
 static void create_gl_program() {
@@ -298,6 +319,7 @@ int main() {
     if (!create_particles(&particles, 300000))
         FAIL("Failed to create particles: %s", runtime.error);
     particles_init = true;
+    particles.compact_moves = 4096;
     
     if (!add_attribute(&particles, "pos.x", ATTR_FLOAT32, &posx_index))
         FAIL("Failed to add pos.x attribute: %s", runtime.error);
@@ -328,12 +350,19 @@ int main() {
         FAIL("Failed to create particle system: %s", runtime.error);
     system_init = true;
     
-    for (size_t i = 0; i < 100000; i++) {
-        int index = spawn_particle(&particles);
-        if (index >= 0) init_particle(index);
-        else FAIL("Failed to spawn particle: %s", runtime.error);
+    for (size_t spawned = 0; spawned < 100000;) {
+        particle_range_t range;
+        if (!spawn_particles(&particles, 100000-spawned, &range))
+            FAIL("Failed to spawn particles: %s", runtime.error);
+        if (!init_particles(range))
+            FAIL("Failed to initialize particles: %s", runtime.error);
+        spawned += range.count;
     }
     
+    //The particles are drawn while the next frame is simulated
+    if (!set_double_buffered(&particles, true))
+        FAIL("Failed to enable double buffering: %s", runtime.error);
+    
     create_gl_program();
     
     glUseProgram(gl_program);
@@ -344,32 +373,17 @@ int main() {
     GLint colr_loc = glGetAttribLocation(gl_program, "colr");
     GLint colg_loc = glGetAttribLocation(gl_program, "colg");
     GLint colb_loc = glGetAttribLocation(gl_program, "colb");
-    GLint deleted_loc = glGetAttribLocation(gl_program, "deleted");
     glEnableVertexAttribArray(posx_loc);
     glEnableVertexAttribArray(posy_loc);
     glEnableVertexAttribArray(posz_loc);
     glEnableVertexAttribArray(colr_loc);
     glEnableVertexAttribArray(colg_loc);
     glEnableVertexAttribArray(colb_loc);
-    glEnableVertexAttribArray(deleted_loc);
-    float* posx = particles.attributes[posx_index];
-    float* posy = particles.attributes[posy_index];
-    float* posz = particles.attributes[posz_index];
-    uint8_t* colr = particles.attributes[colr_index];
-    uint8_t* colg = particles.attributes[colg_index];
-    uint8_t* colb = particles.attributes[colb_index];
-    uint8_t* deleted = particles.deleted_flags;
-    glVertexAttribPointer(posx_loc, 1, GL_FLOAT, GL_FALSE, 0, posx);
-    glVertexAttribPointer(posy_loc, 1, GL_FLOAT, GL_FALSE, 0, posy);
-    glVertexAttribPointer(posz_loc, 1, GL_FLOAT, GL_FALSE, 0, posz);
-    glVertexAttribPointer(colr_loc, 1, GL_UNSIGNED_BYTE, GL_TRUE, 0, colr);
-    glVertexAttribPointer(colg_loc, 1, GL_UNSIGNED_BYTE, GL_TRUE, 0, colg);
-    glVertexAttribPointer(colb_loc, 1, GL_UNSIGNED_BYTE, GL_TRUE, 0, colb);
-    glVertexAttribPointer(deleted_loc, 1, GL_UNSIGNED_BYTE, GL_FALSE, 0, deleted);
     
     anglea = -0.652613f;
     angleb = -0.69614f;
     
+    thread_fence_t* fence = NULL;
     while (!glfwWindowShouldClose(window)) {
         double begin = glfwGetTime();
         
@@ -382,14 +396,18 @@ int main() {
         if (glfwGetKey(window, GLFW_KEY_DOWN))
             angleb += radians(30.0f) * frametime;
         
+        //The previous frame's simulation is done before the next one begins
+        double wait_begin = glfwGetTime();
+        bool success = !fence || threading_wait(&runtime.threading, fence);
+        fence = NULL;
+        if (!success)
+            FAIL("Failed to simulate particle system: %s", runtime.error);
+        double wait_end = glfwGetTime();
+        float usage = (double)particles.pool_usage/particles.pool_size;
+        
         int index = get_uniform_index(&emit_program, "count.x");
         particle_system.emit_uniforms[index] = glfwGetKey(window, GLFW_KEY_S) ? 50000*frametime : 0;
         
-        double sim_begin = glfwGetTime();
-        if (!simulate_system(&particle_system))
-            FAIL("Failed to simulate particle system: %s", runtime.error);
-        double sim_end = glfwGetTime();
-        
         vec3_t eye = create_vec3(zoom*sin(anglea)*cos(angleb),
                                  zoom*sin(anglea)*sin(angleb),
                                  zoom*cos(anglea));
@@ -399,6 +417,19 @@ int main() {
                              eye);
         mat4_t proj = perspective(radians(45.0f), 1.0f, 1.0f, 0.1f, 100.0f);
         
+        //These stay valid until the next simulation is done
+        const uint64_t* live_bits = particles.front_live_bits;
+        glVertexAttribPointer(posx_loc, 1, GL_FLOAT, GL_FALSE, 0, particles.attributes[posx_index]);
+        glVertexAttribPointer(posy_loc, 1, GL_FLOAT, GL_FALSE, 0, particles.attributes[posy_index]);
+        glVertexAttribPointer(posz_loc, 1, GL_FLOAT, GL_FALSE, 0, particles.attributes[posz_index]);
+        glVertexAttribPointer(colr_loc, 1, GL_UNSIGNED_BYTE, GL_TRUE, 0, particles.attributes[colr_index]);
+        glVertexAttribPointer(colg_loc, 1, GL_UNSIGNED_BYTE, GL_TRUE, 0, particles.attributes[colg_index]);
+        glVertexAttribPointer(colb_loc, 1, GL_UNSIGNED_BYTE, GL_TRUE, 0, particles.attributes[colb_index]);
+        
+        fence = simulate_system_async(&particle_system);
+        if (!fence)
+            FAIL("Failed to simulate particle system: %s", runtime.error);
+        
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
         GLint loc = glGetUniformLocation(gl_program, "uView");
@@ -406,7 +437,13 @@ int main() {
         loc = glGetUniformLocation(gl_program, "uProj");
         glUniformMatrix4fv(loc, 1, GL_FALSE, (const GLfloat*)&proj);
         
-        glDrawArrays(GL_POINTS, 0, particles.pool_size);
+        //Only runs of live particles are drawn
+        size_t pool_size = particles.pool_size;
+        for (size_t i = next_bit(live_bits, 0, pool_size, true); i < pool_size;) {
+            size_t end = next_bit(live_bits, i, pool_size, false);
+            glDrawArrays(GL_POINTS, i, end-i);
+            i = next_bit(live_bits, end, pool_size, true);
+        }
         
         glfwSwapBuffers(window);
         glfwPollEvents();
@@ -415,14 +452,12 @@ int main() {
         
         char title[256];
         frametime = end - begin;
-        float usage = (double)particles.pool_usage/particles.pool_size;
-        float nspp = (sim_end-sim_begin)*1000000000.0/particles.pool_usage;
-        float ppms = particles.pool_usage / ((sim_end-sim_begin)*1000.0);
-        static const char* format = "Frametime: %.0f mspf - Pool usage: %.0f%c - Simulated in %.0f ms (%.0f nspp %.0f ppms)";
-        snprintf(title, 256, format, frametime*1000.0f, usage*100.0, '%', (sim_end-sim_begin)*1000.0f, nspp, ppms);
+        static const char* format = "Frametime: %.0f mspf - Pool usage: %.0f%c - Waited %.1f ms for simulation";
+        snprintf(title, 256, format, frametime*1000.0f, usage*100.0, '%', (wait_end-wait_begin)*1000.0f);
         glfwSetWindowTitle(window, title);
     }
     
+    if (fence) threading_wait(&runtime.threading, fence);
     deinit();
     
     return EXIT_SUCCESS;
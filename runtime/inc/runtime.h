@@ -31,7 +31,12 @@ typedef enum bc_op_t {
     BC_OP_EMIT = 21,
     BC_OP_RAND = 22,
     BC_OP_FLOOR = 23,
-    BC_OP_MOV = 24
+    BC_OP_MOV = 24,
+    BC_OP_FMA = 25,
+    BC_OP_FMS = 26,
+    BC_OP_FNMA = 27,
+    BC_OP_SEL_LESS = 28,
+    BC_OP_SEL_GREATER = 29
 } bc_op_t;
 
 typedef enum program_type_t {
@@ -50,6 +55,12 @@ typedef enum attr_dtype_t {
     ATTR_FLOAT64 = 7
 } attr_dtype_t;
 
+typedef enum kernel_tier_t {
+    KERNEL_TIER_VM = 0,
+    KERNEL_TIER_COMPILED = 1,
+    KERNEL_TIER_SPECIALIZED = 2 //Compiled with sim_uniforms as constants
+} kernel_tier_t;
+
 typedef struct runtime_t runtime_t;
 typedef struct backend_t backend_t;
 typedef struct program_t program_t;
@@ -61,7 +72,17 @@ struct backend_t {
     bool (*destroy)(runtime_t* runtime);
     bool (*create_program)(program_t* program);
     bool (*destroy_program)(program_t* program);
-    bool (*simulate_system)(system_t* program);
+    bool (*create_system)(system_t* system);
+    bool (*destroy_system)(system_t* system);
+    //Called on the calling thread before each frame of the system is
+    //emitted and simulated
+    bool (*begin_frame)(system_t* system);
+    //Runs the emitter program on the calling thread. parallel is false when
+    //called from a threading_run() job.
+    bool (*emit_system)(system_t* system, bool parallel);
+    //Runs the simulation program for particles begin..begin+count-1. Called
+    //from threading_run() jobs.
+    bool (*simulate_range)(system_t* system, size_t begin, size_t count);
     void* internal;
 };
 
@@ -91,18 +112,50 @@ struct particles_t {
     runtime_t* runtime;
     
     size_t pool_size;
-    size_t pool_usage;
-    int* nexts;
-    int next_particle;
+    size_t pool_usage; //Updated by flush_deletions()
     
     char* attribute_names[256];
     attr_dtype_t attribute_dtypes[256];
-    void* attributes[256];
-    uint8_t* deleted_flags;
+    void* attributes[256]; //Allocated for pool_size rounded up to a multiple of 64
+    
+    //Particles are spawned into the lowest unused slots, which are found
+    //using these
+    uint64_t* live_bits; //Bit i%64 of word i/64 is set if particle i is alive
+    uint64_t* live_summary; //Bit i%64 of word i/64 is set if live_bits[i] is not zero
+    uint64_t* full_summary; //Bit i%64 of word i/64 is set if live_bits[i] is all ones
+    size_t free_hint; //Every particle before this is alive or pending deletion
+    
+    //simulate_system moves up to compact_moves particles towards the front of
+    //the pool when get_fragmentation() is above compact_threshold. Moving a
+    //particle changes its index. Set to 0 and 0.25 by create_particles.
+    size_t compact_moves;
+    float compact_threshold;
     
-    void* _del_particle_mutex;
+    //Particles deleted since the last flush_deletions() which are not counted
+    //in pool_usage and free_hint yet. Deleting a particle does not take a lock.
+    uint64_t* pending_bits;
+    uint64_t* pending_summary;
+    bool pending;
+    
+    //Set by set_double_buffered(). The simulation program then reads
+    //attributes and writes back_attributes, which are swapped when
+    //simulate_system() finishes, so the attributes and front_live_bits taken
+    //before a simulate_system() call can be read until it returns. Attributes
+    //the simulation program does not write are shared and may change for
+    //particles it deletes. Emitted particles are stored in slots which are
+    //dead in front_live_bits.
+    bool double_buffered;
+    void* back_attributes[256];
+    uint64_t* front_live_bits; //Copy of live_bits when the attributes were last swapped
+    uint64_t* back_live_bits;
 };
 
+//Particles begin..begin+count-1
+typedef struct particle_range_t {
+    size_t begin;
+    size_t count;
+} particle_range_t;
+
 struct system_t {
     runtime_t* runtime;
     program_t* sim_program;
@@ -115,6 +168,37 @@ struct system_t {
     
     float emit_uniforms[256];
     uint8_t emit_attribute_indices[256];
+    
+    uint32_t seed; //Set to 0 by create_system
+    uint32_t frame; //Incremented by simulate_system
+    
+    //Number of particles the VM backend runs each instruction for before
+    //dispatching the next one. Set to 256 by create_system.
+    size_t tile_size;
+    
+    //Instanced systems simulate many instances of an effect in one pool. The
+    //raw value of a particle's instance_attribute selects the row of
+    //instance_uniforms, sim_program->uniform_count floats each, which it is
+    //simulated with instead of sim_uniforms. Particles with an instance
+    //outside 0..instance_count-1 use sim_uniforms. The emitter still runs
+    //once per system. instance_attribute is set to -1 by create_system.
+    int instance_attribute;
+    size_t instance_count;
+    const float* instance_uniforms;
+    
+    //If not 0, the LLVM backend compiles a simulation kernel with sim_uniforms
+    //as constants once they have been unchanged for this many frames, and uses
+    //it until one of them changes. Not done for instanced systems. Only the
+    //latest specialized kernel is kept, so this is meant for uniforms which
+    //rarely change. Set to 0 by create_system.
+    size_t specialize_frames;
+    
+    //The kernels the current or last frame is emitted and simulated with. Set
+    //by the backend before each frame and to KERNEL_TIER_VM by create_system.
+    kernel_tier_t sim_tier;
+    kernel_tier_t emit_tier;
+    
+    void* backend_internal;
 };
 
 bool create_runtime(runtime_t* runtime, threading_t* threading);
@@ -130,10 +214,22 @@ int get_uniform_index(const program_t* program, const char* name);
 bool create_particles(particles_t* particles, size_t pool_size);
 bool destroy_particles(particles_t* particles);
 bool add_attribute(particles_t* particles, const char* name, attr_dtype_t dtype, int* index);
+bool set_double_buffered(particles_t* particles, bool double_buffered);
 
 bool create_system(system_t* system);
 bool destroy_system(system_t* system);
 bool simulate_system(system_t* system);
+bool simulate_systems(system_t** systems, size_t count);
+thread_fence_t* simulate_system_async(system_t* system);
+const float* get_particle_uniforms(const system_t* system, size_t index);
 int spawn_particle(particles_t* particles);
+bool spawn_particles(particles_t* particles, size_t count, particle_range_t* range);
+bool write_attribute(particles_t* particles, int attribute, particle_range_t range,
+                     attr_dtype_t dtype, const void* values);
 bool delete_particle(particles_t* particles, int index);
+void flush_deletions(particles_t* particles);
+size_t next_live_particle(const particles_t* particles, size_t index, size_t end);
+size_t next_dead_particle(const particles_t* particles, size_t index, size_t end);
+float get_fragmentation(particles_t* particles);
+bool compact_particles(particles_t* particles, size_t max_moves);
 #endif
@@ -5,15 +5,25 @@
 
 #define MAX_THREADS 256
 
+//Chunks handed out by the built-in threading begin at multiples of this, so
+//threads share neither cache lines of attributes nor words of bitmaps
+#define THREAD_CHUNK_ALIGN 64
+
 typedef struct threading_t threading_t;
 typedef struct thread_run_t thread_run_t;
 typedef struct thread_res_t thread_res_t;
+typedef struct thread_fence_t thread_fence_t;
 typedef void* (*thread_func_t)(size_t, size_t, void*);
+typedef bool (*thread_task_t)(void*);
 
 struct threading_t {
     char error[256];
     bool (*destroy)(threading_t*);
     thread_res_t (*run)(threading_t*, thread_run_t);
+    thread_fence_t* (*submit)(threading_t*, thread_task_t, void*);
+    thread_fence_t* (*submit_background)(threading_t*, thread_task_t, void*);
+    bool (*wait)(threading_t*, thread_fence_t*);
+    bool (*poll)(threading_t*, thread_fence_t*);
     void* (*create_mutex)(threading_t*);
     void (*destroy_mutex)(threading_t*, void*);
     void (*lock_mutex)(threading_t*, void*);
@@ -21,22 +31,33 @@ struct threading_t {
     void* internal;
 };
 
+//func may be called several times by each thread, with disjoint chunks of
+//0..count-1
 struct thread_run_t {
     thread_func_t func;
     size_t count;
     void* data;
+    //Number of items per chunk, rounded up to a multiple of
+    //THREAD_CHUNK_ALIGN. 0 selects one from count and the number of threads.
+    size_t grain;
 };
 
+//One result per thread which ran a chunk. It is the first NULL returned to
+//the thread or otherwise the last result.
 struct thread_res_t {
     bool success;
     size_t count;
     void* res[MAX_THREADS];
 };
 
-bool create_builtin_threading(threading_t* threading, size_t count);
+bool create_builtin_threading(threading_t* threading, size_t count, bool pin);
 bool create_null_threading(threading_t* threading);
 bool destroy_threading(threading_t* threading);
 thread_res_t threading_run(threading_t* threading, thread_run_t run);
+thread_fence_t* threading_submit(threading_t* threading, thread_task_t task, void* data);
+thread_fence_t* threading_submit_background(threading_t* threading, thread_task_t task, void* data);
+bool threading_wait(threading_t* threading, thread_fence_t* fence);
+bool threading_poll(threading_t* threading, thread_fence_t* fence);
 
 void* create_mutex(threading_t* threading);
 void destroy_mutex(threading_t* threading, void* mut);
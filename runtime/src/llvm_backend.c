@@ -1,348 +1,458 @@
 #include "runtime.h"
+#include "rand.h"
+#include "vm.h"
 
 #include <string.h>
 #include <endian.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <assert.h>
+#include <inttypes.h>
+#include <unistd.h>
 #include <llvm-c/Core.h>
-#include <llvm-c/ExecutionEngine.h>
 #include <llvm-c/Analysis.h>
-#include <llvm-c/BitWriter.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Transforms/PassManagerBuilder.h>
+#include <llvm/Config/llvm-config.h>
 
-typedef struct llvm_prog_t {
+//Simulation kernels run blocks of up to this many particles
+#define LLVM_MAX_WIDTH 16
+
+//Part of the cache key. Bump it when the generated code changes, so objects
+//cached by older builds are not loaded.
+#define LLVM_CACHE_VERSION 3
+
+//A program compiled for the dtypes of the attributes it is bound to. Kernels
+//are shared by programs with the same bytecode and kept until the runtime is
+//destroyed, except for kernels specialized on uniforms, which have their own
+//tracker and are removed from the JIT once no system uses them.
+typedef struct llvm_kernel_t {
+    uint64_t key;
+    void* func;
+    LLVMOrcResourceTrackerRef tracker; //NULL unless specialized
+    size_t refs; //Number of systems using the specialized kernel
+    struct llvm_kernel_t* next;
+} llvm_kernel_t;
+
+//Stored in vm_system_t::jit. Systems run in the VM until their kernels have
+//been compiled by a task submitted to the threading_t.
+typedef struct llvm_system_t {
+    //Used for the current frame. NULL if the VM runs the program.
+    llvm_kernel_t* sim_kernel;
+    llvm_kernel_t* emit_kernel;
+    //Kernels of the last finished compile task. spec_sim is specialized on
+    //spec_uniforms.
+    llvm_kernel_t* generic_sim;
+    llvm_kernel_t* spec_sim;
+    float spec_uniforms[256];
+    bool specialized; //Set if the task tried to compile spec_sim
+    //Number of frames sim_uniforms has been equal to last_uniforms
+    size_t stable_frames;
+    float last_uniforms[256];
+    //Written by the compile task, and switched to by begin_frame() once it
+    //has finished
+    thread_fence_t* compile_fence;
+    llvm_kernel_t* compiled_sim;
+    llvm_kernel_t* compiled_emit;
+    llvm_kernel_t* compiled_spec;
+    bool specialize;
+    float compile_uniforms[256];
+    //The dtypes of the attributes the kernels are compiled for
+    uint8_t sim_dtypes[256];
+    uint8_t emit_dtypes[256];
+} llvm_system_t;
+
+typedef struct llvm_backend_t {
+    //The VM's hooks find its kernel through backend_t::internal
+    vm_kernel_t vm_kernel;
+    backend_t vm;
+    size_t next_name;
+    char* cpu;
+    char* features;
+    size_t width; //Number of particles simulation kernels run together
+    LLVMOrcLLJITRef jit;
+    void* mutex; //Protects kernels and the JIT's symbols
+    llvm_kernel_t* kernels;
+    //Objects of compiled kernels are stored here if WIP26_JIT_CACHE is set, so
+    //later processes can load them instead of compiling
+    char* cache_dir;
+} llvm_backend_t;
+
+//State used while a kernel is generated
+typedef struct llvm_gen_t {
+    program_t* program;
+    runtime_t* runtime;
+    const uint8_t* dtypes;
+    const float* constant_uniforms; //If not NULL, uniforms are constants with these values
+    size_t width; //1 for emitter kernels
+    LLVMContextRef context;
     LLVMModuleRef module;
-    LLVMModuleRef opt_module;
     LLVMBuilderRef builder;
-    LLVMExecutionEngineRef exec_engine;
     LLVMValueRef main_func;
     LLVMValueRef floor_func;
     LLVMValueRef sqrt_func;
     LLVMValueRef pow_func;
-    LLVMValueRef randf_func;
-    LLVMValueRef inv_index;
-    LLVMValueRef del_flags;
+    LLVMValueRef fmuladd_func;
+    LLVMValueRef cttz_func;
+    LLVMValueRef index; //The particle, or the first particle of the block
+    LLVMValueRef lane_index; //The particle of each lane
+    LLVMValueRef rand_key;
+    LLVMValueRef rand_counter;
+    //Lanes running the current instruction and lanes which have ended or
+    //deleted their particle. Register writes are only blended with exec_mask
+    //when masked is set.
+    LLVMValueRef exec_mask;
+    LLVMValueRef finished_mask;
+    LLVMValueRef delete_bits;
+    bool masked;
+    bool may_finish;
+    LLVMValueRef live_bits;
     LLVMValueRef particles;
-    LLVMValueRef attr_data;
-    LLVMValueRef attr_dtypes;
     LLVMValueRef uniforms;
+    LLVMValueRef load_ptrs[256];
+    LLVMValueRef store_ptrs[256];
     LLVMValueRef del_particle_func;
     LLVMValueRef spawn_particle_func;
-} llvm_prog_t;
-
-typedef struct llvm_backend_t {
-    size_t next_name;
-} llvm_backend_t;
+    LLVMBasicBlockRef fail_block; //Emitter kernels return 0 from here if the pool is full
+} llvm_gen_t;
 
 typedef int (*sim_func_t)(unsigned int, unsigned int, float*, void**,
-                          int*, uint8_t*, particles_t*);
+                          uint64_t*, particles_t*, uint32_t);
 
-typedef int (*emit_func_t)(float*, particles_t*, void**, int*);
-
-static float randf() {
-    return rand() / (float)RAND_MAX;
-}
+//Returns 0 if the pool is full
+typedef int (*emit_func_t)(float*, particles_t*, void**, uint32_t);
 
 static char* get_reg_name(unsigned int i) {
-    static char name[64];
+    static _Thread_local char name[64];
     snprintf(name, sizeof(name), "r%u", i);
     return name;
 }
 
 static char* get_name(runtime_t* runtime) {
     llvm_backend_t* backend = runtime->backend.internal;
-    static char name[64];
-    snprintf(name, sizeof(name), "n%zu", backend->next_name++);
+    static _Thread_local char name[64];
+    snprintf(name, sizeof(name), "n%zu", __atomic_fetch_add(&backend->next_name, 1, __ATOMIC_RELAXED));
     return name;
 }
 
-static LLVMValueRef get_intrinsic1(LLVMModuleRef module, const char* name) {
-    LLVMTypeRef param[] = {LLVMFloatType()};
-    LLVMTypeRef ret = LLVMFunctionType(LLVMFloatType(), param, 1, 0);
-    return LLVMAddFunction(module, name, ret);
+//The type, or a vector of it if the kernel runs several particles together
+static LLVMTypeRef get_vec_type(llvm_gen_t* gen, LLVMTypeRef type) {
+    return gen->width==1 ? type : LLVMVectorType(type, gen->width);
+}
+
+static LLVMValueRef const_splat(llvm_gen_t* gen, LLVMValueRef val) {
+    if (gen->width == 1) return val;
+    LLVMValueRef vals[LLVM_MAX_WIDTH];
+    for (size_t i = 0; i < gen->width; i++) vals[i] = val;
+    return LLVMConstVector(vals, gen->width);
 }
 
-static LLVMValueRef get_intrinsic2(LLVMModuleRef module, const char* name) {
-    LLVMTypeRef params[] = {LLVMFloatType(), LLVMFloatType()};
-    LLVMTypeRef ret = LLVMFunctionType(LLVMFloatType(), params, 2, 0);
-    return LLVMAddFunction(module, name, ret);
+static LLVMValueRef build_splat(llvm_gen_t* gen, LLVMValueRef val) {
+    if (gen->width == 1) return val;
+    runtime_t* runtime = gen->runtime;
+    LLVMTypeRef type = LLVMVectorType(LLVMTypeOf(val), gen->width);
+    LLVMValueRef zero = LLVMConstInt(LLVMInt32TypeInContext(gen->context), 0, false);
+    LLVMValueRef vec = LLVMBuildInsertElement(gen->builder, LLVMGetUndef(type), val, zero, get_name(runtime));
+    LLVMValueRef mask = LLVMConstNull(LLVMVectorType(LLVMInt32TypeInContext(gen->context), gen->width));
+    return LLVMBuildShuffleVector(gen->builder, vec, LLVMGetUndef(type), mask, get_name(runtime));
+}
+
+//Whether any lane of the mask is set
+static LLVMValueRef build_any(llvm_gen_t* gen, LLVMValueRef mask) {
+    runtime_t* runtime = gen->runtime;
+    LLVMTypeRef bits_type = LLVMIntTypeInContext(gen->context, gen->width);
+    LLVMValueRef bits = LLVMBuildBitCast(gen->builder, mask, bits_type, get_name(runtime));
+    return LLVMBuildICmp(gen->builder, LLVMIntNE, bits, LLVMConstNull(bits_type), get_name(runtime));
+}
+
+//name is the name of the intrinsic without the type suffix
+static LLVMValueRef get_intrinsic(llvm_gen_t* gen, const char* name, unsigned int param_count) {
+    char full_name[64];
+    if (gen->width == 1) snprintf(full_name, sizeof(full_name), "%s.f32", name);
+    else snprintf(full_name, sizeof(full_name), "%s.v%zuf32", name, gen->width);
+    LLVMTypeRef f = get_vec_type(gen, LLVMFloatTypeInContext(gen->context));
+    LLVMTypeRef params[] = {f, f, f};
+    LLVMTypeRef ret = LLVMFunctionType(f, params, param_count, 0);
+    return LLVMAddFunction(gen->module, full_name, ret);
+}
+
+static LLVMValueRef get_cttz_func(LLVMModuleRef module) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(LLVMGetModuleContext(module));
+    LLVMTypeRef params[] = {i32, LLVMIntTypeInContext(LLVMGetModuleContext(module), 1)};
+    LLVMTypeRef ret = LLVMFunctionType(i32, params, 2, 0);
+    return LLVMAddFunction(module, "llvm.cttz.i32", ret);
 }
 
 static LLVMValueRef get_del_particle_func(LLVMModuleRef module) {
-    LLVMTypeRef params[] = {LLVMPointerType(LLVMInt32Type(), 0), LLVMInt32Type()};
-    LLVMTypeRef ret = LLVMFunctionType(LLVMIntType(1), params, 2, 0);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(LLVMGetModuleContext(module));
+    LLVMTypeRef params[] = {LLVMPointerType(i32, 0), i32};
+    LLVMTypeRef ret = LLVMFunctionType(LLVMIntTypeInContext(LLVMGetModuleContext(module), 1), params, 2, 0);
     return LLVMAddFunction(module, "delete_particle", ret);
 }
 
 static LLVMValueRef get_spawn_particle_func(LLVMModuleRef module) {
-    LLVMTypeRef params[] = {LLVMPointerType(LLVMInt32Type(), 0)};
-    LLVMTypeRef ret = LLVMFunctionType(LLVMInt32Type(), params, 1, 0);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(LLVMGetModuleContext(module));
+    LLVMTypeRef params[] = {LLVMPointerType(i32, 0)};
+    LLVMTypeRef ret = LLVMFunctionType(i32, params, 1, 0);
     return LLVMAddFunction(module, "spawn_particle", ret);
 }
 
-static LLVMValueRef get_randf_func(LLVMModuleRef module) {
-    LLVMTypeRef ret = LLVMFunctionType(LLVMFloatType(), NULL, 0, 0);
-    return LLVMAddFunction(module, "randf", ret);
+//Inline equivalent of rand_hash() in rand.h
+static LLVMValueRef build_rand_hash(llvm_gen_t* gen, LLVMValueRef x) {
+    runtime_t* runtime = gen->runtime;
+    LLVMValueRef s16 = const_splat(gen, LLVMConstInt(LLVMInt32TypeInContext(gen->context), 16, false));
+    LLVMValueRef s15 = const_splat(gen, LLVMConstInt(LLVMInt32TypeInContext(gen->context), 15, false));
+    LLVMValueRef m0 = const_splat(gen, LLVMConstInt(LLVMInt32TypeInContext(gen->context), RAND_MUL0, false));
+    LLVMValueRef m1 = const_splat(gen, LLVMConstInt(LLVMInt32TypeInContext(gen->context), RAND_MUL1, false));
+    x = LLVMBuildXor(gen->builder, x, LLVMBuildLShr(gen->builder, x, s16, get_name(runtime)), get_name(runtime));
+    x = LLVMBuildMul(gen->builder, x, m0, get_name(runtime));
+    x = LLVMBuildXor(gen->builder, x, LLVMBuildLShr(gen->builder, x, s15, get_name(runtime)), get_name(runtime));
+    x = LLVMBuildMul(gen->builder, x, m1, get_name(runtime));
+    return LLVMBuildXor(gen->builder, x, LLVMBuildLShr(gen->builder, x, s16, get_name(runtime)), get_name(runtime));
 }
 
-static LLVMValueRef load_reg_f(program_t* program, LLVMValueRef* regs, uint8_t i) {
-    runtime_t* runtime = program->runtime;
-    llvm_prog_t* llvm = program->backend_internal;
-    return LLVMBuildLoad(llvm->builder, regs[i], get_name(runtime));
+//Inline equivalent of rand_float() in rand.h
+static LLVMValueRef build_rand_float(llvm_gen_t* gen, LLVMValueRef index, LLVMValueRef counter) {
+    runtime_t* runtime = gen->runtime;
+    LLVMValueRef x = LLVMBuildAdd(gen->builder, gen->rand_key, counter, get_name(runtime));
+    x = build_rand_hash(gen, x);
+    x = LLVMBuildAdd(gen->builder, x, index, get_name(runtime));
+    x = build_rand_hash(gen, x);
+    x = LLVMBuildLShr(gen->builder, x, const_splat(gen, LLVMConstInt(LLVMInt32TypeInContext(gen->context), 8, false)),
+                      get_name(runtime));
+    LLVMValueRef f = LLVMBuildUIToFP(gen->builder, x, get_vec_type(gen, LLVMFloatTypeInContext(gen->context)),
+                                     get_name(runtime));
+    return LLVMBuildFMul(gen->builder, f, const_splat(gen, LLVMConstReal(LLVMFloatTypeInContext(gen->context), 1.0/16777216.0)),
+                         get_name(runtime));
 }
 
-static LLVMValueRef load_reg_b(program_t* program, LLVMValueRef* regs, uint8_t i) {
-    runtime_t* runtime = program->runtime;
-    llvm_prog_t* llvm = program->backend_internal;
-    LLVMValueRef res = LLVMBuildLoad(llvm->builder, regs[i], get_name(runtime));
-    res = LLVMBuildBitCast(llvm->builder, res, LLVMInt32Type(), get_name(runtime));
-    LLVMValueRef zero = LLVMConstInt(LLVMInt32Type(), 0, false);
-    return LLVMBuildICmp(llvm->builder, LLVMIntNE, res, zero, get_name(runtime));
+static LLVMValueRef load_reg_f(llvm_gen_t* gen, LLVMValueRef* regs, uint8_t i) {
+    return LLVMBuildLoad(gen->builder, regs[i], get_name(gen->runtime));
 }
 
-static void store_reg_b(program_t* program, LLVMValueRef* regs, uint8_t i, LLVMValueRef val) {
-    runtime_t* runtime = program->runtime;
-    llvm_prog_t* llvm = program->backend_internal;
-    val = LLVMBuildZExt(llvm->builder, val, LLVMInt32Type(), get_name(runtime));
-    val = LLVMBuildBitCast(llvm->builder, val, LLVMFloatType(), get_name(runtime));
-    LLVMBuildStore(llvm->builder, val, regs[i]);
-}
-
-static LLVMBasicBlockRef load_attr(LLVMValueRef dest, size_t i, llvm_prog_t* llvm,
-                                   runtime_t* runtime, LLVMValueRef inv_index) {
-    LLVMValueRef index = LLVMConstInt(LLVMInt32Type(), i, false);
-    
-    LLVMValueRef dtype = LLVMBuildInBoundsGEP(llvm->builder, llvm->attr_dtypes,
-                                              &index, 1, get_name(runtime));
-    dtype = LLVMBuildLoad(llvm->builder, dtype, get_name(runtime));
-    
-    LLVMBasicBlockRef u8_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef i8_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef u16_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef i16_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef u32_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef i32_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef f32_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef f64_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef end_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    
-    LLVMValueRef switch_ = LLVMBuildSwitch(llvm->builder, dtype, end_block, 8);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_UINT8, false), u8_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_INT8, false), i8_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_UINT16, false), u16_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_INT16, false), i16_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_UINT32, false), u32_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_INT32, false), i32_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_FLOAT32, false), f32_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_FLOAT64, false), f64_block);
-    
-    #define LOAD_INT(block, type, signed_, max) {\
-        LLVMPositionBuilderAtEnd(llvm->builder, block);\
-        LLVMValueRef vals = LLVMBuildInBoundsGEP(llvm->builder, llvm->attr_data,\
-                                                 &index, 1, get_name(runtime));\
-        vals = LLVMBuildLoad(llvm->builder, vals, get_name(runtime));\
-        vals = LLVMBuildBitCast(llvm->builder, vals,\
-                                LLVMPointerType(type, 0),\
-                                get_name(runtime));\
-        LLVMValueRef val_ptr = LLVMBuildGEP(llvm->builder, vals,\
-                                            &inv_index, 1, get_name(runtime));\
-        LLVMValueRef val = LLVMBuildLoad(llvm->builder, val_ptr, get_name(runtime));\
-        if (signed_) {\
-            val = LLVMBuildSIToFP(llvm->builder, val, LLVMDoubleType(), get_name(runtime));\
-            val = LLVMBuildFDiv(llvm->builder, val, LLVMConstReal(LLVMDoubleType(), max), get_name(runtime));\
-        } else {\
-            val = LLVMBuildUIToFP(llvm->builder, val, LLVMDoubleType(), get_name(runtime));\
-            val = LLVMBuildFDiv(llvm->builder, val, LLVMConstReal(LLVMDoubleType(), max), get_name(runtime));\
-        }\
-        val = LLVMBuildFPTrunc(llvm->builder, val, LLVMFloatType(), get_name(runtime));\
-        LLVMBuildStore(llvm->builder, val, dest);\
-        LLVMBuildBr(llvm->builder, end_block);\
+static LLVMValueRef load_reg_b(llvm_gen_t* gen, LLVMValueRef* regs, uint8_t i) {
+    runtime_t* runtime = gen->runtime;
+    LLVMTypeRef type = get_vec_type(gen, LLVMInt32TypeInContext(gen->context));
+    LLVMValueRef res = LLVMBuildLoad(gen->builder, regs[i], get_name(runtime));
+    res = LLVMBuildBitCast(gen->builder, res, type, get_name(runtime));
+    return LLVMBuildICmp(gen->builder, LLVMIntNE, res, LLVMConstNull(type), get_name(runtime));
+}
+
+static void store_reg_f(llvm_gen_t* gen, LLVMValueRef* regs, uint8_t i, LLVMValueRef val) {
+    runtime_t* runtime = gen->runtime;
+    if (gen->masked) {
+        LLVMValueRef exec = LLVMBuildLoad(gen->builder, gen->exec_mask, get_name(runtime));
+        LLVMValueRef old = LLVMBuildLoad(gen->builder, regs[i], get_name(runtime));
+        val = LLVMBuildSelect(gen->builder, exec, val, old, get_name(runtime));
     }
-    
-    LOAD_INT(u8_block, LLVMInt8Type(), false, 255);
-    LOAD_INT(i8_block, LLVMInt8Type(), true, 127);
-    LOAD_INT(u16_block, LLVMInt16Type(), false, 65535);
-    LOAD_INT(i16_block, LLVMInt16Type(), true, 32767);
-    LOAD_INT(u32_block, LLVMInt32Type(), false, 4294967295);
-    LOAD_INT(i32_block, LLVMInt32Type(), true, 2147483647);
-    
-    #undef LOAD_INT
-    
-    //ATTR_FLOAT32
-    {
-        LLVMPositionBuilderAtEnd(llvm->builder, f32_block);
-        LLVMValueRef vals = LLVMBuildInBoundsGEP(llvm->builder, llvm->attr_data,
-                                                 &index, 1, get_name(runtime));
-        vals = LLVMBuildLoad(llvm->builder, vals, get_name(runtime));
-        vals = LLVMBuildBitCast(llvm->builder, vals,
-                                LLVMPointerType(LLVMFloatType(), 0),
-                                get_name(runtime));
-        LLVMValueRef val_ptr = LLVMBuildGEP(llvm->builder, vals,
-                                            &inv_index, 1, get_name(runtime));
-        LLVMValueRef val = LLVMBuildLoad(llvm->builder, val_ptr, get_name(runtime));
-        LLVMBuildStore(llvm->builder, val, dest);
-        LLVMBuildBr(llvm->builder, end_block);
+    LLVMBuildStore(gen->builder, val, regs[i]);
+}
+
+static void store_reg_b(llvm_gen_t* gen, LLVMValueRef* regs, uint8_t i, LLVMValueRef val) {
+    runtime_t* runtime = gen->runtime;
+    val = LLVMBuildZExt(gen->builder, val, get_vec_type(gen, LLVMInt32TypeInContext(gen->context)), get_name(runtime));
+    val = LLVMBuildBitCast(gen->builder, val, get_vec_type(gen, LLVMFloatTypeInContext(gen->context)), get_name(runtime));
+    store_reg_f(gen, regs, i, val);
+}
+
+//Sets max to the value 1.0 is stored as for integer dtypes
+static LLVMTypeRef get_attr_type(llvm_gen_t* gen, attr_dtype_t dtype, double* max) {
+    *max = 0.0;
+    switch (dtype) {
+    case ATTR_UINT8: *max = 255; return LLVMInt8TypeInContext(gen->context);
+    case ATTR_INT8: *max = 127; return LLVMInt8TypeInContext(gen->context);
+    case ATTR_UINT16: *max = 65535; return LLVMInt16TypeInContext(gen->context);
+    case ATTR_INT16: *max = 32767; return LLVMInt16TypeInContext(gen->context);
+    case ATTR_UINT32: *max = 4294967295; return LLVMInt32TypeInContext(gen->context);
+    case ATTR_INT32: *max = 2147483647; return LLVMInt32TypeInContext(gen->context);
+    case ATTR_FLOAT32: return LLVMFloatTypeInContext(gen->context);
+    case ATTR_FLOAT64: return LLVMDoubleTypeInContext(gen->context);
     }
+    return NULL;
+}
+
+static bool is_attr_signed(attr_dtype_t dtype) {
+    return dtype==ATTR_INT8 || dtype==ATTR_INT16 || dtype==ATTR_INT32;
+}
+
+//Integer dtypes are scaled in the same precision as the VM scales them
+static LLVMTypeRef get_scale_type(llvm_gen_t* gen, attr_dtype_t dtype) {
+    if (dtype==ATTR_UINT32 || dtype==ATTR_INT32) return LLVMDoubleTypeInContext(gen->context);
+    return LLVMFloatTypeInContext(gen->context);
+}
+
+//Pointer to the value of the particle at index, or to the values of the block
+//beginning at it
+static LLVMValueRef get_attr_ptr(llvm_gen_t* gen, LLVMValueRef data, LLVMTypeRef type,
+                                 LLVMValueRef index) {
+    runtime_t* runtime = gen->runtime;
+    LLVMValueRef vals = LLVMBuildBitCast(gen->builder, data, LLVMPointerType(type, 0), get_name(runtime));
+    LLVMValueRef ptr = LLVMBuildGEP(gen->builder, vals, &index, 1, get_name(runtime));
+    return LLVMBuildBitCast(gen->builder, ptr, LLVMPointerType(get_vec_type(gen, type), 0), get_name(runtime));
+}
+
+static LLVMValueRef load_attr(llvm_gen_t* gen, size_t i, LLVMValueRef index) {
+    runtime_t* runtime = gen->runtime;
+    attr_dtype_t dtype = gen->dtypes[i];
+    double max;
+    LLVMTypeRef type = get_attr_type(gen, dtype, &max);
+    LLVMTypeRef f32 = get_vec_type(gen, LLVMFloatTypeInContext(gen->context));
     
-    //ATTR_FLOAT64
-    {
-        LLVMPositionBuilderAtEnd(llvm->builder, f64_block);
-        LLVMValueRef vals = LLVMBuildInBoundsGEP(llvm->builder, llvm->attr_data,
-                                                 &index, 1, get_name(runtime));
-        vals = LLVMBuildLoad(llvm->builder, vals, get_name(runtime));
-        vals = LLVMBuildBitCast(llvm->builder, vals,
-                                LLVMPointerType(LLVMDoubleType(), 0),
-                                get_name(runtime));
-        LLVMValueRef val_ptr = LLVMBuildGEP(llvm->builder, vals,
-                                            &inv_index, 1, get_name(runtime));
-        LLVMValueRef val = LLVMBuildLoad(llvm->builder, val_ptr, get_name(runtime));
-        val = LLVMBuildFPTrunc(llvm->builder, val, LLVMFloatType(), get_name(runtime));
-        LLVMBuildStore(llvm->builder, val, dest);
-        LLVMBuildBr(llvm->builder, end_block);
-    }
+    LLVMValueRef ptr = get_attr_ptr(gen, gen->load_ptrs[i], type, index);
+    LLVMValueRef val = LLVMBuildLoad(gen->builder, ptr, get_name(runtime));
+    LLVMSetAlignment(val, LLVMABISizeOfType(LLVMGetModuleDataLayout(gen->module), type));
     
-    LLVMPositionBuilderAtEnd(llvm->builder, end_block);
-    return end_block;
-}
-
-static LLVMBasicBlockRef store_attr(LLVMValueRef val, size_t i, llvm_prog_t* llvm,
-                                    runtime_t* runtime, LLVMValueRef inv_index) {
-    LLVMValueRef index = LLVMConstInt(LLVMInt32Type(), i, false);
-    
-    LLVMValueRef dtype = LLVMBuildInBoundsGEP(llvm->builder, llvm->attr_dtypes,
-                                              &index, 1, get_name(runtime));
-    dtype = LLVMBuildLoad(llvm->builder, dtype, get_name(runtime));
-    
-    LLVMBasicBlockRef u8_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef i8_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef u16_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef i16_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef u32_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef i32_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef f32_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef f64_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    LLVMBasicBlockRef end_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    
-    LLVMValueRef switch_ = LLVMBuildSwitch(llvm->builder, dtype, end_block, 8);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_UINT8, false), u8_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_INT8, false), i8_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_UINT16, false), u16_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_INT16, false), i16_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_UINT32, false), u32_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_INT32, false), i32_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_FLOAT32, false), f32_block);
-    LLVMAddCase(switch_, LLVMConstInt(LLVMInt32Type(), ATTR_FLOAT64, false), f64_block);
-    
-    #define STORE_INT(block, type, signed_, max) {\
-        LLVMPositionBuilderAtEnd(llvm->builder, block);\
-        LLVMValueRef vals = LLVMBuildInBoundsGEP(llvm->builder, llvm->attr_data,\
-                                                 &index, 1, get_name(runtime));\
-        vals = LLVMBuildLoad(llvm->builder, vals, get_name(runtime));\
-        vals = LLVMBuildBitCast(llvm->builder, vals,\
-                                LLVMPointerType(type, 0),\
-                                get_name(runtime));\
-        LLVMValueRef dest_ptr = LLVMBuildGEP(llvm->builder, vals,\
-                                             &inv_index, 1, get_name(runtime));\
-        LLVMValueRef new_val = LLVMBuildFPExt(llvm->builder, val, LLVMDoubleType(), get_name(runtime));\
-        new_val = LLVMBuildFMul(llvm->builder, new_val, LLVMConstReal(LLVMDoubleType(), max), get_name(runtime));\
-        if (signed_) new_val = LLVMBuildFPToSI(llvm->builder, new_val, type, get_name(runtime));\
-        else new_val = LLVMBuildFPToUI(llvm->builder, new_val, type, get_name(runtime));\
-        LLVMBuildStore(llvm->builder, new_val, dest_ptr);\
-        LLVMBuildBr(llvm->builder, end_block);\
-    }
+    if (dtype == ATTR_FLOAT32) return val;
+    if (dtype == ATTR_FLOAT64) return LLVMBuildFPTrunc(gen->builder, val, f32, get_name(runtime));
+    
+    LLVMTypeRef scale_type = get_scale_type(gen, dtype);
+    LLVMTypeRef scale_vec_type = get_vec_type(gen, scale_type);
+    if (is_attr_signed(dtype)) val = LLVMBuildSIToFP(gen->builder, val, scale_vec_type, get_name(runtime));
+    else val = LLVMBuildUIToFP(gen->builder, val, scale_vec_type, get_name(runtime));
+    val = LLVMBuildFDiv(gen->builder, val, const_splat(gen, LLVMConstReal(scale_type, max)), get_name(runtime));
+    if (scale_type == LLVMFloatTypeInContext(gen->context)) return val;
+    return LLVMBuildFPTrunc(gen->builder, val, f32, get_name(runtime));
+}
+
+//Only the lanes set in store_mask are written if it is not NULL. Values
+//outside of the range of the dtype saturate, like in the VM.
+static void store_attr(llvm_gen_t* gen, size_t i, LLVMValueRef val, LLVMValueRef index,
+                       LLVMValueRef store_mask) {
+    runtime_t* runtime = gen->runtime;
+    attr_dtype_t dtype = gen->dtypes[i];
+    double max;
+    LLVMTypeRef type = get_attr_type(gen, dtype, &max);
+    LLVMTypeRef f64 = get_vec_type(gen, LLVMDoubleTypeInContext(gen->context));
+    unsigned int align = LLVMABISizeOfType(LLVMGetModuleDataLayout(gen->module), type);
     
-    STORE_INT(u8_block, LLVMInt8Type(), false, 255);
-    STORE_INT(i8_block, LLVMInt8Type(), true, 127);
-    STORE_INT(u16_block, LLVMInt16Type(), false, 65535);
-    STORE_INT(i16_block, LLVMInt16Type(), true, 32767);
-    STORE_INT(u32_block, LLVMInt32Type(), false, 4294967295);
-    STORE_INT(i32_block, LLVMInt32Type(), true, 2147483647);
-    
-    #undef STORE_INT
-    
-    //ATTR_FLOAT32
-    {
-        LLVMPositionBuilderAtEnd(llvm->builder, f32_block);
-        LLVMValueRef vals = LLVMBuildInBoundsGEP(llvm->builder, llvm->attr_data,
-                                                 &index, 1, get_name(runtime));
-        vals = LLVMBuildLoad(llvm->builder, vals, get_name(runtime));
-        vals = LLVMBuildBitCast(llvm->builder, vals,
-                                LLVMPointerType(LLVMFloatType(), 0),
-                                get_name(runtime));
-        LLVMValueRef dest_ptr = LLVMBuildGEP(llvm->builder, vals,
-                                             &inv_index, 1, get_name(runtime));
-        LLVMBuildStore(llvm->builder, val, dest_ptr);
-        LLVMBuildBr(llvm->builder, end_block);
+    if (dtype == ATTR_FLOAT64) {
+        val = LLVMBuildFPExt(gen->builder, val, f64, get_name(runtime));
+    } else if (dtype != ATTR_FLOAT32) {
+        LLVMTypeRef scale_type = get_scale_type(gen, dtype);
+        if (scale_type != LLVMFloatTypeInContext(gen->context))
+            val = LLVMBuildFPExt(gen->builder, val, get_vec_type(gen, scale_type), get_name(runtime));
+        LLVMValueRef min_val = const_splat(gen, LLVMConstReal(scale_type, is_attr_signed(dtype) ? -max-1 : 0));
+        LLVMValueRef max_val = const_splat(gen, LLVMConstReal(scale_type, max));
+        val = LLVMBuildFMul(gen->builder, val, max_val, get_name(runtime));
+        LLVMValueRef below = LLVMBuildFCmp(gen->builder, LLVMRealOLT, val, min_val, get_name(runtime));
+        val = LLVMBuildSelect(gen->builder, below, min_val, val, get_name(runtime));
+        LLVMValueRef above = LLVMBuildFCmp(gen->builder, LLVMRealOGT, val, max_val, get_name(runtime));
+        val = LLVMBuildSelect(gen->builder, above, max_val, val, get_name(runtime));
+        if (is_attr_signed(dtype)) val = LLVMBuildFPToSI(gen->builder, val, get_vec_type(gen, type), get_name(runtime));
+        else val = LLVMBuildFPToUI(gen->builder, val, get_vec_type(gen, type), get_name(runtime));
     }
     
-    //ATTR_FLOAT64
-    {
-        LLVMPositionBuilderAtEnd(llvm->builder, f64_block);
-        LLVMValueRef vals = LLVMBuildInBoundsGEP(llvm->builder, llvm->attr_data,
-                                                 &index, 1, get_name(runtime));
-        vals = LLVMBuildLoad(llvm->builder, vals, get_name(runtime));
-        vals = LLVMBuildBitCast(llvm->builder, vals,
-                                LLVMPointerType(LLVMDoubleType(), 0),
-                                get_name(runtime));
-        LLVMValueRef dest_ptr = LLVMBuildGEP(llvm->builder, vals,
-                                            &inv_index, 1, get_name(runtime));
-        LLVMValueRef new_val = LLVMBuildFPExt(llvm->builder, val, LLVMDoubleType(), get_name(runtime));
-        LLVMBuildStore(llvm->builder, new_val, dest_ptr);
-        LLVMBuildBr(llvm->builder, end_block);
+    LLVMValueRef ptr = get_attr_ptr(gen, gen->store_ptrs[i], type, index);
+    if (store_mask) {
+        LLVMValueRef old = LLVMBuildLoad(gen->builder, ptr, get_name(runtime));
+        LLVMSetAlignment(old, align);
+        val = LLVMBuildSelect(gen->builder, store_mask, val, old, get_name(runtime));
     }
+    LLVMSetAlignment(LLVMBuildStore(gen->builder, val, ptr), align);
+}
+
+//Removes the lanes running the instruction from the rest of the program
+static void finish_lanes(llvm_gen_t* gen) {
+    runtime_t* runtime = gen->runtime;
+    LLVMValueRef exec = LLVMBuildLoad(gen->builder, gen->exec_mask, get_name(runtime));
+    LLVMValueRef finished = LLVMBuildLoad(gen->builder, gen->finished_mask, get_name(runtime));
+    LLVMBuildStore(gen->builder, LLVMBuildOr(gen->builder, finished, exec, get_name(runtime)), gen->finished_mask);
+    LLVMBuildStore(gen->builder, LLVMConstNull(LLVMTypeOf(exec)), gen->exec_mask);
+    gen->masked = true;
+    gen->may_finish = true;
+}
+
+//Restores the lanes which ran the instruction before a block, except for the
+//ones which have finished in it
+static void restore_lanes(llvm_gen_t* gen, LLVMValueRef exec, bool masked) {
+    runtime_t* runtime = gen->runtime;
+    LLVMValueRef finished = LLVMBuildLoad(gen->builder, gen->finished_mask, get_name(runtime));
+    finished = LLVMBuildNot(gen->builder, finished, get_name(runtime));
+    LLVMBuildStore(gen->builder, LLVMBuildAnd(gen->builder, exec, finished, get_name(runtime)), gen->exec_mask);
+    gen->masked = masked || gen->may_finish;
+}
+
+//Calls delete_particle() for each lane running the instruction
+static void build_delete_lanes(llvm_gen_t* gen) {
+    runtime_t* runtime = gen->runtime;
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(gen->context);
+    LLVMValueRef exec = LLVMBuildLoad(gen->builder, gen->exec_mask, get_name(runtime));
+    LLVMValueRef bits = LLVMBuildBitCast(gen->builder, exec, LLVMIntTypeInContext(gen->context, gen->width),
+                                         get_name(runtime));
+    LLVMValueRef bits_var = gen->delete_bits;
+    LLVMBuildStore(gen->builder, LLVMBuildZExt(gen->builder, bits, i32, get_name(runtime)), bits_var);
+    
+    LLVMBasicBlockRef cond_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBasicBlockRef body_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBasicBlockRef end_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBuildBr(gen->builder, cond_block);
     
-    LLVMPositionBuilderAtEnd(llvm->builder, end_block);
-    return end_block;
+    LLVMPositionBuilderAtEnd(gen->builder, cond_block);
+    LLVMValueRef cur = LLVMBuildLoad(gen->builder, bits_var, get_name(runtime));
+    LLVMValueRef cmp_res = LLVMBuildICmp(gen->builder, LLVMIntNE, cur, LLVMConstNull(i32), get_name(runtime));
+    LLVMBuildCondBr(gen->builder, cmp_res, body_block, end_block);
+    
+    LLVMPositionBuilderAtEnd(gen->builder, body_block);
+    LLVMValueRef cttz_args[] = {cur, LLVMConstInt(LLVMIntTypeInContext(gen->context, 1), 1, false)};
+    LLVMValueRef lane = LLVMBuildCall(gen->builder, gen->cttz_func, cttz_args, 2, get_name(runtime));
+    LLVMValueRef args[] = {gen->particles, LLVMBuildAdd(gen->builder, gen->index, lane, get_name(runtime))};
+    LLVMBuildCall(gen->builder, gen->del_particle_func, args, 2, get_name(runtime));
+    LLVMValueRef rest = LLVMBuildSub(gen->builder, cur, LLVMConstInt(i32, 1, false), get_name(runtime));
+    LLVMBuildStore(gen->builder, LLVMBuildAnd(gen->builder, cur, rest, get_name(runtime)), bits_var);
+    LLVMBuildBr(gen->builder, cond_block);
+    
+    LLVMPositionBuilderAtEnd(gen->builder, end_block);
 }
 
-static LLVMBasicBlockRef to_ir(LLVMBasicBlockRef block, program_t* program,
+//Scalar kernels branch to end_block on BC_OP_DELETE and BC_OP_END. Vector
+//kernels run each block for the lanes in exec_mask.
+static LLVMBasicBlockRef to_ir(llvm_gen_t* gen, LLVMBasicBlockRef block,
                                LLVMValueRef* regs, uint8_t* bc, uint8_t* end,
                                LLVMBasicBlockRef end_block) {
-    runtime_t* runtime = program->runtime;
-    llvm_prog_t* llvm = program->backend_internal;
+    runtime_t* runtime = gen->runtime;
     
     while (bc != end) {
-        LLVMPositionBuilderAtEnd(llvm->builder, block);
+        LLVMPositionBuilderAtEnd(gen->builder, block);
         bc_op_t op = *bc++;
         switch (op) {
         case BC_OP_ADD: {
-            LLVMValueRef av = load_reg_f(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_f(program, regs, bc[2]);
-            LLVMValueRef res = LLVMBuildFAdd(llvm->builder, av, bv, get_name(runtime));
-            LLVMBuildStore(llvm->builder, res, regs[bc[0]]);
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
+            LLVMValueRef res = LLVMBuildFAdd(gen->builder, av, bv, get_name(runtime));
+            store_reg_f(gen, regs, bc[0], res);
             bc += 3;
             break;
         }
         case BC_OP_SUB: {
-            LLVMValueRef av = load_reg_f(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_f(program, regs, bc[2]);
-            LLVMValueRef res = LLVMBuildFSub(llvm->builder, av, bv, get_name(runtime));
-            LLVMBuildStore(llvm->builder, res, regs[bc[0]]);
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
+            LLVMValueRef res = LLVMBuildFSub(gen->builder, av, bv, get_name(runtime));
+            store_reg_f(gen, regs, bc[0], res);
             bc += 3;
             break;
         }
         case BC_OP_MUL: {
-            LLVMValueRef av = load_reg_f(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_f(program, regs, bc[2]);
-            LLVMValueRef res = LLVMBuildFMul(llvm->builder, av, bv, get_name(runtime));
-            LLVMBuildStore(llvm->builder, res, regs[bc[0]]);
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
+            LLVMValueRef res = LLVMBuildFMul(gen->builder, av, bv, get_name(runtime));
+            store_reg_f(gen, regs, bc[0], res);
             bc += 3;
             break;
         }
         case BC_OP_DIV: {
-            LLVMValueRef av = load_reg_f(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_f(program, regs, bc[2]);
-            LLVMValueRef res = LLVMBuildFDiv(llvm->builder, av, bv, get_name(runtime));
-            LLVMBuildStore(llvm->builder, res, regs[bc[0]]);
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
+            LLVMValueRef res = LLVMBuildFDiv(gen->builder, av, bv, get_name(runtime));
+            store_reg_f(gen, regs, bc[0], res);
             bc += 3;
             break;
         }
         case BC_OP_POW: {
-            LLVMValueRef av = load_reg_f(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_f(program, regs, bc[2]);
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
             LLVMValueRef args[] = {av, bv};
-            LLVMValueRef res = LLVMBuildCall(llvm->builder, llvm->pow_func, args, 2, get_name(runtime));
-            LLVMBuildStore(llvm->builder, res, regs[bc[0]]);
+            LLVMValueRef res = LLVMBuildCall(gen->builder, gen->pow_func, args, 2, get_name(runtime));
+            store_reg_f(gen, regs, bc[0], res);
             bc += 3;
             break;
         }
@@ -350,100 +460,148 @@ static LLVMBasicBlockRef to_ir(LLVMBasicBlockRef block, program_t* program,
             uint8_t d = *bc++;
             float f = *(float*)bc;
             bc += 4;
-            LLVMBuildStore(llvm->builder, LLVMConstReal(LLVMFloatType(), f), regs[d]);
+            store_reg_f(gen, regs, d, const_splat(gen, LLVMConstReal(LLVMFloatTypeInContext(gen->context), f)));
             break;
         }
         case BC_OP_SQRT: {
-            LLVMValueRef v = load_reg_f(program, regs, bc[1]);
+            LLVMValueRef v = load_reg_f(gen, regs, bc[1]);
             LLVMValueRef args[] = {v};
-            LLVMValueRef res = LLVMBuildCall(llvm->builder, llvm->sqrt_func, args, 1, get_name(runtime));
-            LLVMBuildStore(llvm->builder, res, regs[bc[0]]);
+            LLVMValueRef res = LLVMBuildCall(gen->builder, gen->sqrt_func, args, 1, get_name(runtime));
+            store_reg_f(gen, regs, bc[0], res);
             bc += 2;
             break;
         }
         case BC_OP_DELETE: {
-            LLVMValueRef index = LLVMBuildLoad(llvm->builder, llvm->inv_index, get_name(runtime));
-            LLVMValueRef args[] = {llvm->particles, index};
-            LLVMBuildCall(llvm->builder, llvm->del_particle_func, args, 2, get_name(runtime));
-            
-            LLVMBuildBr(llvm->builder, end_block);
-            block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
+            if (gen->width == 1) {
+                LLVMValueRef args[] = {gen->particles, gen->index};
+                LLVMBuildCall(gen->builder, gen->del_particle_func, args, 2, get_name(runtime));
+                
+                LLVMBuildBr(gen->builder, end_block);
+                block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+            } else {
+                build_delete_lanes(gen);
+                finish_lanes(gen);
+                block = LLVMGetInsertBlock(gen->builder);
+            }
             break;
         }
         case BC_OP_LESS: {
-            LLVMValueRef av = load_reg_f(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_f(program, regs, bc[2]);
-            LLVMValueRef res = LLVMBuildFCmp(llvm->builder, LLVMRealOLT, av, bv, get_name(runtime));
-            store_reg_b(program, regs, bc[0], res);
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
+            LLVMValueRef res = LLVMBuildFCmp(gen->builder, LLVMRealOLT, av, bv, get_name(runtime));
+            store_reg_b(gen, regs, bc[0], res);
             bc += 3;
             break;
         }
         case BC_OP_GREATER: {
-            LLVMValueRef av = load_reg_f(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_f(program, regs, bc[2]);
-            LLVMValueRef res = LLVMBuildFCmp(llvm->builder, LLVMRealOGT, av, bv, get_name(runtime));
-            store_reg_b(program, regs, bc[0], res);
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
+            LLVMValueRef res = LLVMBuildFCmp(gen->builder, LLVMRealOGT, av, bv, get_name(runtime));
+            store_reg_b(gen, regs, bc[0], res);
             bc += 3;
             break;
         }
         case BC_OP_EQUAL: {
-            LLVMValueRef av = load_reg_f(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_f(program, regs, bc[2]);
-            LLVMValueRef res = LLVMBuildFCmp(llvm->builder, LLVMRealOEQ, av, bv, get_name(runtime));
-            store_reg_b(program, regs, bc[0], res);
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
+            LLVMValueRef res = LLVMBuildFCmp(gen->builder, LLVMRealOEQ, av, bv, get_name(runtime));
+            store_reg_b(gen, regs, bc[0], res);
             bc += 3;
             break;
         }
         case BC_OP_BOOL_AND: {
-            LLVMValueRef av = load_reg_b(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_b(program, regs, bc[2]);
-            LLVMValueRef res = LLVMBuildAnd(llvm->builder, av, bv, get_name(runtime));
-            store_reg_b(program, regs, bc[0], res);
+            LLVMValueRef av = load_reg_b(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_b(gen, regs, bc[2]);
+            LLVMValueRef res = LLVMBuildAnd(gen->builder, av, bv, get_name(runtime));
+            store_reg_b(gen, regs, bc[0], res);
             bc += 3;
             break;
         }
         case BC_OP_BOOL_OR: {
-            LLVMValueRef av = load_reg_b(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_b(program, regs, bc[2]);
-            LLVMValueRef res = LLVMBuildOr(llvm->builder, av, bv, get_name(runtime));
-            store_reg_b(program, regs, bc[0], res);
+            LLVMValueRef av = load_reg_b(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_b(gen, regs, bc[2]);
+            LLVMValueRef res = LLVMBuildOr(gen->builder, av, bv, get_name(runtime));
+            store_reg_b(gen, regs, bc[0], res);
             bc += 3;
             break;
         }
         case BC_OP_BOOL_NOT: {
-            LLVMValueRef av = load_reg_b(program, regs, bc[1]);
-            LLVMValueRef bv = LLVMConstInt(LLVMIntType(1), 1, false);
-            LLVMValueRef res = LLVMBuildXor(llvm->builder, av, bv, get_name(runtime));
-            store_reg_b(program, regs, bc[0], res);
+            LLVMValueRef av = load_reg_b(gen, regs, bc[1]);
+            LLVMValueRef res = LLVMBuildNot(gen->builder, av, get_name(runtime));
+            store_reg_b(gen, regs, bc[0], res);
             bc += 2;
             break;
         }
         case BC_OP_SEL: {
-            LLVMValueRef av = load_reg_f(program, regs, bc[1]);
-            LLVMValueRef bv = load_reg_f(program, regs, bc[2]);
-            LLVMValueRef cv = load_reg_b(program, regs, bc[3]);
-            LLVMValueRef res = LLVMBuildSelect(llvm->builder, cv, av, bv, get_name(runtime));
-            LLVMBuildStore(llvm->builder, res, regs[bc[0]]);
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
+            LLVMValueRef cv = load_reg_b(gen, regs, bc[3]);
+            LLVMValueRef res = LLVMBuildSelect(gen->builder, cv, av, bv, get_name(runtime));
+            store_reg_f(gen, regs, bc[0], res);
+            bc += 4;
+            break;
+        }
+        case BC_OP_FMA:
+        case BC_OP_FMS:
+        case BC_OP_FNMA: {
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
+            LLVMValueRef cv = load_reg_f(gen, regs, bc[3]);
+            if (op == BC_OP_FMS)
+                cv = LLVMBuildFNeg(gen->builder, cv, get_name(runtime));
+            else if (op == BC_OP_FNMA)
+                av = LLVMBuildFNeg(gen->builder, av, get_name(runtime));
+            LLVMValueRef args[] = {av, bv, cv};
+            LLVMValueRef res = LLVMBuildCall(gen->builder, gen->fmuladd_func, args, 3, get_name(runtime));
+            store_reg_f(gen, regs, bc[0], res);
             bc += 4;
             break;
         }
+        case BC_OP_SEL_LESS:
+        case BC_OP_SEL_GREATER: {
+            LLVMValueRef av = load_reg_f(gen, regs, bc[1]);
+            LLVMValueRef bv = load_reg_f(gen, regs, bc[2]);
+            LLVMValueRef xv = load_reg_f(gen, regs, bc[3]);
+            LLVMValueRef yv = load_reg_f(gen, regs, bc[4]);
+            LLVMRealPredicate pred = op==BC_OP_SEL_LESS ? LLVMRealOLT : LLVMRealOGT;
+            LLVMValueRef cv = LLVMBuildFCmp(gen->builder, pred, xv, yv, get_name(runtime));
+            LLVMValueRef res = LLVMBuildSelect(gen->builder, cv, av, bv, get_name(runtime));
+            store_reg_f(gen, regs, bc[0], res);
+            bc += 5;
+            break;
+        }
         case BC_OP_COND_BEGIN: {
-            LLVMValueRef cond = load_reg_b(program, regs, *bc++);
+            LLVMValueRef cond = load_reg_b(gen, regs, *bc++);
             uint32_t count = *(uint32_t*)bc;
             bc += 6;
             
-            LLVMBasicBlockRef then_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-            LLVMBasicBlockRef then_block_end = to_ir(then_block, program, regs, bc, bc+count, end_block);
+            //The body is skipped if no lane takes it
+            LLVMValueRef exec = NULL;
+            bool masked = gen->masked;
+            if (gen->width != 1) {
+                exec = LLVMBuildLoad(gen->builder, gen->exec_mask, get_name(runtime));
+                cond = LLVMBuildAnd(gen->builder, exec, cond, get_name(runtime));
+                LLVMBuildStore(gen->builder, cond, gen->exec_mask);
+                cond = build_any(gen, cond);
+                gen->masked = true;
+            }
+            
+            LLVMBasicBlockRef then_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+            LLVMBasicBlockRef then_block_end = to_ir(gen, then_block, regs, bc, bc+count, end_block);
             
-            LLVMBasicBlockRef else_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
+            LLVMBasicBlockRef else_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
             
-            LLVMPositionBuilderAtEnd(llvm->builder, then_block_end);
-            LLVMBuildBr(llvm->builder, else_block);
+            LLVMPositionBuilderAtEnd(gen->builder, then_block_end);
+            LLVMBuildBr(gen->builder, else_block);
             
-            LLVMPositionBuilderAtEnd(llvm->builder, block);
-            LLVMBuildCondBr(llvm->builder, cond, then_block, else_block);
+            LLVMPositionBuilderAtEnd(gen->builder, block);
+            LLVMBuildCondBr(gen->builder, cond, then_block, else_block);
             
             block = else_block;
+            if (exec) {
+                LLVMPositionBuilderAtEnd(gen->builder, block);
+                restore_lanes(gen, exec, masked);
+            }
             
             bc += count;
             break;
@@ -458,25 +616,44 @@ static LLVMBasicBlockRef to_ir(LLVMBasicBlockRef block, program_t* program,
             uint32_t body_count = *(uint32_t*)bc;
             bc += 6;
             
-            LLVMBasicBlockRef cond_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-            LLVMBasicBlockRef cond_block_end = to_ir(cond_block, program, regs, bc, bc+cond_count, end_block);
-            LLVMValueRef cond = load_reg_b(program, regs, c);
+            //Lanes leave the loop once their condition is false
+            LLVMValueRef exec = NULL;
+            bool masked = gen->masked;
+            if (gen->width != 1) {
+                exec = LLVMBuildLoad(gen->builder, gen->exec_mask, get_name(runtime));
+                gen->masked = true;
+            }
+            
+            LLVMBasicBlockRef cond_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+            LLVMBasicBlockRef cond_block_end = to_ir(gen, cond_block, regs, bc, bc+cond_count, end_block);
+            LLVMPositionBuilderAtEnd(gen->builder, cond_block_end);
+            LLVMValueRef cond = load_reg_b(gen, regs, c);
+            if (exec) {
+                LLVMValueRef loop_exec = LLVMBuildLoad(gen->builder, gen->exec_mask, get_name(runtime));
+                cond = LLVMBuildAnd(gen->builder, loop_exec, cond, get_name(runtime));
+                LLVMBuildStore(gen->builder, cond, gen->exec_mask);
+                cond = build_any(gen, cond);
+            }
             
-            LLVMBasicBlockRef body_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-            LLVMBasicBlockRef body_block_end = to_ir(body_block, program, regs, bc+cond_count, bc+cond_count+body_count, end_block);
+            LLVMBasicBlockRef body_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+            LLVMBasicBlockRef body_block_end = to_ir(gen, body_block, regs, bc+cond_count, bc+cond_count+body_count, end_block);
             
-            LLVMBasicBlockRef new_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
+            LLVMBasicBlockRef new_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
             
-            LLVMPositionBuilderAtEnd(llvm->builder, body_block_end);
-            LLVMBuildBr(llvm->builder, cond_block);
+            LLVMPositionBuilderAtEnd(gen->builder, body_block_end);
+            LLVMBuildBr(gen->builder, cond_block);
             
-            LLVMPositionBuilderAtEnd(llvm->builder, block);
-            LLVMBuildBr(llvm->builder, cond_block);
+            LLVMPositionBuilderAtEnd(gen->builder, block);
+            LLVMBuildBr(gen->builder, cond_block);
             
-            LLVMPositionBuilderAtEnd(llvm->builder, cond_block_end);
-            LLVMBuildCondBr(llvm->builder, cond, body_block, new_block);
+            LLVMPositionBuilderAtEnd(gen->builder, cond_block_end);
+            LLVMBuildCondBr(gen->builder, cond, body_block, new_block);
             
             block = new_block;
+            if (exec) {
+                LLVMPositionBuilderAtEnd(gen->builder, block);
+                restore_lanes(gen, exec, masked);
+            }
             
             bc += cond_count + body_count;
             break;
@@ -488,39 +665,57 @@ static LLVMBasicBlockRef to_ir(LLVMBasicBlockRef block, program_t* program,
             break;
         }
         case BC_OP_END: {
-            LLVMBuildBr(llvm->builder, end_block);
-            block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
+            if (gen->width == 1) {
+                LLVMBuildBr(gen->builder, end_block);
+                block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+            } else {
+                finish_lanes(gen);
+            }
             break;
         }
         case BC_OP_EMIT: {
-            LLVMValueRef particle_index = LLVMBuildCall(llvm->builder, llvm->spawn_particle_func,
-                                                        &llvm->particles, 1, get_name(runtime));
-            //TODO: Check if index < 0
+            LLVMValueRef particle_index = LLVMBuildCall(gen->builder, gen->spawn_particle_func,
+                                                        &gen->particles, 1, get_name(runtime));
             
+            //The emitter fails once the pool is full, like in the VM
+            LLVMValueRef zero = LLVMConstNull(LLVMTypeOf(particle_index));
+            LLVMValueRef spawned = LLVMBuildICmp(gen->builder, LLVMIntSGE, particle_index, zero, get_name(runtime));
+            block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+            LLVMBuildCondBr(gen->builder, spawned, block, gen->fail_block);
+            
+            LLVMPositionBuilderAtEnd(gen->builder, block);
             uint8_t count = *bc++;
-            for (size_t i = 0; i < count; i++) {
-                LLVMValueRef val = LLVMBuildLoad(llvm->builder, regs[*bc++], get_name(runtime));
-                block = store_attr(val, i, llvm, runtime, particle_index);
-            }
+            for (size_t i = 0; i < count; i++)
+                store_attr(gen, i, load_reg_f(gen, regs, *bc++), particle_index, NULL);
             break;
         }
         case BC_OP_RAND: {
-            LLVMValueRef v = LLVMBuildCall(llvm->builder, llvm->randf_func, NULL, 0, get_name(runtime));
-            LLVMBuildStore(llvm->builder, v, regs[bc[0]]);
+            LLVMValueRef counter = LLVMBuildLoad(gen->builder, gen->rand_counter, get_name(runtime));
+            LLVMValueRef v = build_rand_float(gen, gen->lane_index, counter);
+            store_reg_f(gen, regs, bc[0], v);
+            
+            //Lanes only advance their counter when they are active
+            LLVMValueRef inc = const_splat(gen, LLVMConstInt(LLVMInt32TypeInContext(gen->context), 1, false));
+            if (gen->width != 1) {
+                LLVMValueRef exec = LLVMBuildLoad(gen->builder, gen->exec_mask, get_name(runtime));
+                inc = LLVMBuildZExt(gen->builder, exec, LLVMTypeOf(counter), get_name(runtime));
+            }
+            LLVMValueRef next = LLVMBuildAdd(gen->builder, counter, inc, get_name(runtime));
+            LLVMBuildStore(gen->builder, next, gen->rand_counter);
             bc += 1;
             break;
         }
         case BC_OP_FLOOR: {
-            LLVMValueRef v = LLVMBuildLoad(llvm->builder, regs[bc[1]], get_name(runtime));
+            LLVMValueRef v = load_reg_f(gen, regs, bc[1]);
             LLVMValueRef args[] = {v};
-            LLVMValueRef res = LLVMBuildCall(llvm->builder, llvm->floor_func, args, 1, get_name(runtime));
-            LLVMBuildStore(llvm->builder, res, regs[bc[0]]);
+            LLVMValueRef res = LLVMBuildCall(gen->builder, gen->floor_func, args, 1, get_name(runtime));
+            store_reg_f(gen, regs, bc[0], res);
             bc += 2;
             break;
         }
         case BC_OP_MOV: {
-            LLVMValueRef v = LLVMBuildLoad(llvm->builder, regs[bc[1]], get_name(runtime));
-            LLVMBuildStore(llvm->builder, v, regs[bc[0]]);
+            LLVMValueRef v = load_reg_f(gen, regs, bc[1]);
+            store_reg_f(gen, regs, bc[0], v);
             bc += 2;
             break;
         }
@@ -530,308 +725,800 @@ static LLVMBasicBlockRef to_ir(LLVMBasicBlockRef block, program_t* program,
     return block;
 }
 
-static void create_body_block(program_t* program, LLVMBasicBlockRef body_block,
-                              LLVMValueRef* regs, LLVMBasicBlockRef end_block) {
-    runtime_t* runtime = program->runtime;
-    llvm_prog_t* llvm = program->backend_internal;
-    
-    LLVMBasicBlockRef store_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-    
-    LLVMPositionBuilderAtEnd(llvm->builder, body_block);
-    
-    LLVMValueRef inv_index;
-    if (program->type == PROGRAM_TYPE_SIMULATION) {
-        inv_index = LLVMBuildLoad(llvm->builder, llvm->inv_index, get_name(runtime));
+static void load_uniforms(llvm_gen_t* gen, LLVMValueRef* regs) {
+    runtime_t* runtime = gen->runtime;
+    program_t* program = gen->program;
+    for (size_t i = 0; i < program->uniform_count; i++) {
+        if (gen->constant_uniforms) {
+            LLVMValueRef val = LLVMConstReal(LLVMFloatTypeInContext(gen->context), gen->constant_uniforms[i]);
+            LLVMBuildStore(gen->builder, const_splat(gen, val), regs[program->uniform_regs[i]]);
+            continue;
+        }
         
-        LLVMValueRef del_flag = LLVMBuildGEP(llvm->builder, llvm->del_flags,
-                                             &inv_index, 1, get_name(runtime));
-        LLVMValueRef cmp_res = LLVMBuildICmp(llvm->builder, LLVMIntNE,
-                                             LLVMBuildLoad(llvm->builder, del_flag, get_name(runtime)),
-                                             LLVMConstInt(LLVMInt8Type(), 0, false),
-                                             get_name(runtime));
+        LLVMValueRef index = LLVMConstInt(LLVMInt32TypeInContext(gen->context), i, false);
         
-        LLVMBasicBlockRef new_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-        LLVMBuildCondBr(llvm->builder, cmp_res, end_block, new_block);
-        body_block = new_block;
+        LLVMValueRef val_ptr = LLVMBuildGEP(gen->builder, gen->uniforms,
+                                            &index, 1, get_name(runtime));
+        LLVMValueRef val = LLVMBuildLoad(gen->builder, val_ptr, get_name(runtime));
+        LLVMBuildStore(gen->builder, build_splat(gen, val), regs[program->uniform_regs[i]]);
+    }
+}
+
+//Attribute pointers do not change during a call, so they are loaded once
+static void load_attr_ptrs(llvm_gen_t* gen, LLVMValueRef attr_data) {
+    runtime_t* runtime = gen->runtime;
+    for (size_t i = 0; i < gen->program->attribute_count; i++) {
+        LLVMValueRef index = LLVMConstInt(LLVMInt32TypeInContext(gen->context), i, false);
+        LLVMValueRef ptr = LLVMBuildInBoundsGEP(gen->builder, attr_data, &index, 1, get_name(runtime));
+        gen->load_ptrs[i] = LLVMBuildLoad(gen->builder, ptr, get_name(runtime));
+        
+        index = LLVMConstInt(LLVMInt32TypeInContext(gen->context), 256+i, false);
+        ptr = LLVMBuildInBoundsGEP(gen->builder, attr_data, &index, 1, get_name(runtime));
+        gen->store_ptrs[i] = LLVMBuildLoad(gen->builder, ptr, get_name(runtime));
     }
+}
+
+//Runs the program for blocks of gen->width particles. Blocks begin at
+//multiples of the width, so a block never crosses a THREAD_CHUNK_ALIGN chunk
+//and may extend past begin..end-1. Lanes outside of it are neither run nor
+//stored.
+static void create_sim_func(llvm_gen_t* gen, const char* name) {
+    runtime_t* runtime = gen->runtime;
+    program_t* program = gen->program;
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(gen->context);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(gen->context);
+    LLVMTypeRef mask_type = get_vec_type(gen, LLVMIntTypeInContext(gen->context, 1));
     
-    //Load attributes
-    LLVMPositionBuilderAtEnd(llvm->builder, body_block);
+    LLVMTypeRef param_types[7] = {i32, //int begin
+                                  i32, //int end
+                                  LLVMPointerType(LLVMFloatTypeInContext(gen->context), 0), //float* uniforms
+                                  LLVMPointerType(LLVMPointerType(LLVMInt8TypeInContext(gen->context), 0), 0), //void** attr_data //presorted, stores use the second 256
+                                  LLVMPointerType(i64, 0), //uint64_t* live_bits
+                                  LLVMPointerType(i32, 0), //particles_t* particles
+                                  i32}; //uint32_t rand_key
+    LLVMTypeRef ret_type = LLVMFunctionType(i32, param_types, 7, 0);
+    gen->main_func = LLVMAddFunction(gen->module, name, ret_type);
     
-    if (program->type == PROGRAM_TYPE_SIMULATION)
-        for (size_t i = 0; i < program->attribute_count; i++)
-            body_block = load_attr(regs[program->attribute_load_regs[i]], i, llvm,
-                                   runtime, inv_index);
+    LLVMValueRef begin = LLVMGetParam(gen->main_func, 0);
+    LLVMValueRef end = LLVMGetParam(gen->main_func, 1);
+    gen->uniforms = LLVMGetParam(gen->main_func, 2);
+    LLVMValueRef attr_data = LLVMGetParam(gen->main_func, 3);
+    gen->live_bits = LLVMGetParam(gen->main_func, 4);
+    gen->particles = LLVMGetParam(gen->main_func, 5);
     
-    //Load uniforms
-    for (size_t i = 0; i < program->uniform_count; i++) {
-        LLVMValueRef index = LLVMConstInt(LLVMInt32Type(), i, false);
-        
-        LLVMValueRef val_ptr = LLVMBuildGEP(llvm->builder, llvm->uniforms,
-                                            &index, 1, get_name(runtime));
-        LLVMValueRef val = LLVMBuildLoad(llvm->builder, val_ptr, get_name(runtime));
-        LLVMBuildStore(llvm->builder, val, regs[program->uniform_regs[i]]);
-    }
+    LLVMBasicBlockRef init_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBasicBlockRef cond_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBasicBlockRef body_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBasicBlockRef run_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBasicBlockRef store_full_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBasicBlockRef store_edge_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBasicBlockRef next_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBasicBlockRef end_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
     
-    uint8_t* bc = program->bc;
-    uint8_t* end = bc + program->bc_size;
-    body_block = to_ir(body_block, program, regs, bc, end, store_block);
+    //Initialization block
+    LLVMPositionBuilderAtEnd(gen->builder, init_block);
     
-    LLVMPositionBuilderAtEnd(llvm->builder, body_block);
-    LLVMBuildBr(llvm->builder, store_block);
+    LLVMValueRef regs[256];
+    for (size_t i = 0; i < 256; i++)
+        regs[i] = LLVMBuildAlloca(gen->builder, get_vec_type(gen, LLVMFloatTypeInContext(gen->context)), get_reg_name(i));
+    gen->rand_counter = LLVMBuildAlloca(gen->builder, get_vec_type(gen, i32), "rand_counter");
+    gen->exec_mask = LLVMBuildAlloca(gen->builder, mask_type, "exec_mask");
+    gen->finished_mask = LLVMBuildAlloca(gen->builder, mask_type, "finished_mask");
+    gen->delete_bits = LLVMBuildAlloca(gen->builder, i32, "delete_bits");
+    gen->rand_key = build_splat(gen, LLVMGetParam(gen->main_func, 6));
+    load_attr_ptrs(gen, attr_data);
     
-    //Store attributes
-    LLVMPositionBuilderAtEnd(llvm->builder, store_block);
+    LLVMValueRef lanes[LLVM_MAX_WIDTH];
+    for (size_t i = 0; i < gen->width; i++)
+        lanes[i] = LLVMConstInt(i32, i, false);
+    LLVMValueRef lane_offsets = LLVMConstVector(lanes, gen->width);
+    LLVMValueRef begin_vec = build_splat(gen, begin);
+    LLVMValueRef end_vec = build_splat(gen, end);
     
-    if (program->type == PROGRAM_TYPE_SIMULATION) {
-        for (size_t i = 0; i < program->attribute_count; i++) {
-            LLVMValueRef val = LLVMBuildLoad(llvm->builder, regs[program->attribute_store_regs[i]], get_name(runtime));
-            body_block = store_attr(val, i, llvm, runtime, inv_index);
-        }
+    LLVMValueRef i = LLVMBuildAlloca(gen->builder, i32, "i");
+    LLVMValueRef first = LLVMBuildAnd(gen->builder, begin, LLVMConstInt(i32, ~(gen->width-1), false), get_name(runtime));
+    LLVMBuildStore(gen->builder, first, i);
+    LLVMBuildBr(gen->builder, cond_block);
+    
+    //Condition block
+    LLVMPositionBuilderAtEnd(gen->builder, cond_block);
+    gen->index = LLVMBuildLoad(gen->builder, i, get_name(runtime));
+    LLVMValueRef cmp_res = LLVMBuildICmp(gen->builder, LLVMIntULT, gen->index, end, get_name(runtime));
+    LLVMBuildCondBr(gen->builder, cmp_res, body_block, end_block);
+    
+    //Body block. Lanes which are dead or outside of begin..end-1 are skipped.
+    LLVMPositionBuilderAtEnd(gen->builder, body_block);
+    gen->lane_index = LLVMBuildAdd(gen->builder, build_splat(gen, gen->index), lane_offsets, get_name(runtime));
+    LLVMValueRef in_range = LLVMBuildAnd(gen->builder,
+                                         LLVMBuildICmp(gen->builder, LLVMIntUGE, gen->lane_index, begin_vec, get_name(runtime)),
+                                         LLVMBuildICmp(gen->builder, LLVMIntULT, gen->lane_index, end_vec, get_name(runtime)),
+                                         get_name(runtime));
+    
+    LLVMValueRef index = LLVMBuildZExt(gen->builder, gen->index, i64, get_name(runtime));
+    LLVMValueRef word_index = LLVMBuildLShr(gen->builder, index, LLVMConstInt(i64, 6, false), get_name(runtime));
+    LLVMValueRef word_ptr = LLVMBuildGEP(gen->builder, gen->live_bits, &word_index, 1, get_name(runtime));
+    LLVMValueRef word = LLVMBuildLoad(gen->builder, word_ptr, get_name(runtime));
+    LLVMSetOrdering(word, LLVMAtomicOrderingMonotonic);
+    LLVMSetAlignment(word, 8);
+    LLVMValueRef shift = LLVMBuildAnd(gen->builder, index, LLVMConstInt(i64, 63, false), get_name(runtime));
+    LLVMValueRef bits = LLVMBuildTrunc(gen->builder, LLVMBuildLShr(gen->builder, word, shift, get_name(runtime)),
+                                       LLVMIntTypeInContext(gen->context, gen->width), get_name(runtime));
+    LLVMValueRef live = LLVMBuildBitCast(gen->builder, bits, mask_type, get_name(runtime));
+    LLVMValueRef mask = LLVMBuildAnd(gen->builder, in_range, live, get_name(runtime));
+    LLVMValueRef block_end = LLVMBuildAdd(gen->builder, gen->index, LLVMConstInt(i32, gen->width, false), get_name(runtime));
+    LLVMBuildCondBr(gen->builder, build_any(gen, mask), run_block, next_block);
+    
+    //Run block
+    LLVMPositionBuilderAtEnd(gen->builder, run_block);
+    LLVMBuildStore(gen->builder, mask, gen->exec_mask);
+    LLVMBuildStore(gen->builder, LLVMConstNull(mask_type), gen->finished_mask);
+    LLVMBuildStore(gen->builder, LLVMConstNull(get_vec_type(gen, i32)), gen->rand_counter);
+    gen->masked = false;
+    gen->may_finish = false;
+    
+    for (size_t j = 0; j < program->attribute_count; j++)
+        LLVMBuildStore(gen->builder, load_attr(gen, j, gen->index), regs[program->attribute_load_regs[j]]);
+    load_uniforms(gen, regs);
+    
+    LLVMBasicBlockRef block = to_ir(gen, run_block, regs, program->bc, program->bc+program->bc_size, NULL);
+    
+    //Blocks entirely inside of begin..end-1 are stored whole
+    LLVMPositionBuilderAtEnd(gen->builder, block);
+    LLVMValueRef full = LLVMBuildAnd(gen->builder,
+                                     LLVMBuildICmp(gen->builder, LLVMIntUGE, gen->index, begin, get_name(runtime)),
+                                     LLVMBuildICmp(gen->builder, LLVMIntULE, block_end, end, get_name(runtime)),
+                                     get_name(runtime));
+    LLVMBuildCondBr(gen->builder, full, store_full_block, store_edge_block);
+    
+    LLVMPositionBuilderAtEnd(gen->builder, store_full_block);
+    for (size_t j = 0; j < program->attribute_count; j++)
+        store_attr(gen, j, load_reg_f(gen, regs, program->attribute_store_regs[j]), gen->index, NULL);
+    LLVMBuildBr(gen->builder, next_block);
+    
+    LLVMPositionBuilderAtEnd(gen->builder, store_edge_block);
+    for (size_t j = 0; j < program->attribute_count; j++)
+        store_attr(gen, j, load_reg_f(gen, regs, program->attribute_store_regs[j]), gen->index, in_range);
+    LLVMBuildBr(gen->builder, next_block);
+    
+    //Next block
+    LLVMPositionBuilderAtEnd(gen->builder, next_block);
+    LLVMBuildStore(gen->builder, block_end, i);
+    LLVMBuildBr(gen->builder, cond_block);
+    
+    //End block
+    LLVMPositionBuilderAtEnd(gen->builder, end_block);
+    LLVMBuildRet(gen->builder, LLVMConstInt(i32, 0, false));
+}
+
+static void create_emit_func(llvm_gen_t* gen, const char* name) {
+    runtime_t* runtime = gen->runtime;
+    program_t* program = gen->program;
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(gen->context);
+    
+    LLVMTypeRef param_types[4] = {LLVMPointerType(LLVMFloatTypeInContext(gen->context), 0), //float* uniforms
+                                  LLVMPointerType(i32, 0), //particles_t* particles
+                                  LLVMPointerType(LLVMPointerType(LLVMInt8TypeInContext(gen->context), 0), 0), //void** attr_data //presorted, stores use the second 256
+                                  i32}; //uint32_t rand_key
+    LLVMTypeRef ret_type = LLVMFunctionType(i32, param_types, 4, 0);
+    gen->main_func = LLVMAddFunction(gen->module, name, ret_type);
+    
+    gen->uniforms = LLVMGetParam(gen->main_func, 0);
+    gen->particles = LLVMGetParam(gen->main_func, 1);
+    gen->rand_key = LLVMGetParam(gen->main_func, 3);
+    gen->lane_index = LLVMConstInt(i32, 0, false);
+    
+    LLVMBasicBlockRef block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    LLVMBasicBlockRef end_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    gen->fail_block = LLVMAppendBasicBlockInContext(gen->context, gen->main_func, get_name(runtime));
+    
+    LLVMPositionBuilderAtEnd(gen->builder, block);
+    LLVMValueRef regs[256];
+    for (size_t i = 0; i < 256; i++)
+        regs[i] = LLVMBuildAlloca(gen->builder, LLVMFloatTypeInContext(gen->context), get_reg_name(i));
+    gen->rand_counter = LLVMBuildAlloca(gen->builder, i32, "rand_counter");
+    LLVMBuildStore(gen->builder, LLVMConstInt(i32, 0, false), gen->rand_counter);
+    load_attr_ptrs(gen, LLVMGetParam(gen->main_func, 2));
+    load_uniforms(gen, regs);
+    
+    block = to_ir(gen, block, regs, program->bc, program->bc+program->bc_size, end_block);
+    LLVMPositionBuilderAtEnd(gen->builder, block);
+    LLVMBuildBr(gen->builder, end_block);
+    
+    LLVMPositionBuilderAtEnd(gen->builder, end_block);
+    LLVMBuildRet(gen->builder, LLVMConstInt(i32, 1, false));
+    
+    LLVMPositionBuilderAtEnd(gen->builder, gen->fail_block);
+    LLVMBuildRet(gen->builder, LLVMConstInt(i32, 0, false));
+}
+
+static bool set_llvm_error(runtime_t* runtime, LLVMErrorRef error) {
+    char* message = LLVMGetErrorMessage(error);
+    set_error(runtime, message);
+    LLVMDisposeErrorMessage(message);
+    return false;
+}
+
+//FNV-1a
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash^bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+static void get_kernel_name(char* name, size_t size, uint64_t key) {
+    snprintf(name, size, "k%016" PRIx64, key);
+}
+
+static void get_cache_path(char* path, size_t size, llvm_backend_t* backend, uint64_t key) {
+    snprintf(path, size, "%s/%016" PRIx64 ".o", backend->cache_dir, key);
+}
+
+//Returns NULL if the object is not cached
+static LLVMMemoryBufferRef load_cached_object(llvm_backend_t* backend, uint64_t key) {
+    if (!backend->cache_dir) return NULL;
+    char path[4096];
+    get_cache_path(path, sizeof(path), backend, key);
+    if (access(path, R_OK)) return NULL;
+    
+    LLVMMemoryBufferRef object = NULL;
+    char* error = NULL;
+    if (LLVMCreateMemoryBufferWithContentsOfFile(path, &object, &error)) {
+        LLVMDisposeMessage(error);
+        return NULL;
     }
+    return object;
+}
+
+//The object is written to a temporary file which is then renamed, so other
+//processes never load a partial object. Failing to cache is not an error.
+static void store_cached_object(runtime_t* runtime, uint64_t key, LLVMMemoryBufferRef object) {
+    llvm_backend_t* backend = runtime->backend.internal;
+    if (!backend->cache_dir) return;
+    char path[4096];
+    char temp_path[4200];
+    get_cache_path(path, sizeof(path), backend, key);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.%s.tmp", path, (int)getpid(), get_name(runtime));
     
-    LLVMBuildBr(llvm->builder, end_block);
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) return;
+    size_t size = LLVMGetBufferSize(object);
+    bool success = fwrite(LLVMGetBufferStart(object), 1, size, file) == size;
+    success = !fclose(file) && success;
+    if (!success || rename(temp_path, path)) remove(temp_path);
 }
 
-static bool create_module(program_t* program) {
+//Compiles the program for attributes of the dtypes into an object file.
+//Returns NULL on failure.
+static LLVMMemoryBufferRef compile_kernel(program_t* program, const uint8_t* dtypes,
+                                          const float* uniforms, uint64_t key) {
     runtime_t* runtime = program->runtime;
-    llvm_prog_t* llvm = program->backend_internal;
-    
-    llvm->module = LLVMModuleCreateWithName(get_name(program->runtime));
-    llvm->builder = LLVMCreateBuilder();
-    
-    llvm->floor_func = get_intrinsic1(llvm->module, "llvm.floor.f32");
-    llvm->sqrt_func = get_intrinsic1(llvm->module, "llvm.sqrt.f32");
-    llvm->pow_func = get_intrinsic2(llvm->module, "llvm.pow.f32");
-    llvm->del_particle_func = get_del_particle_func(llvm->module);
-    llvm->spawn_particle_func = get_spawn_particle_func(llvm->module);
-    llvm->randf_func = get_randf_func(llvm->module);
-    
-    if (program->type == PROGRAM_TYPE_SIMULATION) {
-        LLVMTypeRef param_types[7] = {LLVMInt32Type(), //int begin
-                                      LLVMInt32Type(), //int end
-                                      LLVMPointerType(LLVMFloatType(), 0), //float* uniforms
-                                      LLVMPointerType(LLVMPointerType(LLVMInt32Type(), 0), 0), //int**, attr_data //presorted
-                                      LLVMPointerType(LLVMInt32Type(), 0), //int* attr_dtypes //presorted
-                                      LLVMPointerType(LLVMIntType(8), 0), //int8* deleted_flags
-                                      LLVMPointerType(LLVMInt32Type(), 0)}; //particles_t* particles
-        LLVMTypeRef ret_type = LLVMFunctionType(LLVMInt32Type(), param_types, 7, 0);
-        llvm->main_func = LLVMAddFunction(llvm->module, get_name(runtime), ret_type);
-        
-        LLVMValueRef begin = LLVMGetParam(llvm->main_func, 0);
-        LLVMValueRef end = LLVMGetParam(llvm->main_func, 1);
-        llvm->uniforms = LLVMGetParam(llvm->main_func, 2);
-        llvm->attr_data = LLVMGetParam(llvm->main_func, 3);
-        llvm->attr_dtypes = LLVMGetParam(llvm->main_func, 4);
-        llvm->del_flags = LLVMGetParam(llvm->main_func, 5);
-        llvm->particles = LLVMGetParam(llvm->main_func, 6);
-        
-        LLVMBasicBlockRef init_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-        LLVMBasicBlockRef cond_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-        LLVMBasicBlockRef body_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-        LLVMBasicBlockRef end_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-        LLVMBasicBlockRef end_body_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-        
-        //Initialization block
-        LLVMPositionBuilderAtEnd(llvm->builder, init_block);
-        
-        LLVMValueRef regs[256];
-        for (size_t i = 0; i < 256; i++)
-            regs[i] = LLVMBuildAlloca(llvm->builder, LLVMFloatType(), get_reg_name(i));
-        
-        LLVMValueRef i = LLVMBuildAlloca(llvm->builder, LLVMInt32Type(), "i");
-        LLVMBuildStore(llvm->builder, begin, i);
-        llvm->inv_index = i;
-        
-        LLVMBuildBr(llvm->builder, cond_block);
-        
-        //Condition block
-        LLVMPositionBuilderAtEnd(llvm->builder, cond_block);
-        
-        LLVMValueRef cmp_res = LLVMBuildICmp(llvm->builder, LLVMIntULT,
-                                             LLVMBuildLoad(llvm->builder, i, get_name(runtime)),
-                                             end,
-                                             get_name(runtime));
-        
-        LLVMBuildCondBr(llvm->builder, cmp_res, body_block, end_block);
-        
-        //Body block
-        create_body_block(program, body_block, regs, end_body_block);
-        
-        //End body block
-        LLVMPositionBuilderAtEnd(llvm->builder, end_body_block);
-        LLVMValueRef a = LLVMBuildLoad(llvm->builder, i, get_name(runtime));
-        LLVMValueRef b = LLVMConstInt(LLVMInt32Type(), 1, false);
-        LLVMBuildStore(llvm->builder, LLVMBuildAdd(llvm->builder, a, b, get_name(runtime)), i);
-        LLVMBuildBr(llvm->builder, cond_block);
-        
-        //End block
-        LLVMPositionBuilderAtEnd(llvm->builder, end_block);
-        LLVMBuildRet(llvm->builder, LLVMConstInt(LLVMInt32Type(), 0, false));
-    } else {
-        LLVMTypeRef param_types[4] = {LLVMPointerType(LLVMFloatType(), 0), //float* uniforms
-                                      LLVMPointerType(LLVMInt32Type(), 0), //particles_t* particles
-                                      LLVMPointerType(LLVMPointerType(LLVMInt32Type(), 0), 0), //int**, attr_data //presorted
-                                      LLVMPointerType(LLVMInt32Type(), 0)}; //int* attr_dtypes //presorted
-        LLVMTypeRef ret_type = LLVMFunctionType(LLVMInt32Type(), param_types, 4, 0);
-        llvm->main_func = LLVMAddFunction(llvm->module, get_name(runtime), ret_type);
-        
-        llvm->uniforms = LLVMGetParam(llvm->main_func, 0);
-        llvm->particles = LLVMGetParam(llvm->main_func, 1);
-        llvm->attr_data = LLVMGetParam(llvm->main_func, 2);
-        llvm->attr_dtypes = LLVMGetParam(llvm->main_func, 3);
-        
-        LLVMBasicBlockRef block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-        LLVMBasicBlockRef end_block = LLVMAppendBasicBlock(llvm->main_func, get_name(runtime));
-        
-        LLVMPositionBuilderAtEnd(llvm->builder, block);
-        LLVMValueRef regs[256];
-        for (size_t i = 0; i < 256; i++)
-            regs[i] = LLVMBuildAlloca(llvm->builder, LLVMFloatType(), get_reg_name(i));
-        create_body_block(program, block, regs, end_block);
-        
-        LLVMPositionBuilderAtEnd(llvm->builder, end_block);
-        LLVMBuildRet(llvm->builder, LLVMConstInt(LLVMInt32Type(), 0, false));
-    }
+    llvm_backend_t* backend = runtime->backend.internal;
     
     char* error = NULL;
-    LLVMVerifyModule(llvm->module, LLVMAbortProcessAction, &error);
+    char* triple = LLVMGetDefaultTargetTriple();
+    LLVMTargetRef target;
+    if (LLVMGetTargetFromTriple(triple, &target, &error)) {
+        char new_error[1024];
+        strncpy(new_error, error, sizeof(new_error)-1);
+        new_error[sizeof(new_error)-1] = 0;
+        LLVMDisposeMessage(error);
+        LLVMDisposeMessage(triple);
+        set_error(runtime, new_error);
+        return NULL;
+    }
+    //Kernels are compiled for the host CPU
+    LLVMTargetMachineRef target_machine = LLVMCreateTargetMachine(target, triple, backend->cpu, backend->features,
+                                                                  LLVMCodeGenLevelAggressive, LLVMRelocDefault,
+                                                                  LLVMCodeModelJITDefault);
+    
+    //Each kernel has its own context so that kernels can be compiled concurrently
+    llvm_gen_t gen;
+    memset(&gen, 0, sizeof(gen));
+    gen.program = program;
+    gen.runtime = runtime;
+    gen.dtypes = dtypes;
+    gen.constant_uniforms = uniforms;
+    gen.width = program->type==PROGRAM_TYPE_SIMULATION ? backend->width : 1;
+    gen.context = LLVMContextCreate();
+    gen.module = LLVMModuleCreateWithNameInContext(get_name(runtime), gen.context);
+    gen.builder = LLVMCreateBuilderInContext(gen.context);
+    LLVMSetTarget(gen.module, triple);
+    LLVMTargetDataRef data_layout = LLVMCreateTargetDataLayout(target_machine);
+    LLVMSetModuleDataLayout(gen.module, data_layout);
+    LLVMDisposeTargetData(data_layout);
+    LLVMDisposeMessage(triple);
+    
+    gen.floor_func = get_intrinsic(&gen, "llvm.floor", 1);
+    gen.sqrt_func = get_intrinsic(&gen, "llvm.sqrt", 1);
+    gen.pow_func = get_intrinsic(&gen, "llvm.pow", 2);
+    gen.fmuladd_func = get_intrinsic(&gen, "llvm.fmuladd", 3);
+    gen.cttz_func = get_cttz_func(gen.module);
+    gen.del_particle_func = get_del_particle_func(gen.module);
+    gen.spawn_particle_func = get_spawn_particle_func(gen.module);
+    
+    char name[64];
+    get_kernel_name(name, sizeof(name), key);
+    if (program->type == PROGRAM_TYPE_SIMULATION) create_sim_func(&gen, name);
+    else create_emit_func(&gen, name);
+    
+    LLVMAddTargetDependentFunctionAttr(gen.main_func, "target-cpu", backend->cpu);
+    LLVMAddTargetDependentFunctionAttr(gen.main_func, "target-features", backend->features);
+    
+    LLVMVerifyModule(gen.module, LLVMAbortProcessAction, &error);
     LLVMDisposeMessage(error);
     
-    //Optimize
-    if (LLVMWriteBitcodeToFile(llvm->module, "test.bc"))
-        printf("Error writing bitcode\n");
-    LLVMDisposeBuilder(llvm->builder);
-    llvm->opt_module = LLVMModuleCreateWithName(get_name(program->runtime));
-    system("opt test.bc -O3 > test_opt.bc");
-    LLVMMemoryBufferRef buf;
-    LLVMCreateMemoryBufferWithContentsOfFile("test_opt.bc", &buf, NULL);
-    LLVMParseBitcode(buf, &llvm->opt_module, NULL);
-    LLVMDisposeMemoryBuffer(buf);
-    system("rm test_opt.bc");
-    system("rm test.bc");
-    
-    if (LLVMWriteBitcodeToFile(llvm->opt_module, "test.bc"))
-        printf("Error writing bitcode\n");
+    //Optimize in-process with the same pipeline as opt -O3
+    LLVMDisposeBuilder(gen.builder);
+    LLVMPassManagerBuilderRef pm_builder = LLVMPassManagerBuilderCreate();
+    LLVMPassManagerBuilderSetOptLevel(pm_builder, 3);
+    LLVMPassManagerBuilderUseInlinerWithThreshold(pm_builder, 275);
+    LLVMPassManagerRef func_passes = LLVMCreateFunctionPassManagerForModule(gen.module);
+    LLVMPassManagerRef module_passes = LLVMCreatePassManager();
+    LLVMAddAnalysisPasses(target_machine, func_passes);
+    LLVMAddAnalysisPasses(target_machine, module_passes);
+    LLVMPassManagerBuilderPopulateFunctionPassManager(pm_builder, func_passes);
+    LLVMPassManagerBuilderPopulateModulePassManager(pm_builder, module_passes);
+    LLVMPassManagerBuilderDispose(pm_builder);
+    
+    LLVMInitializeFunctionPassManager(func_passes);
+    for (LLVMValueRef func = LLVMGetFirstFunction(gen.module); func; func = LLVMGetNextFunction(func))
+        LLVMRunFunctionPassManager(func_passes, func);
+    LLVMFinalizeFunctionPassManager(func_passes);
+    LLVMRunPassManager(module_passes, gen.module);
+    LLVMDisposePassManager(func_passes);
+    LLVMDisposePassManager(module_passes);
     
+    LLVMMemoryBufferRef object = NULL;
     error = NULL;
-    if (LLVMCreateJITCompilerForModule(&llvm->exec_engine, llvm->opt_module, 3, &error)) {
+    if (LLVMTargetMachineEmitToMemoryBuffer(target_machine, gen.module, LLVMObjectFile, &error, &object)) {
         char new_error[1024];
-        strncpy(new_error, error, sizeof(new_error));
+        strncpy(new_error, error, sizeof(new_error)-1);
+        new_error[sizeof(new_error)-1] = 0;
         LLVMDisposeMessage(error);
-        return set_error(program->runtime, new_error);
+        set_error(runtime, new_error);
+        object = NULL;
     }
     
-    LLVMAddGlobalMapping(llvm->exec_engine, llvm->del_particle_func, &delete_particle);
-    LLVMAddGlobalMapping(llvm->exec_engine, llvm->spawn_particle_func, &spawn_particle);
-    LLVMAddGlobalMapping(llvm->exec_engine, llvm->randf_func, &randf);
+    LLVMDisposeModule(gen.module);
+    LLVMContextDispose(gen.context);
+    LLVMDisposeTargetMachine(target_machine);
+    return object;
+}
+
+//Must be called with the backend's mutex held. Takes ownership of the object.
+static llvm_kernel_t* add_kernel(runtime_t* runtime, uint64_t key, LLVMMemoryBufferRef object,
+                                 bool specialized) {
+    llvm_backend_t* backend = runtime->backend.internal;
+    llvm_kernel_t* kernel = calloc(1, sizeof(llvm_kernel_t));
+    if (!kernel) {
+        LLVMDisposeMemoryBuffer(object);
+        set_error(runtime, "Failed to allocate LLVM kernel");
+        return NULL;
+    }
+    kernel->key = key;
+    
+    LLVMOrcJITDylibRef dylib = LLVMOrcLLJITGetMainJITDylib(backend->jit);
+    LLVMErrorRef error;
+    if (specialized) {
+        kernel->tracker = LLVMOrcJITDylibCreateResourceTracker(dylib);
+        error = LLVMOrcLLJITAddObjectFileWithRT(backend->jit, kernel->tracker, object);
+    } else {
+        error = LLVMOrcLLJITAddObjectFile(backend->jit, dylib, object);
+    }
+    char name[64];
+    get_kernel_name(name, sizeof(name), key);
+    LLVMOrcExecutorAddress address = 0;
+    if (!error) error = LLVMOrcLLJITLookup(backend->jit, &address, name);
+    if (error) {
+        if (kernel->tracker) LLVMOrcReleaseResourceTracker(kernel->tracker);
+        free(kernel);
+        set_llvm_error(runtime, error);
+        return NULL;
+    }
+    kernel->func = (void*)(uintptr_t)address;
+    
+    kernel->next = backend->kernels;
+    backend->kernels = kernel;
+    return kernel;
+}
+
+//Hash of everything the kernels of the program depend on except the dtypes
+static uint64_t get_program_hash(const program_t* program) {
+    llvm_backend_t* backend = program->runtime->backend.internal;
+    uint64_t hash = 14695981039346656037ull;
+    const char* version = LLVM_VERSION_STRING;
+    int cache_version = LLVM_CACHE_VERSION;
+    hash = hash_bytes(hash, version, strlen(version)+1);
+    hash = hash_bytes(hash, &cache_version, sizeof(cache_version));
+    hash = hash_bytes(hash, backend->cpu, strlen(backend->cpu)+1);
+    hash = hash_bytes(hash, backend->features, strlen(backend->features)+1);
+    hash = hash_bytes(hash, &backend->width, sizeof(backend->width));
+    hash = hash_bytes(hash, &program->type, sizeof(program->type));
+    hash = hash_bytes(hash, &program->attribute_count, 1);
+    hash = hash_bytes(hash, program->attribute_load_regs, program->attribute_count);
+    hash = hash_bytes(hash, program->attribute_store_regs, program->attribute_count);
+    hash = hash_bytes(hash, &program->uniform_count, 1);
+    hash = hash_bytes(hash, program->uniform_regs, program->uniform_count);
+    hash = hash_bytes(hash, &program->bc_size, sizeof(program->bc_size));
+    return hash_bytes(hash, program->bc, program->bc_size);
+}
+
+static llvm_kernel_t* find_kernel(llvm_backend_t* backend, uint64_t key) {
+    llvm_kernel_t* kernel = backend->kernels;
+    while (kernel && kernel->key!=key) kernel = kernel->next;
+    return kernel;
+}
+
+//Returns the kernel of the program for the dtypes, which is loaded from the
+//cache or compiled if the process has not used it yet. If uniforms is not
+//NULL, the kernel is specialized on their values and has to be released with
+//release_kernel().
+static llvm_kernel_t* get_kernel(program_t* program, const uint8_t* dtypes, const float* uniforms) {
+    runtime_t* runtime = program->runtime;
+    llvm_backend_t* backend = runtime->backend.internal;
+    uint64_t key = hash_bytes(get_program_hash(program), dtypes, program->attribute_count);
+    if (uniforms) key = hash_bytes(key, uniforms, program->uniform_count*sizeof(float));
+    
+    lock_mutex(&runtime->threading, backend->mutex);
+    llvm_kernel_t* kernel = find_kernel(backend, key);
+    if (kernel && uniforms) kernel->refs++;
+    unlock_mutex(&runtime->threading, backend->mutex);
+    if (kernel) return kernel;
     
+    //Compiled without the lock so that programs can be compiled concurrently.
+    //Specialized kernels are not cached, so the cache does not grow with every
+    //set of values.
+    LLVMMemoryBufferRef object = uniforms ? NULL : load_cached_object(backend, key);
+    if (!object) {
+        object = compile_kernel(program, dtypes, uniforms, key);
+        if (!object) return NULL;
+        if (!uniforms) store_cached_object(runtime, key, object);
+    }
+    
+    lock_mutex(&runtime->threading, backend->mutex);
+    kernel = find_kernel(backend, key);
+    if (kernel) LLVMDisposeMemoryBuffer(object);
+    else kernel = add_kernel(runtime, key, object, uniforms!=NULL);
+    if (kernel && uniforms) kernel->refs++;
+    unlock_mutex(&runtime->threading, backend->mutex);
+    return kernel;
+}
+
+//Removes a specialized kernel from the JIT once no system uses it
+static void release_kernel(runtime_t* runtime, llvm_kernel_t* kernel) {
+    if (!kernel) return;
+    llvm_backend_t* backend = runtime->backend.internal;
+    lock_mutex(&runtime->threading, backend->mutex);
+    if (!--kernel->refs) {
+        llvm_kernel_t** link = &backend->kernels;
+        while (*link != kernel) link = &(*link)->next;
+        *link = kernel->next;
+        
+        LLVMErrorRef error = LLVMOrcResourceTrackerRemove(kernel->tracker);
+        if (error) LLVMConsumeError(error);
+        LLVMOrcReleaseResourceTracker(kernel->tracker);
+        free(kernel);
+    }
+    unlock_mutex(&runtime->threading, backend->mutex);
+}
+
+static llvm_system_t* get_llvm_system(system_t* system) {
+    return ((vm_system_t*)system->backend_internal)->jit;
+}
+
+static void get_dtypes(const program_t* program, const particles_t* particles,
+                       const uint8_t* indices, uint8_t* dtypes) {
+    for (size_t i = 0; program && i < program->attribute_count; i++)
+        dtypes[i] = particles->attribute_dtypes[indices[i]];
+}
+
+//Runs on a thread of the threading_t. Kernels which fail to compile are left
+//to the VM, or to the generic kernel if they are specialized.
+static bool compile_task(void* data) {
+    system_t* system = data;
+    llvm_system_t* llvm_system = get_llvm_system(system);
+    program_t* sim_program = system->sim_program;
+    llvm_system->compiled_sim = NULL;
+    llvm_system->compiled_emit = NULL;
+    llvm_system->compiled_spec = NULL;
+    if (sim_program)
+        llvm_system->compiled_sim = get_kernel(sim_program, llvm_system->sim_dtypes, NULL);
+    if (system->emit_program)
+        llvm_system->compiled_emit = get_kernel(system->emit_program, llvm_system->emit_dtypes, NULL);
+    if (sim_program && llvm_system->specialize)
+        llvm_system->compiled_spec = get_kernel(sim_program, llvm_system->sim_dtypes, llvm_system->compile_uniforms);
     return true;
 }
 
+static void finish_compile(system_t* system) {
+    llvm_system_t* llvm_system = get_llvm_system(system);
+    llvm_system->generic_sim = llvm_system->compiled_sim;
+    llvm_system->emit_kernel = llvm_system->compiled_emit;
+    //A system keeps only its latest specialized kernel
+    release_kernel(system->runtime, llvm_system->spec_sim);
+    llvm_system->spec_sim = llvm_system->compiled_spec;
+    llvm_system->specialized = llvm_system->specialize;
+    memcpy(llvm_system->spec_uniforms, llvm_system->compile_uniforms, sizeof(llvm_system->spec_uniforms));
+}
+
+//Compiles kernels for the dtypes the system's attributes currently have. If
+//specialize is set, a simulation kernel with the current sim_uniforms as
+//constants is compiled too.
+static void start_compile(system_t* system, bool specialize) {
+    llvm_system_t* llvm_system = get_llvm_system(system);
+    get_dtypes(system->sim_program, system->particles, system->sim_attribute_indices, llvm_system->sim_dtypes);
+    get_dtypes(system->emit_program, system->particles, system->emit_attribute_indices, llvm_system->emit_dtypes);
+    llvm_system->specialize = specialize;
+    memcpy(llvm_system->compile_uniforms, system->sim_uniforms, sizeof(llvm_system->compile_uniforms));
+    threading_t* threading = &system->runtime->threading;
+    llvm_system->compile_fence = threading_submit_background(threading, &compile_task, system);
+    if (!llvm_system->compile_fence) {
+        compile_task(system);
+        finish_compile(system);
+    }
+}
+
+static void poll_compile(system_t* system) {
+    llvm_system_t* llvm_system = get_llvm_system(system);
+    threading_t* threading = &system->runtime->threading;
+    if (llvm_system->compile_fence && threading_poll(threading, llvm_system->compile_fence)) {
+        threading_wait(threading, llvm_system->compile_fence);
+        llvm_system->compile_fence = NULL;
+        finish_compile(system);
+    }
+}
+
+static bool layout_changed(system_t* system) {
+    llvm_system_t* llvm_system = get_llvm_system(system);
+    uint8_t sim_dtypes[256];
+    uint8_t emit_dtypes[256];
+    get_dtypes(system->sim_program, system->particles, system->sim_attribute_indices, sim_dtypes);
+    get_dtypes(system->emit_program, system->particles, system->emit_attribute_indices, emit_dtypes);
+    return (system->sim_program &&
+            memcmp(sim_dtypes, llvm_system->sim_dtypes, system->sim_program->attribute_count)) ||
+           (system->emit_program &&
+            memcmp(emit_dtypes, llvm_system->emit_dtypes, system->emit_program->attribute_count));
+}
+
 static bool llvm_create(runtime_t* runtime) {
-    llvm_backend_t* backend = malloc(sizeof(llvm_backend_t));
+    llvm_backend_t* backend = calloc(1, sizeof(llvm_backend_t));
     if (!backend)
         return set_error(runtime, "Failed to allocate internal LLVM backend data");
-    backend->next_name = 0;
+    
+    vm_backend(&backend->vm);
+    if (!backend->vm.create(runtime)) {
+        free(backend);
+        return false;
+    }
+    backend->vm_kernel = *(const vm_kernel_t*)runtime->backend.internal;
     runtime->backend.internal = backend;
     
     LLVMInitializeNativeTarget();
     LLVMInitializeNativeAsmPrinter();
     LLVMInitializeNativeAsmParser();
     
+    backend->cpu = LLVMGetHostCPUName();
+    backend->features = LLVMGetHostCPUFeatures();
+    backend->width = strstr(backend->features, "+avx512f") ? 16 : 8;
+    
+    const char* cache_dir = getenv("WIP26_JIT_CACHE");
+    if (cache_dir && cache_dir[0]) {
+        backend->cache_dir = malloc(strlen(cache_dir)+1);
+        if (!backend->cache_dir)
+            return set_error(runtime, "Failed to allocate JIT cache directory");
+        strcpy(backend->cache_dir, cache_dir);
+    }
+    
+    backend->mutex = create_mutex(&runtime->threading);
+    if (!backend->mutex)
+        return set_error(runtime, "Failed to create mutex");
+    
+    LLVMErrorRef error = LLVMOrcCreateLLJIT(&backend->jit, NULL);
+    if (error) return set_llvm_error(runtime, error);
+    
+    //Kernels call back into the runtime and into the C library
+    LLVMOrcJITDylibRef dylib = LLVMOrcLLJITGetMainJITDylib(backend->jit);
+    LLVMJITSymbolFlags flags = {LLVMJITSymbolGenericFlagsExported|LLVMJITSymbolGenericFlagsCallable, 0};
+    LLVMJITCSymbolMapPair symbols[] = {
+        {LLVMOrcLLJITMangleAndIntern(backend->jit, "delete_particle"),
+         {(LLVMOrcExecutorAddress)(uintptr_t)&delete_particle, flags}},
+        {LLVMOrcLLJITMangleAndIntern(backend->jit, "spawn_particle"),
+         {(LLVMOrcExecutorAddress)(uintptr_t)&spawn_particle, flags}}};
+    error = LLVMOrcJITDylibDefine(dylib, LLVMOrcAbsoluteSymbols(symbols, 2));
+    if (error) return set_llvm_error(runtime, error);
+    
+    LLVMOrcDefinitionGeneratorRef generator;
+    error = LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(&generator, LLVMOrcLLJITGetGlobalPrefix(backend->jit),
+                                                                 NULL, NULL);
+    if (error) return set_llvm_error(runtime, error);
+    LLVMOrcJITDylibAddGenerator(dylib, generator);
+    
     return true;
 }
 
 static bool llvm_destroy(runtime_t* runtime) {
-    free(runtime->backend.internal);
-    return true;
+    llvm_backend_t* backend = runtime->backend.internal;
+    //Trackers refer to the JIT, so they are released before it is disposed
+    for (llvm_kernel_t* kernel = backend->kernels; kernel; kernel = kernel->next)
+        if (kernel->tracker) LLVMOrcReleaseResourceTracker(kernel->tracker);
+    if (backend->jit) {
+        LLVMErrorRef error = LLVMOrcDisposeLLJIT(backend->jit);
+        if (error) LLVMConsumeError(error);
+    }
+    while (backend->kernels) {
+        llvm_kernel_t* next = backend->kernels->next;
+        free(backend->kernels);
+        backend->kernels = next;
+    }
+    if (backend->mutex) destroy_mutex(&runtime->threading, backend->mutex);
+    LLVMDisposeMessage(backend->cpu);
+    LLVMDisposeMessage(backend->features);
+    free(backend->cache_dir);
+    runtime->backend.internal = &backend->vm_kernel;
+    bool success = backend->vm.destroy(runtime);
+    free(backend);
+    return success;
 }
 
 static bool llvm_create_program(program_t* program) {
-    llvm_prog_t* prog = malloc(sizeof(llvm_prog_t));
-    if (!prog)
-        return set_error(program->runtime, "Failed to allocate internal LLVM program data");
-    program->backend_internal = prog;
-    
-    return create_module(program);
+    llvm_backend_t* backend = program->runtime->backend.internal;
+    return backend->vm.create_program(program);
 }
 
 static bool llvm_destroy_program(program_t* program) {
-    llvm_prog_t* prog = program->backend_internal;
-    LLVMDisposeModule(prog->module);
-    LLVMDisposeExecutionEngine(prog->exec_engine);
-    free(prog);
+    llvm_backend_t* backend = program->runtime->backend.internal;
+    return backend->vm.destroy_program(program);
+}
+
+//The system starts in the VM while its kernels are compiled in the background
+static bool llvm_create_system(system_t* system) {
+    llvm_backend_t* backend = system->runtime->backend.internal;
+    llvm_system_t* llvm_system = calloc(1, sizeof(llvm_system_t));
+    if (!llvm_system)
+        return set_error(system->runtime, "Failed to allocate internal LLVM system data");
+    if (!backend->vm.create_system(system)) {
+        free(llvm_system);
+        return false;
+    }
+    ((vm_system_t*)system->backend_internal)->jit = llvm_system;
+    
+    start_compile(system, false);
     return true;
 }
 
-typedef struct thread_data_t {
-    system_t* system;
-    sim_func_t func;
-} thread_data_t;
+static bool llvm_destroy_system(system_t* system) {
+    llvm_backend_t* backend = system->runtime->backend.internal;
+    llvm_system_t* llvm_system = get_llvm_system(system);
+    if (llvm_system->compile_fence) {
+        threading_wait(&system->runtime->threading, llvm_system->compile_fence);
+        finish_compile(system);
+    }
+    release_kernel(system->runtime, llvm_system->spec_sim);
+    free(llvm_system);
+    return backend->vm.destroy_system(system);
+}
+
+//Returns true if the simulation uniforms should be compiled into a kernel
+static bool should_specialize(system_t* system) {
+    llvm_system_t* llvm_system = get_llvm_system(system);
+    program_t* program = system->sim_program;
+    if (!system->specialize_frames || !program || !program->uniform_count || system->instance_attribute>=0)
+        return false;
+    if (llvm_system->stable_frames < system->specialize_frames) return false;
+    //Values which have been compiled for, or have failed to compile, are not
+    //compiled again
+    return !llvm_system->specialized ||
+           memcmp(llvm_system->spec_uniforms, system->sim_uniforms, program->uniform_count*sizeof(float));
+}
 
-static void* thread_func(size_t begin, size_t count, void* userdata) {
-    thread_data_t* data = userdata;
-    system_t* system = data->system;
-    program_t* prog = system->sim_program;
+//Kernels are only switched here, so every particle of a frame is emitted and
+//simulated by the same tier
+static bool llvm_begin_frame(system_t* system) {
+    llvm_system_t* llvm_system = get_llvm_system(system);
+    program_t* sim_program = system->sim_program;
+    size_t uniforms_size = sim_program ? sim_program->uniform_count*sizeof(float) : 0;
     
+    if (memcmp(llvm_system->last_uniforms, system->sim_uniforms, uniforms_size)) {
+        memcpy(llvm_system->last_uniforms, system->sim_uniforms, uniforms_size);
+        llvm_system->stable_frames = 0;
+    } else if (llvm_system->stable_frames < SIZE_MAX) {
+        llvm_system->stable_frames++;
+    }
+    
+    poll_compile(system);
+    if (!llvm_system->compile_fence && layout_changed(system)) {
+        //The VM runs the system until the new kernels are compiled
+        llvm_system->generic_sim = NULL;
+        llvm_system->emit_kernel = NULL;
+        release_kernel(system->runtime, llvm_system->spec_sim);
+        llvm_system->spec_sim = NULL;
+        llvm_system->specialized = false;
+        start_compile(system, false);
+        poll_compile(system);
+    }
+    
+    if (!llvm_system->compile_fence && llvm_system->generic_sim && should_specialize(system)) {
+        start_compile(system, true);
+        poll_compile(system);
+    }
+    
+    //The specialized kernel is used while the uniforms have its values
+    llvm_system->sim_kernel = llvm_system->generic_sim;
+    if (llvm_system->spec_sim && system->instance_attribute<0 &&
+        !memcmp(llvm_system->spec_uniforms, system->sim_uniforms, uniforms_size))
+        llvm_system->sim_kernel = llvm_system->spec_sim;
+    
+    if (!llvm_system->sim_kernel) system->sim_tier = KERNEL_TIER_VM;
+    else if (llvm_system->sim_kernel == llvm_system->spec_sim) system->sim_tier = KERNEL_TIER_SPECIALIZED;
+    else system->sim_tier = KERNEL_TIER_COMPILED;
+    system->emit_tier = llvm_system->emit_kernel ? KERNEL_TIER_COMPILED : KERNEL_TIER_VM;
+    return true;
+}
+
+static bool llvm_simulate_range(system_t* system, size_t begin, size_t count) {
+    llvm_backend_t* backend = system->runtime->backend.internal;
+    llvm_kernel_t* kernel = get_llvm_system(system)->sim_kernel;
+    if (!kernel) return backend->vm.simulate_range(system, begin, count);
+    
+    program_t* prog = system->sim_program;
     particles_t* particles = system->particles;
+    sim_func_t func = (sim_func_t)kernel->func;
+    
     float* uniforms = system->sim_uniforms;
-    void* attr_data[256];
-    int attr_dtypes[256];
+    void* attr_data[512];
     for (size_t i = 0; i < prog->attribute_count; i++) {
         uint8_t index = system->sim_attribute_indices[i];
-        attr_data[i] = system->particles->attributes[index];
-        attr_dtypes[i] = (int)system->particles->attribute_dtypes[index];
+        void* back = particles->back_attributes[index];
+        attr_data[i] = particles->attributes[index];
+        attr_data[256+i] = back ? back : particles->attributes[index];
     }
-    uint8_t* deleted_flags = particles->deleted_flags;
     
-    data->func(begin, begin+count, uniforms, attr_data, attr_dtypes, deleted_flags, particles);
+    uint32_t key = rand_key(system->seed, system->frame, RAND_STREAM_SIM);
     
-    return (void*)true;
-}
-
-static bool llvm_simulate_system(system_t* system) {
-    if (system->emit_program) {
-        program_t* prog = system->emit_program;
-        llvm_prog_t* llvm = prog->backend_internal;
-        
-        void* attr_data[256];
-        int attr_dtypes[256];
-        for (size_t i = 0; i < prog->attribute_count; i++) {
-            uint8_t index = system->emit_attribute_indices[i];
-            attr_data[i] = system->particles->attributes[index];
-            attr_dtypes[i] = (int)system->particles->attribute_dtypes[index];
+    //Runs of 64-particle words with live particles
+    size_t end = begin + count;
+    size_t i = next_live_particle(particles, begin, end);
+    while (i < end) {
+        size_t run_end = (i/64+1) * 64;
+        while (run_end<end && __atomic_load_n(&particles->live_bits[run_end/64], __ATOMIC_RELAXED))
+            run_end += 64;
+        run_end = run_end<end ? run_end : end;
+        if (system->instance_attribute < 0) {
+            func(i, run_end, uniforms, attr_data, particles->live_bits, particles, key);
+        } else {
+            //Particles of the same instance are simulated together
+            while (i < run_end) {
+                const float* row = get_particle_uniforms(system, i);
+                size_t row_end = i + 1;
+                while (row_end<run_end && get_particle_uniforms(system, row_end)==row) row_end++;
+                func(i, row_end, (float*)row, attr_data, particles->live_bits, particles, key);
+                i = row_end;
+            }
         }
-        
-        uint64_t func_ptr = LLVMGetFunctionAddress(llvm->exec_engine, LLVMGetValueName(llvm->main_func));
-        assert(func_ptr);
-        ((emit_func_t)func_ptr)(system->emit_uniforms, system->particles, attr_data, attr_dtypes);
+        i = next_live_particle(particles, run_end, end);
     }
     
-    if (system->sim_program) {
-        llvm_prog_t* llvm = system->sim_program->backend_internal;
-        
-        thread_data_t data;
-        data.system = system;
-        data.func = (sim_func_t)LLVMGetFunctionAddress(llvm->exec_engine, LLVMGetValueName(llvm->main_func));
-        assert(data.func);
-        
-        threading_t* threading = &system->runtime->threading;
-        thread_run_t run = (thread_run_t){.func = &thread_func,
-                                          .count=system->particles->pool_size,
-                                          .data=&data};
-        thread_res_t res = threading_run(threading, run);
-        if (!res.success) {
-            strncpy(system->runtime->error, threading->error, sizeof(system->runtime->error)-1);
-            return false;
-        }
-        
-        for (size_t i = 0; i < res.count; i++)
-            if (!res.res[i]) return false;
+    return true;
+}
+
+static bool llvm_emit_system(system_t* system, bool parallel) {
+    llvm_backend_t* backend = system->runtime->backend.internal;
+    llvm_kernel_t* kernel = get_llvm_system(system)->emit_kernel;
+    if (!kernel) return backend->vm.emit_system(system, parallel);
+    
+    program_t* prog = system->emit_program;
+    void* attr_data[512];
+    for (size_t i = 0; i < prog->attribute_count; i++) {
+        uint8_t index = system->emit_attribute_indices[i];
+        attr_data[i] = system->particles->attributes[index];
+        attr_data[256+i] = system->particles->attributes[index];
     }
     
-    return true;
+    uint32_t key = rand_key(system->seed, system->frame, RAND_STREAM_EMIT);
+    //Particles emitted before the pool became full are still spawned.
+    //spawn_particle() has set the error.
+    return ((emit_func_t)kernel->func)(system->emit_uniforms, system->particles, attr_data, key);
 }
 
 bool llvm_backend(backend_t* backend) {
@@ -840,8 +1527,12 @@ bool llvm_backend(backend_t* backend) {
     backend->destroy = &llvm_destroy;
     backend->create_program = &llvm_create_program;
     backend->destroy_program = &llvm_destroy_program;
-    backend->simulate_system = &llvm_simulate_system;
-    return false;
+    backend->create_system = &llvm_create_system;
+    backend->destroy_system = &llvm_destroy_system;
+    backend->begin_frame = &llvm_begin_frame;
+    backend->emit_system = &llvm_emit_system;
+    backend->simulate_range = &llvm_simulate_range;
+    return true;
 #else
     return false;
 #endif
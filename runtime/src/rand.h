@@ -0,0 +1,32 @@
+#ifndef RAND_H
+#define RAND_H
+#include <stdint.h>
+
+//Counter-based generator used for rand(). A value is a pure function of the
+//system's seed and frame, the particle index and the number of values the
+//particle has drawn during the frame, so streams do not depend on the thread
+//or SIMD width a particle is simulated with and no state is shared.
+#define RAND_STREAM_SIM 0
+#define RAND_STREAM_EMIT 1
+
+#define RAND_MUL0 0x7feb352du
+#define RAND_MUL1 0x846ca68bu
+
+static inline uint32_t rand_hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= RAND_MUL0;
+    x ^= x >> 15;
+    x *= RAND_MUL1;
+    x ^= x >> 16;
+    return x;
+}
+
+static inline uint32_t rand_key(uint32_t seed, uint32_t frame, uint32_t stream) {
+    return rand_hash(stream + rand_hash(frame + rand_hash(seed)));
+}
+
+//Returns a float in [0, 1)
+static inline float rand_float(uint32_t key, uint32_t index, uint32_t counter) {
+    return (rand_hash(rand_hash(key+counter) + index) >> 8) * (1.0f/16777216.0f);
+}
+#endif
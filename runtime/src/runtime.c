@@ -8,6 +8,7 @@
 #include <endian.h>
 #include <math.h>
 #include <stdio.h>
+#include <sched.h>
 
 bool llvm_backend(backend_t* backend);
 bool vm_backend(backend_t* backend);
@@ -22,7 +23,7 @@ bool create_runtime(runtime_t* runtime, threading_t* threading) {
         runtime->threading = *threading;
     }
     else {
-        if (!create_builtin_threading(&runtime->threading, 0)) {
+        if (!create_builtin_threading(&runtime->threading, 0, false)) {
             strncpy(runtime->error, runtime->threading.error, sizeof(runtime->error)-1);
             return false;
         }
@@ -173,7 +174,12 @@ bool validate_program(const program_t* program) { //TODO: Validate conditional b
         case BC_OP_BOOL_NOT:
         case BC_OP_MOV:
         case BC_OP_FLOOR: required = 2; break;
+        case BC_OP_FMA:
+        case BC_OP_FMS:
+        case BC_OP_FNMA:
         case BC_OP_SEL: required = 4; break;
+        case BC_OP_SEL_LESS:
+        case BC_OP_SEL_GREATER: required = 5; break;
         case BC_OP_COND_BEGIN: required = 7; break;
         case BC_OP_WHILE_BEGIN: required = 13; break;
         case BC_OP_COND_END:
@@ -232,47 +238,72 @@ static size_t get_attr_dtype_size(attr_dtype_t dtype) {
 bool create_particles(particles_t* particles, size_t pool_size) {
     particles->pool_size = pool_size;
     particles->pool_usage = 0;
-    particles->nexts = malloc(pool_size*sizeof(int));
-    if (!particles->nexts && pool_size) return set_error(particles->runtime, "Failed to allocate next indices");
-    if (pool_size) {
-        for (int i = 0; i < particles->pool_size-1; i++)
-            particles->nexts[i] = i + 1;
-        particles->nexts[pool_size-1] = -1;
-    }
-    particles->next_particle = 0;
     
     memset(particles->attribute_names, 0, sizeof(particles->attribute_names));
     memset(particles->attributes, 0, sizeof(particles->attributes));
     
-    particles->deleted_flags = malloc(pool_size);
-    if (!particles->deleted_flags && pool_size) {
-        free(particles->nexts);
-        particles->nexts = NULL;
-        return set_error(particles->runtime, "Failed to allocate deleted flags");
+    size_t words = (pool_size+63) / 64;
+    particles->live_bits = calloc(words, sizeof(uint64_t));
+    particles->live_summary = calloc((words+63)/64, sizeof(uint64_t));
+    particles->full_summary = calloc((words+63)/64, sizeof(uint64_t));
+    particles->free_hint = 0;
+    particles->pending_bits = calloc(words, sizeof(uint64_t));
+    particles->pending_summary = calloc((words+63)/64, sizeof(uint64_t));
+    particles->pending = false;
+    if ((!particles->live_bits || !particles->live_summary || !particles->full_summary ||
+         !particles->pending_bits || !particles->pending_summary) && pool_size) {
+        free(particles->live_bits);
+        free(particles->live_summary);
+        free(particles->full_summary);
+        free(particles->pending_bits);
+        free(particles->pending_summary);
+        particles->live_bits = NULL;
+        particles->live_summary = NULL;
+        particles->full_summary = NULL;
+        particles->pending_bits = NULL;
+        particles->pending_summary = NULL;
+        return set_error(particles->runtime, "Failed to allocate occupancy bitmap");
     }
-    memset(particles->deleted_flags, 1, pool_size);
     
-    particles->_del_particle_mutex = create_mutex(&particles->runtime->threading);
+    particles->compact_moves = 0;
+    particles->compact_threshold = 0.25f;
+    
+    particles->double_buffered = false;
+    memset(particles->back_attributes, 0, sizeof(particles->back_attributes));
+    particles->front_live_bits = NULL;
+    particles->back_live_bits = NULL;
     
     return true;
 }
 
 bool destroy_particles(particles_t* particles) {
-    destroy_mutex(&particles->runtime->threading, particles->_del_particle_mutex);
-    
     for (size_t i = 0; i < 256; i++) free(particles->attributes[i]);
     for (size_t i = 0; i < 256; i++) free(particles->attribute_names[i]);
-    free(particles->nexts);
-    free(particles->deleted_flags);
+    for (size_t i = 0; i < 256; i++) free(particles->back_attributes[i]);
+    free(particles->front_live_bits);
+    free(particles->back_live_bits);
+    free(particles->live_bits);
+    free(particles->live_summary);
+    free(particles->full_summary);
+    free(particles->pending_bits);
+    free(particles->pending_summary);
     return true;
 }
 
+//Attributes have room for whole 64-particle words, so backends can access them
+//a block at a time without checking for the end of the pool
+static size_t get_attr_capacity(const particles_t* particles) {
+    return (particles->pool_size+63) / 64 * 64;
+}
+
 bool add_attribute(particles_t* particles, const char* name, attr_dtype_t dtype, int* index) {
     size_t i = 0;
     for (; i < 256; i++)
         if (particles->attribute_names[i] && !strcmp(particles->attribute_names[i], name)) {
             free(particles->attribute_names);
             free(particles->attributes[i]);
+            free(particles->back_attributes[i]);
+            particles->back_attributes[i] = NULL;
         } else if (!particles->attribute_names[i]) break;
     
     particles->attribute_dtypes[i] = dtype;
@@ -283,15 +314,61 @@ bool add_attribute(particles_t* particles, const char* name, attr_dtype_t dtype,
     strcpy(particles->attribute_names[i], name);
     
     size_t size = get_attr_dtype_size(dtype);
-    particles->attributes[i] = calloc(1, particles->pool_size*size);
+    particles->attributes[i] = calloc(1, get_attr_capacity(particles)*size);
     if (!particles->attributes[i])
         return set_error(particles->runtime, "Failed to allocate attribute data");
     
+    if (particles->double_buffered) {
+        particles->back_attributes[i] = calloc(1, get_attr_capacity(particles)*size);
+        if (!particles->back_attributes[i])
+            return set_error(particles->runtime, "Failed to allocate attribute data");
+    }
+    
     if (index) *index = i;
     
     return true;
 }
 
+bool set_double_buffered(particles_t* particles, bool double_buffered) {
+    if (!double_buffered) {
+        for (size_t i = 0; i < 256; i++) free(particles->back_attributes[i]);
+        memset(particles->back_attributes, 0, sizeof(particles->back_attributes));
+        free(particles->front_live_bits);
+        free(particles->back_live_bits);
+        particles->front_live_bits = NULL;
+        particles->back_live_bits = NULL;
+        particles->double_buffered = false;
+        return true;
+    } else if (particles->double_buffered) {
+        return true;
+    }
+    
+    size_t words = (particles->pool_size+63) / 64;
+    particles->front_live_bits = malloc(words*sizeof(uint64_t));
+    particles->back_live_bits = malloc(words*sizeof(uint64_t));
+    if ((!particles->front_live_bits || !particles->back_live_bits) && words) {
+        free(particles->front_live_bits);
+        free(particles->back_live_bits);
+        particles->front_live_bits = NULL;
+        particles->back_live_bits = NULL;
+        return set_error(particles->runtime, "Failed to allocate occupancy bitmap");
+    }
+    memcpy(particles->front_live_bits, particles->live_bits, words*sizeof(uint64_t));
+    
+    particles->double_buffered = true;
+    for (size_t i = 0; i < 256; i++) {
+        if (!particles->attribute_names[i]) continue;
+        size_t size = get_attr_dtype_size(particles->attribute_dtypes[i]);
+        particles->back_attributes[i] = calloc(1, get_attr_capacity(particles)*size);
+        if (!particles->back_attributes[i]) {
+            set_double_buffered(particles, false);
+            return set_error(particles->runtime, "Failed to allocate attribute data");
+        }
+    }
+    
+    return true;
+}
+
 bool create_system(system_t* system) {
     if (system->sim_program && system->sim_program->type != PROGRAM_TYPE_SIMULATION)
         return set_error(system->runtime, "Simulation program is not a simulation program");
@@ -300,6 +377,15 @@ bool create_system(system_t* system) {
     
     memset(system->sim_uniforms, 0, sizeof(system->sim_uniforms));
     memset(system->emit_uniforms, 0, sizeof(system->emit_uniforms));
+    system->seed = 0;
+    system->frame = 0;
+    system->tile_size = 256;
+    system->instance_attribute = -1;
+    system->instance_count = 0;
+    system->instance_uniforms = NULL;
+    system->specialize_frames = 0;
+    system->sim_tier = KERNEL_TIER_VM;
+    system->emit_tier = KERNEL_TIER_VM;
     
     particles_t* particles = system->particles;
     
@@ -333,43 +419,600 @@ bool create_system(system_t* system) {
         }
     }
     
-    return true;
+    return system->runtime->backend.create_system(system);
 }
 
 bool destroy_system(system_t* system) {
+    return system->runtime->backend.destroy_system(system);
+}
+
+static bool validate_instances(system_t* system) {
+    if (system->instance_attribute < 0) return true;
+    if (system->instance_attribute>255 || !system->particles->attribute_names[system->instance_attribute])
+        return set_error(system->runtime, "Invalid instance attribute");
+    if (system->instance_count && !system->instance_uniforms &&
+        system->sim_program && system->sim_program->uniform_count)
+        return set_error(system->runtime, "Instanced system has no instance uniforms");
     return true;
 }
 
+//Flushes the deletions and, if the frame was simulated successfully, advances
+//the frame, swaps the double buffers and compacts the particles
+static bool finish_simulation(system_t* system, bool success) {
+    particles_t* particles = system->particles;
+    flush_deletions(particles);
+    if (!success) return false;
+    system->frame++;
+    
+    if (particles->double_buffered && system->sim_program) {
+        for (size_t i = 0; i < system->sim_program->attribute_count; i++) {
+            uint8_t index = system->sim_attribute_indices[i];
+            void* front = particles->attributes[index];
+            particles->attributes[index] = particles->back_attributes[index];
+            particles->back_attributes[index] = front;
+        }
+    }
+    
+    if (particles->compact_moves && get_fragmentation(particles) > particles->compact_threshold)
+        success = compact_particles(particles, particles->compact_moves);
+    
+    //The previous snapshot may still be read until this returns
+    if (particles->double_buffered) {
+        size_t words = (particles->pool_size+63) / 64;
+        uint64_t* front = particles->back_live_bits;
+        memcpy(front, particles->live_bits, words*sizeof(uint64_t));
+        particles->back_live_bits = particles->front_live_bits;
+        particles->front_live_bits = front;
+    }
+    return success;
+}
+
+static void* simulate_func(size_t begin, size_t count, void* userdata) {
+    system_t* system = userdata;
+    return system->runtime->backend.simulate_range(system, begin, count) ? (void*)true : NULL;
+}
+
 bool simulate_system(system_t* system) {
-    return system->runtime->backend.simulate_system(system);
+    if (!validate_instances(system)) return false;
+    backend_t* backend = &system->runtime->backend;
+    bool success = backend->begin_frame(system);
+    success = success && (!system->emit_program || backend->emit_system(system, true));
+    
+    if (success && system->sim_program) {
+        threading_t* threading = &system->runtime->threading;
+        thread_res_t res = threading_run(threading, (thread_run_t){.func = &simulate_func,
+                                                                   .count = system->particles->pool_size,
+                                                                   .data = system});
+        if (!res.success)
+            strncpy(system->runtime->error, threading->error, sizeof(system->runtime->error)-1);
+        success = res.success;
+        for (size_t i = 0; i < res.count; i++)
+            success = success && res.res[i];
+    }
+    
+    return finish_simulation(system, success);
+}
+
+enum {
+    EMIT_PENDING,
+    EMIT_RUNNING,
+    EMIT_DONE,
+    EMIT_FAILED
+};
+
+typedef struct batch_t {
+    system_t** systems;
+    size_t count;
+    //Items 0..count-1 run the emitters. The particles of system i are
+    //simulated by items begins[i]..begins[i+1]-1, which begin at a multiple of
+    //THREAD_CHUNK_ALIGN.
+    size_t* begins;
+    int* emit_states;
+    bool* failed;
+} batch_t;
+
+//The first call for a system runs its emitter and later ones wait for it to
+//finish, so a system's particles are only simulated once it has emitted
+static bool emit_once(batch_t* batch, size_t index) {
+    int state = EMIT_PENDING;
+    if (__atomic_compare_exchange_n(&batch->emit_states[index], &state, EMIT_RUNNING,
+                                    false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        system_t* system = batch->systems[index];
+        bool success = system->runtime->backend.emit_system(system, false);
+        if (!success) __atomic_store_n(&batch->failed[index], true, __ATOMIC_RELAXED);
+        __atomic_store_n(&batch->emit_states[index], success?EMIT_DONE:EMIT_FAILED, __ATOMIC_RELEASE);
+        return success;
+    }
+    
+    while (state == EMIT_RUNNING) {
+        sched_yield();
+        state = __atomic_load_n(&batch->emit_states[index], __ATOMIC_ACQUIRE);
+    }
+    return state == EMIT_DONE;
+}
+
+static void* batch_func(size_t begin, size_t count, void* userdata) {
+    batch_t* batch = userdata;
+    size_t end = begin + count;
+    bool success = true;
+    
+    for (size_t i = begin; i<end && i<batch->count; i++)
+        success = emit_once(batch, i) && success;
+    
+    //The first system with particles in the chunk
+    size_t first = 0;
+    size_t last = batch->count;
+    while (first < last) {
+        size_t mid = (first+last) / 2;
+        if (batch->begins[mid+1] <= begin) first = mid + 1;
+        else last = mid;
+    }
+    
+    for (size_t i = first; i<batch->count && batch->begins[i]<end; i++) {
+        system_t* system = batch->systems[i];
+        size_t sim_begin = begin>batch->begins[i] ? begin-batch->begins[i] : 0;
+        size_t sim_end = end - batch->begins[i];
+        sim_end = sim_end<system->particles->pool_size ? sim_end : system->particles->pool_size;
+        if (!system->sim_program || sim_begin>=sim_end) continue;
+        
+        if (!emit_once(batch, i) ||
+            !system->runtime->backend.simulate_range(system, sim_begin, sim_end-sim_begin)) {
+            __atomic_store_n(&batch->failed[i], true, __ATOMIC_RELAXED);
+            success = false;
+        }
+    }
+    
+    return success ? (void*)true : NULL;
+}
+
+//Simulates the systems with a single threading_run() job instead of one per
+//system. The systems must share the runtime but not particles. Systems are
+//finished as if by simulate_system() even if others fail.
+bool simulate_systems(system_t** systems, size_t count) {
+    if (!count) return true;
+    runtime_t* runtime = systems[0]->runtime;
+    for (size_t i = 0; i < count; i++) {
+        if (systems[i]->runtime != runtime)
+            return set_error(runtime, "Systems simulated together must share the runtime");
+        for (size_t j = 0; j < i; j++)
+            if (systems[i]->particles == systems[j]->particles)
+                return set_error(runtime, "Systems simulated together must not share particles");
+        if (!validate_instances(systems[i])) return false;
+    }
+    
+    batch_t batch;
+    batch.systems = systems;
+    batch.count = count;
+    batch.begins = malloc((count+1)*sizeof(size_t));
+    batch.emit_states = malloc(count*sizeof(int));
+    batch.failed = malloc(count*sizeof(bool));
+    if (!batch.begins || !batch.emit_states || !batch.failed) {
+        free(batch.begins);
+        free(batch.emit_states);
+        free(batch.failed);
+        return set_error(runtime, "Failed to allocate batch");
+    }
+    
+    batch.begins[0] = (count+THREAD_CHUNK_ALIGN-1) / THREAD_CHUNK_ALIGN * THREAD_CHUNK_ALIGN;
+    for (size_t i = 0; i < count; i++) {
+        size_t size = systems[i]->sim_program ? systems[i]->particles->pool_size : 0;
+        size = (size+THREAD_CHUNK_ALIGN-1) / THREAD_CHUNK_ALIGN * THREAD_CHUNK_ALIGN;
+        batch.begins[i+1] = batch.begins[i] + size;
+        batch.failed[i] = !runtime->backend.begin_frame(systems[i]);
+        if (batch.failed[i]) batch.emit_states[i] = EMIT_FAILED;
+        else batch.emit_states[i] = systems[i]->emit_program ? EMIT_PENDING : EMIT_DONE;
+    }
+    
+    threading_t* threading = &runtime->threading;
+    thread_res_t res = threading_run(threading, (thread_run_t){.func = &batch_func,
+                                                               .count = batch.begins[count],
+                                                               .data = &batch});
+    if (!res.success)
+        strncpy(runtime->error, threading->error, sizeof(runtime->error)-1);
+    
+    bool success = true;
+    for (size_t i = 0; i < count; i++)
+        success = finish_simulation(systems[i], res.success && !batch.failed[i]) && success;
+    
+    free(batch.begins);
+    free(batch.emit_states);
+    free(batch.failed);
+    return success;
+}
+
+const float* get_particle_uniforms(const system_t* system, size_t index) {
+    if (system->instance_attribute < 0) return system->sim_uniforms;
+    
+    const particles_t* particles = system->particles;
+    const void* ids = particles->attributes[system->instance_attribute];
+    double id = -1.0;
+    switch (particles->attribute_dtypes[system->instance_attribute]) {
+    case ATTR_UINT8: id = ((const uint8_t*)ids)[index]; break;
+    case ATTR_INT8: id = ((const int8_t*)ids)[index]; break;
+    case ATTR_UINT16: id = ((const uint16_t*)ids)[index]; break;
+    case ATTR_INT16: id = ((const int16_t*)ids)[index]; break;
+    case ATTR_UINT32: id = ((const uint32_t*)ids)[index]; break;
+    case ATTR_INT32: id = ((const int32_t*)ids)[index]; break;
+    case ATTR_FLOAT32: id = ((const float*)ids)[index]; break;
+    case ATTR_FLOAT64: id = ((const double*)ids)[index]; break;
+    }
+    
+    if (!(id>=0.0 && id<system->instance_count)) return system->sim_uniforms;
+    return system->instance_uniforms + (size_t)id*system->sim_program->uniform_count;
+}
+
+static bool simulate_task(void* system) {
+    return simulate_system(system);
+}
+
+//Runs simulate_system() on the thread pool and returns a fence for it or NULL
+//on failure. The system and its particles must not be used until the fence
+//has been waited for with threading_wait(), which returns the result of
+//simulate_system().
+thread_fence_t* simulate_system_async(system_t* system) {
+    threading_t* threading = &system->runtime->threading;
+    thread_fence_t* fence = threading_submit(threading, &simulate_task, system);
+    if (!fence)
+        strncpy(system->runtime->error, threading->error, sizeof(system->runtime->error)-1);
+    return fence;
+}
+
+//Simulation threads read the bitmaps while other particles are deleted. Sets
+//the bits of word index/64 in mask.
+static void mark_live(particles_t* particles, size_t index, uint64_t mask) {
+    uint64_t bits = __atomic_or_fetch(&particles->live_bits[index/64], mask, __ATOMIC_RELAXED);
+    __atomic_or_fetch(&particles->live_summary[index/4096], 1ull<<index/64%64, __ATOMIC_RELAXED);
+    if (bits == ~0ull)
+        __atomic_or_fetch(&particles->full_summary[index/4096], 1ull<<index/64%64, __ATOMIC_RELAXED);
+}
+
+//Returns false if the particle was already dead
+static bool mark_dead(particles_t* particles, size_t index) {
+    uint64_t bit = 1ull << index%64;
+    uint64_t bits = __atomic_fetch_and(&particles->live_bits[index/64], ~bit, __ATOMIC_RELAXED);
+    if (!(bits & bit)) return false;
+    uint64_t summary_bit = 1ull << index/64%64;
+    if (bits == ~0ull)
+        __atomic_and_fetch(&particles->full_summary[index/4096], ~summary_bit, __ATOMIC_RELAXED);
+    if (!(bits & ~bit))
+        __atomic_and_fetch(&particles->live_summary[index/4096], ~summary_bit, __ATOMIC_RELAXED);
+    return true;
 }
 
 int spawn_particle(particles_t* particles) {
-    int index = particles->next_particle;
-    if (index < 0) {
+    flush_deletions(particles);
+    
+    size_t index = next_dead_particle(particles, particles->free_hint, particles->pool_size);
+    if (index == particles->pool_size) {
         set_error(particles->runtime, "Pool is full");
         return -1;
     }
     
-    particles->next_particle = particles->nexts[index];
-    particles->deleted_flags[index] = 0;
+    mark_live(particles, index, 1ull<<index%64);
+    particles->free_hint = index + 1;
     particles->pool_usage++;
     
     return index;
 }
 
-bool delete_particle(particles_t* particles, int index) {
-    lock_mutex(&particles->runtime->threading, particles->_del_particle_mutex);
+//Spawns up to count particles into the first run of unused slots and stores
+//them in range. Fails if the pool is full.
+bool spawn_particles(particles_t* particles, size_t count, particle_range_t* range) {
+    flush_deletions(particles);
+    
+    size_t begin = next_dead_particle(particles, particles->free_hint, particles->pool_size);
+    range->begin = begin;
+    range->count = 0;
+    if (!count) return true;
+    if (begin == particles->pool_size) return set_error(particles->runtime, "Pool is full");
+    
+    size_t end = count<particles->pool_size-begin ? begin+count : particles->pool_size;
+    end = next_live_particle(particles, begin, end);
+    range->count = end - begin;
+    particles->free_hint = end;
+    particles->pool_usage += range->count;
+    
+    for (size_t i = begin; i < end; i = (i/64+1) * 64) {
+        uint64_t mask = ~0ull << i%64;
+        if (end-i < 64-i%64) mask &= ~0ull >> (64-end%64);
+        mark_live(particles, i, mask);
+    }
+    
+    return true;
+}
+
+//Larger ranges are written by the thread pool
+#define PARALLEL_WRITE_COUNT 16384
+
+typedef struct write_data_t {
+    void* attribute;
+    attr_dtype_t attribute_dtype;
+    const void* values;
+    attr_dtype_t dtype;
+    size_t first;
+} write_data_t;
+
+#define CONVERT(type, ftype, scale, min, max) {\
+    type* elements = (type*)data->attribute + data->first;\
+    for (size_t i = begin; i < end; i++) {\
+        ftype v = values[i] * scale;\
+        elements[i] = v<min ? min : (v>max ? max : v);\
+    }\
+    break;\
+}
+
+//Values of the attribute's dtype are copied. Floats are converted the same
+//way the simulation stores them.
+static void* write_attribute_func(size_t begin, size_t count, void* userdata) {
+    write_data_t* data = userdata;
+    size_t end = begin + count;
+    if (data->dtype == data->attribute_dtype) {
+        size_t size = get_attr_dtype_size(data->dtype);
+        memcpy((uint8_t*)data->attribute+(data->first+begin)*size,
+               (const uint8_t*)data->values+begin*size, count*size);
+        return (void*)true;
+    }
+    
+    const float* values = data->values;
+    switch (data->attribute_dtype) {
+    case ATTR_UINT8: CONVERT(uint8_t, float, 255.0f, 0.0f, 255.0f)
+    case ATTR_INT8: CONVERT(int8_t, float, 127.0f, -128.0f, 127.0f)
+    case ATTR_UINT16: CONVERT(uint16_t, float, 65535.0f, 0.0f, 65535.0f)
+    case ATTR_INT16: CONVERT(int16_t, float, 32767.0f, -32768.0f, 32767.0f)
+    case ATTR_UINT32: CONVERT(uint32_t, double, 4294967295.0, 0.0, 4294967295.0)
+    case ATTR_INT32: CONVERT(int32_t, double, 2147483647.0, -2147483648.0, 2147483647.0)
+    case ATTR_FLOAT32: break;
+    case ATTR_FLOAT64: {
+        double* elements = (double*)data->attribute + data->first;
+        for (size_t i = begin; i < end; i++) elements[i] = values[i];
+        break;
+    }
+    }
+    return (void*)true;
+}
+
+#undef CONVERT
+
+//Stores values in the attribute of the particles in range. values must either
+//have the attribute's dtype or be ATTR_FLOAT32.
+bool write_attribute(particles_t* particles, int attribute, particle_range_t range,
+                     attr_dtype_t dtype, const void* values) {
+    if (attribute < 0 || attribute >= 256 || !particles->attributes[attribute])
+        return set_error(particles->runtime, "Invalid attribute index");
+    if (range.begin > particles->pool_size || range.count > particles->pool_size-range.begin)
+        return set_error(particles->runtime, "Invalid particle range");
+    attr_dtype_t attribute_dtype = particles->attribute_dtypes[attribute];
+    if (dtype!=attribute_dtype && dtype!=ATTR_FLOAT32)
+        return set_error(particles->runtime, "Unsupported attribute conversion");
+    
+    write_data_t data = {.attribute = particles->attributes[attribute],
+                         .attribute_dtype = attribute_dtype,
+                         .values = values,
+                         .dtype = dtype,
+                         .first = range.begin};
+    if (range.count < PARALLEL_WRITE_COUNT) {
+        write_attribute_func(0, range.count, &data);
+        return true;
+    }
     
+    threading_t* threading = &particles->runtime->threading;
+    thread_res_t res = threading_run(threading, (thread_run_t){.func = &write_attribute_func,
+                                                               .count = range.count,
+                                                               .data = &data});
+    if (!res.success) {
+        strncpy(particles->runtime->error, threading->error, sizeof(particles->runtime->error)-1);
+        return false;
+    }
+    return true;
+}
+
+//Called by simulation threads. The particle is only counted as unused by
+//flush_deletions(). Shared words are only written if they change, so threads
+//deleting particles do not contend for them.
+bool delete_particle(particles_t* particles, int index) {
     if (index < 0 || index >= particles->pool_size)
         return set_error(particles->runtime, "Invalid particle index");
     
-    particles->deleted_flags[index] = 1;
-    particles->nexts[index] = particles->next_particle;
-    particles->next_particle = index;
-    particles->pool_usage--;
+    if (!mark_dead(particles, index)) return true;
     
-    unlock_mutex(&particles->runtime->threading, particles->_del_particle_mutex);
+    __atomic_or_fetch(&particles->pending_bits[index/64], 1ull<<index%64, __ATOMIC_RELAXED);
+    uint64_t* summary = &particles->pending_summary[index/4096];
+    uint64_t summary_bit = 1ull << index/64%64;
+    if (!(__atomic_load_n(summary, __ATOMIC_RELAXED) & summary_bit))
+        __atomic_or_fetch(summary, summary_bit, __ATOMIC_RELAXED);
+    if (!__atomic_load_n(&particles->pending, __ATOMIC_RELAXED))
+        __atomic_store_n(&particles->pending, true, __ATOMIC_RELAXED);
     
     return true;
 }
+
+//Updates pool_usage and free_hint for the deleted particles. This must not run
+//concurrently with delete_particle().
+void flush_deletions(particles_t* particles) {
+    if (!particles->pending) return;
+    particles->pending = false;
+    
+    for (size_t i = 0; i < (particles->pool_size+4095)/4096; i++) {
+        uint64_t words = particles->pending_summary[i];
+        particles->pending_summary[i] = 0;
+        for (; words; words &= words-1) {
+            size_t word = i*64 + __builtin_ctzll(words);
+            uint64_t bits = particles->pending_bits[word];
+            particles->pending_bits[word] = 0;
+            particles->pool_usage -= __builtin_popcountll(bits);
+            size_t first = word*64 + __builtin_ctzll(bits);
+            if (first < particles->free_hint) particles->free_hint = first;
+        }
+    }
+}
+
+//Returns the first live particle in index..end-1 or end if there is none.
+//Words of live_bits without live particles are skipped using live_summary.
+size_t next_live_particle(const particles_t* particles, size_t index, size_t end) {
+    while (index < end) {
+        uint64_t bits = __atomic_load_n(&particles->live_bits[index/64], __ATOMIC_RELAXED);
+        bits >>= index % 64;
+        if (bits) {
+            index += __builtin_ctzll(bits);
+            break;
+        }
+        
+        size_t word = index/64 + 1;
+        if (word*64 >= end) return end;
+        uint64_t summary = __atomic_load_n(&particles->live_summary[word/64], __ATOMIC_RELAXED);
+        summary >>= word % 64;
+        while (!summary) {
+            word = (word/64+1) * 64;
+            if (word*64 >= end) return end;
+            summary = __atomic_load_n(&particles->live_summary[word/64], __ATOMIC_RELAXED);
+        }
+        index = (word+__builtin_ctzll(summary)) * 64;
+    }
+    
+    return index<end ? index : end;
+}
+
+//Returns the first dead particle in index..end-1 or end if there is none.
+//Words of live_bits without dead particles are skipped using full_summary.
+size_t next_dead_particle(const particles_t* particles, size_t index, size_t end) {
+    while (index < end) {
+        uint64_t dead = ~__atomic_load_n(&particles->live_bits[index/64], __ATOMIC_RELAXED);
+        dead >>= index % 64;
+        if (dead) {
+            index += __builtin_ctzll(dead);
+            break;
+        }
+        
+        size_t word = index/64 + 1;
+        if (word*64 >= end) return end;
+        uint64_t summary = ~__atomic_load_n(&particles->full_summary[word/64], __ATOMIC_RELAXED);
+        summary >>= word % 64;
+        while (!summary) {
+            word = (word/64+1) * 64;
+            if (word*64 >= end) return end;
+            summary = ~__atomic_load_n(&particles->full_summary[word/64], __ATOMIC_RELAXED);
+        }
+        index = (word+__builtin_ctzll(summary)) * 64;
+    }
+    
+    return index<end ? index : end;
+}
+
+//Returns one more than the index of the last live particle
+static size_t get_live_end(const particles_t* particles) {
+    size_t word = (particles->pool_size+4095) / 4096;
+    while (word && !particles->live_summary[word-1]) word--;
+    if (!word) return 0;
+    word = (word-1)*64 + 63 - __builtin_clzll(particles->live_summary[word-1]);
+    return word*64 + 64 - __builtin_clzll(particles->live_bits[word]);
+}
+
+//Returns one more than the last live particle in begin..end-1 or begin if
+//there is none
+static size_t prev_live_end(const particles_t* particles, size_t begin, size_t end) {
+    while (end > begin) {
+        size_t last = end - 1;
+        uint64_t bits = particles->live_bits[last/64] << (63-last%64);
+        if (bits) {
+            end = last + 1 - __builtin_clzll(bits);
+            break;
+        }
+        end = last - last%64;
+    }
+    return end>begin ? end : begin;
+}
+
+//Returns the fraction of the pool before the last live particle which is unused
+float get_fragmentation(particles_t* particles) {
+    flush_deletions(particles);
+    size_t end = get_live_end(particles);
+    return end ? 1.0f - particles->pool_usage/(float)end : 0.0f;
+}
+
+typedef struct compact_data_t {
+    particles_t* particles;
+    const size_t* moves; //Pairs of destination and source indices
+} compact_data_t;
+
+#define COPY_ELEMENTS(type) {\
+    type* elements = attribute;\
+    for (size_t i = begin; i < end; i++) elements[moves[i*2]] = elements[moves[i*2+1]];\
+    break;\
+}
+
+static void* move_particles_func(size_t begin, size_t count, void* userdata) {
+    compact_data_t* data = userdata;
+    particles_t* particles = data->particles;
+    const size_t* moves = data->moves;
+    size_t end = begin + count;
+    for (size_t i = 0; i < 256; i++) {
+        void* attribute = particles->attributes[i];
+        if (!attribute) continue;
+        switch (get_attr_dtype_size(particles->attribute_dtypes[i])) {
+        case 1: COPY_ELEMENTS(uint8_t)
+        case 2: COPY_ELEMENTS(uint16_t)
+        case 4: COPY_ELEMENTS(uint32_t)
+        case 8: COPY_ELEMENTS(uint64_t)
+        }
+    }
+    return (void*)true;
+}
+
+#undef COPY_ELEMENTS
+
+static bool run_compact_func(particles_t* particles, thread_func_t func, size_t count,
+                             compact_data_t* data) {
+    threading_t* threading = &particles->runtime->threading;
+    thread_res_t res = threading_run(threading, (thread_run_t){.func=func, .count=count, .data=data});
+    if (!res.success) {
+        strncpy(particles->runtime->error, threading->error, sizeof(particles->runtime->error)-1);
+        return false;
+    }
+    return true;
+}
+
+//Returns true if the particle is live in the snapshot of double buffered
+//particles which may still be read
+static bool is_front_live(const particles_t* particles, size_t index) {
+    if (!particles->double_buffered) return false;
+    return particles->front_live_bits[index/64]>>index%64 & 1;
+}
+
+//Moves up to max_moves particles from the end of the pool into the first
+//unused slots. This changes the indices of the moved particles. Slots of
+//double buffered particles are only reused once they are dead in
+//front_live_bits too, because attributes the simulation program does not
+//write are shared with the front buffer.
+bool compact_particles(particles_t* particles, size_t max_moves) {
+    flush_deletions(particles);
+    
+    size_t* moves = malloc(max_moves*2*sizeof(size_t));
+    if (!moves && max_moves) return set_error(particles->runtime, "Failed to allocate moves");
+    
+    //Pair the first unused slots with the last live particles
+    size_t count = 0;
+    size_t dst = particles->free_hint;
+    size_t src = get_live_end(particles);
+    while (count < max_moves) {
+        dst = next_dead_particle(particles, dst, src);
+        while (dst<src && is_front_live(particles, dst))
+            dst = next_dead_particle(particles, dst+1, src);
+        src = prev_live_end(particles, dst, src);
+        if (src <= dst) break;
+        moves[count*2] = dst++;
+        moves[count*2+1] = --src;
+        count++;
+    }
+    
+    compact_data_t data = {.particles = particles, .moves = moves};
+    bool success = !count || run_compact_func(particles, &move_particles_func, count, &data);
+    if (success) {
+        for (size_t i = 0; i < count; i++) {
+            mark_live(particles, moves[i*2], 1ull<<moves[i*2]%64);
+            mark_dead(particles, moves[i*2+1]);
+        }
+    }
+    
+    free(moves);
+    return success;
+}
@@ -1,10 +1,15 @@
 #include "threading.h"
 
-#include <semaphore.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 bool destroy_threading(threading_t* threading) {
     return threading->destroy(threading);
@@ -14,6 +19,29 @@ thread_res_t threading_run(threading_t* threading, thread_run_t run) {
     return threading->run(threading, run);
 }
 
+//Runs task on another thread where supported and returns a fence for it or
+//NULL on failure. Tasks run one after another in the order they were submitted.
+thread_fence_t* threading_submit(threading_t* threading, thread_task_t task, void* data) {
+    return threading->submit(threading, task, data);
+}
+
+//Like threading_submit(), but the task is ordered only with other background
+//tasks, so long tasks do not delay the ones from threading_submit()
+thread_fence_t* threading_submit_background(threading_t* threading, thread_task_t task, void* data) {
+    return threading->submit_background(threading, task, data);
+}
+
+//Waits for the fence's task to finish, destroys the fence and returns the
+//task's result. Every fence must be waited for.
+bool threading_wait(threading_t* threading, thread_fence_t* fence) {
+    return threading->wait(threading, fence);
+}
+
+//Returns true if the fence's task has finished
+bool threading_poll(threading_t* threading, thread_fence_t* fence) {
+    return threading->poll(threading, fence);
+}
+
 void* create_mutex(threading_t* threading) {
     return threading->create_mutex(threading);
 }
@@ -49,6 +77,35 @@ static thread_res_t null_run(threading_t* _, thread_run_t run) {
     return res;
 }
 
+struct thread_fence_t {
+    thread_task_t task;
+    void* data;
+    bool done;
+    bool res;
+    thread_fence_t* next;
+};
+
+static thread_fence_t* null_submit(threading_t* threading, thread_task_t task, void* data) {
+    thread_fence_t* fence = malloc(sizeof(thread_fence_t));
+    if (!fence) {
+        set_error(threading, "Failed to allocate fence");
+        return NULL;
+    }
+    fence->done = true;
+    fence->res = task(data);
+    return fence;
+}
+
+static bool null_wait(threading_t* threading, thread_fence_t* fence) {
+    bool res = fence->res;
+    free(fence);
+    return res;
+}
+
+static bool null_poll(threading_t* threading, thread_fence_t* fence) {
+    return true;
+}
+
 static void* null_create_mutex(threading_t* threading) {
     return threading;
 }
@@ -66,6 +123,10 @@ bool create_null_threading(threading_t* threading) {
     memset(threading->error, 0, sizeof(threading->error));
     threading->destroy = &null_destroy;
     threading->run = &null_run;
+    threading->submit = &null_submit;
+    threading->submit_background = &null_submit;
+    threading->wait = &null_wait;
+    threading->poll = &null_poll;
     threading->create_mutex = &null_create_mutex;
     threading->destroy_mutex = &null_destroy_mutex;
     threading->lock_mutex = &null_lock_mutex;
@@ -74,87 +135,338 @@ bool create_null_threading(threading_t* threading) {
     return true;
 }
 
+//The chunks a thread has yet to run. The owner takes chunks from the front and
+//other threads steal half of the remaining ones from the back. Both are packed
+//into one word so that either can be taken with a compare-and-swap.
+typedef struct pthread_deque_t {
+    _Alignas(64) uint64_t range; //Front in the low and back in the high 32 bits
+} pthread_deque_t;
+
+typedef struct pthread_job_t {
+    thread_run_t run;
+    size_t participants; //Worker threads plus the calling thread
+    pthread_deque_t deques[MAX_THREADS+1];
+} pthread_job_t;
+
 typedef struct pthread_data_t {
-    thread_func_t func;
-    size_t begin;
-    size_t count;
-    void* userdata;
+    struct pthread_internal_t* internal;
+    pthread_job_t* job;
+    size_t index;
     void* res;
-    sem_t* begin_sem;
-    sem_t* end_sem;
-    bool destroy;
+    bool ran;
+    uint32_t spins; //Adapted by wait_while_equal()
 } pthread_data_t;
 
+//Tasks submitted to a queue are run in order by its driver thread
+typedef struct pthread_queue_t {
+    struct pthread_internal_t* internal;
+    pthread_t driver;
+    pthread_cond_t task_cond;
+    thread_fence_t* first_task;
+    thread_fence_t* last_task;
+} pthread_queue_t;
+
 typedef struct pthread_internal_t {
     size_t count;
     pthread_t threads[MAX_THREADS];
-    sem_t begin_sems[MAX_THREADS];
-    sem_t end_sems[MAX_THREADS];
-    pthread_data_t data[MAX_THREADS];
+    pthread_data_t data[MAX_THREADS+1]; //The first one is used by the calling thread
+    pthread_job_t job;
+    
+    //Workers wait for generation to change and the calling thread waits for
+    //remaining to reach zero. The waiter counts tell whether a futex wake is
+    //needed.
+    _Alignas(64) uint32_t generation;
+    uint32_t generation_waiters;
+    bool destroy;
+    _Alignas(64) uint32_t remaining;
+    uint32_t remaining_waiters;
+    
+    pthread_mutex_t run_mutex; //Jobs of the calling threads and the drivers take turns
+    
+    //Tasks from submit() and submit_background() have separate queues
+    pthread_queue_t queue;
+    pthread_queue_t background_queue;
+    bool stop_drivers;
+    pthread_mutex_t task_mutex;
+    pthread_cond_t done_cond;
 } pthread_internal_t;
 
+#define MIN_SPINS 16
+#define MAX_SPINS 16384
+
+static void cpu_relax() {
+    #if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+    #else
+    __asm__ __volatile__("" ::: "memory");
+    #endif
+}
+
+//Spins while *word is value and sleeps on a futex once *spins iterations have
+//passed. The spin limit doubles when spinning was enough and halves when it was
+//not, so threads running many small jobs in a row do not sleep while idle
+//threads stop burning cycles.
+static void wait_while_equal(uint32_t* word, uint32_t value, uint32_t* waiters, uint32_t* spins) {
+    for (uint32_t i = 0; i < *spins; i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != value) {
+            *spins = *spins*2<MAX_SPINS ? *spins*2 : MAX_SPINS;
+            return;
+        }
+        cpu_relax();
+    }
+    *spins = *spins/2>MIN_SPINS ? *spins/2 : MIN_SPINS;
+    
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == value)
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+//Must follow a sequentially consistent write of *word
+static void wake_all(uint32_t* word, uint32_t* waiters) {
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+//Joins the drivers of the first count queues once they have run their tasks
+static void stop_drivers(pthread_internal_t* internal, size_t count) {
+    pthread_queue_t* queues[] = {&internal->queue, &internal->background_queue};
+    pthread_mutex_lock(&internal->task_mutex);
+    internal->stop_drivers = true;
+    for (size_t i = 0; i < count; i++) pthread_cond_signal(&queues[i]->task_cond);
+    pthread_mutex_unlock(&internal->task_mutex);
+    for (size_t i = 0; i < count; i++) {
+        pthread_join(queues[i]->driver, NULL);
+        pthread_cond_destroy(&queues[i]->task_cond);
+    }
+}
+
 static bool pthread_destroy(threading_t* threading) {
     pthread_internal_t* internal = threading->internal;
+    
+    //The drivers finish the remaining tasks first
+    stop_drivers(internal, 2);
+    
+    internal->destroy = true;
+    __atomic_add_fetch(&internal->generation, 1, __ATOMIC_SEQ_CST);
+    wake_all(&internal->generation, &internal->generation_waiters);
     for (size_t i = 0; i < internal->count; i++) {
-        internal->data[i].destroy = true;
-        sem_post(internal->begin_sems+i);
         void* res;
         pthread_join(internal->threads[i], &res);
     }
     
-    for (size_t i = 0; i < internal->count; i++) {
-        sem_destroy(internal->end_sems+i);
-        sem_destroy(internal->begin_sems+i);
-    }
-    
+    pthread_mutex_destroy(&internal->run_mutex);
+    pthread_mutex_destroy(&internal->task_mutex);
+    pthread_cond_destroy(&internal->done_cond);
     free(internal);
     return true;
 }
 
+static uint64_t pack_range(uint64_t front, uint64_t back) {
+    return front | back<<32;
+}
+
+//Takes the front chunk of the thread's own deque. Returns false if it is empty.
+static bool pop_chunk(pthread_deque_t* deque, size_t* chunk) {
+    uint64_t range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+    while (true) {
+        uint64_t front = range & 0xffffffff;
+        uint64_t back = range >> 32;
+        if (front == back) return false;
+        if (__atomic_compare_exchange_n(&deque->range, &range, pack_range(front+1, back),
+                                        true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = front;
+            return true;
+        }
+    }
+}
+
+//Moves the back half of another thread's chunks into the thread's own deque,
+//which must be empty. Returns false if every other deque is empty.
+static bool steal_chunks(pthread_job_t* job, size_t thief) {
+    for (size_t i = 1; i < job->participants; i++) {
+        pthread_deque_t* victim = &job->deques[(thief+i)%job->participants];
+        uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+        while (true) {
+            uint64_t front = range & 0xffffffff;
+            uint64_t back = range >> 32;
+            if (front == back) break;
+            uint64_t middle = back - (back-front+1)/2;
+            if (__atomic_compare_exchange_n(&victim->range, &range, pack_range(front, middle),
+                                            true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&job->deques[thief].range, pack_range(middle, back),
+                                 __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void run_chunks(pthread_data_t* data) {
+    pthread_job_t* job = data->job;
+    thread_run_t* run = &job->run;
+    data->res = NULL;
+    data->ran = false;
+    
+    size_t chunk;
+    while (pop_chunk(&job->deques[data->index], &chunk) ||
+           (steal_chunks(job, data->index) && pop_chunk(&job->deques[data->index], &chunk))) {
+        size_t begin = chunk * run->grain;
+        size_t count = run->count-begin<run->grain ? run->count-begin : run->grain;
+        void* res = run->func(begin, count, run->data);
+        if (!data->ran || data->res) data->res = res;
+        data->ran = true;
+    }
+}
+
 static void* pthread_func(void* userdata) {
     pthread_data_t* data = userdata;
+    pthread_internal_t* internal = data->internal;
+    uint32_t generation = 0;
     
     while (true) {
-        sem_wait(data->begin_sem);
+        wait_while_equal(&internal->generation, generation,
+                         &internal->generation_waiters, &data->spins);
+        generation = __atomic_load_n(&internal->generation, __ATOMIC_ACQUIRE);
         
-        if (data->destroy) return NULL;
+        if (internal->destroy) return NULL;
         
-        void* res = data->func(data->begin, data->count, data->userdata);
-        data->res = res;
+        run_chunks(data);
         
-        sem_post(data->end_sem);
+        if (!__atomic_sub_fetch(&internal->remaining, 1, __ATOMIC_SEQ_CST))
+            wake_all(&internal->remaining, &internal->remaining_waiters);
     }
 }
 
 static thread_res_t pthread_run(threading_t* threading, thread_run_t run) {
     pthread_internal_t* internal = threading->internal;
+    pthread_job_t* job = &internal->job;
+    pthread_mutex_lock(&internal->run_mutex);
+    size_t participants = internal->count + 1;
     
-    size_t begin = 0;
-    for (size_t i = 0; i < internal->count; i++) {
-        internal->data[i].func = run.func;
-        internal->data[i].begin = begin;
-        internal->data[i].count = run.count/(internal->count+1);
-        internal->data[i].userdata = run.data;
-        begin += internal->data[i].count;
-    }
+    //By default each thread starts with about eight chunks. Chunk indices
+    //have 32 bits.
+    if (!run.grain) run.grain = run.count / (participants*8);
+    if (run.grain <= run.count/0xffffffff) run.grain = run.count/0xffffffff + 1;
+    run.grain = (run.grain+THREAD_CHUNK_ALIGN-1) / THREAD_CHUNK_ALIGN * THREAD_CHUNK_ALIGN;
+    run.grain = run.grain ? run.grain : THREAD_CHUNK_ALIGN;
+    size_t chunks = (run.count+run.grain-1) / run.grain;
     
-    for (size_t i = 0; i < internal->count; i++)
-        sem_post(internal->begin_sems+i);
+    //Workers are only woken if there is more than one chunk
+    if (chunks < 2) participants = 1;
+    job->run = run;
+    job->participants = participants;
+    pthread_data_t* caller = &internal->data[0];
+    if (participants == 1) {
+        for (size_t i = 1; i <= internal->count; i++) internal->data[i].ran = false;
+        job->deques[0].range = pack_range(0, chunks);
+        run_chunks(caller);
+    } else {
+        for (size_t i = 0; i < participants; i++)
+            job->deques[i].range = pack_range(chunks*i/participants, chunks*(i+1)/participants);
+        
+        internal->remaining = internal->count;
+        __atomic_add_fetch(&internal->generation, 1, __ATOMIC_SEQ_CST);
+        wake_all(&internal->generation, &internal->generation_waiters);
+        
+        run_chunks(caller);
+        
+        uint32_t remaining;
+        while ((remaining = __atomic_load_n(&internal->remaining, __ATOMIC_ACQUIRE)))
+            wait_while_equal(&internal->remaining, remaining,
+                             &internal->remaining_waiters, &caller->spins);
+    }
     
     thread_res_t res;
     res.success = true;
-    res.count = internal->count+1;
-    res.res[0] = run.func(begin, run.count-begin, run.data);
+    res.count = 0;
+    for (size_t i = 0; i <= internal->count; i++)
+        if (internal->data[i].ran) res.res[res.count++] = internal->data[i].res;
+    
+    pthread_mutex_unlock(&internal->run_mutex);
+    return res;
+}
+
+static void* pthread_driver_func(void* userdata) {
+    pthread_queue_t* queue = userdata;
+    pthread_internal_t* internal = queue->internal;
+    
+    pthread_mutex_lock(&internal->task_mutex);
+    while (true) {
+        while (!queue->first_task && !internal->stop_drivers)
+            pthread_cond_wait(&queue->task_cond, &internal->task_mutex);
+        thread_fence_t* fence = queue->first_task;
+        if (!fence) break;
+        queue->first_task = fence->next;
+        if (!fence->next) queue->last_task = NULL;
+        pthread_mutex_unlock(&internal->task_mutex);
+        
+        bool res = fence->task(fence->data);
+        
+        pthread_mutex_lock(&internal->task_mutex);
+        fence->res = res;
+        fence->done = true;
+        pthread_cond_broadcast(&internal->done_cond);
+    }
+    pthread_mutex_unlock(&internal->task_mutex);
+    
+    return NULL;
+}
+
+static thread_fence_t* submit_to_queue(threading_t* threading, pthread_queue_t* queue,
+                                       thread_task_t task, void* data) {
+    pthread_internal_t* internal = threading->internal;
+    thread_fence_t* fence = malloc(sizeof(thread_fence_t));
+    if (!fence) {
+        set_error(threading, "Failed to allocate fence");
+        return NULL;
+    }
+    fence->task = task;
+    fence->data = data;
+    fence->done = false;
+    fence->next = NULL;
     
-    for (size_t i = 0; i < internal->count; i++)
-        sem_wait(internal->end_sems+i);
+    pthread_mutex_lock(&internal->task_mutex);
+    if (queue->last_task) queue->last_task->next = fence;
+    else queue->first_task = fence;
+    queue->last_task = fence;
+    pthread_cond_signal(&queue->task_cond);
+    pthread_mutex_unlock(&internal->task_mutex);
     
-    for (size_t i = 0; i < internal->count; i++)
-        res.res[i+1] = internal->data[i].res;
+    return fence;
+}
+
+static thread_fence_t* pthread_submit(threading_t* threading, thread_task_t task, void* data) {
+    pthread_internal_t* internal = threading->internal;
+    return submit_to_queue(threading, &internal->queue, task, data);
+}
+
+static thread_fence_t* pthread_submit_background(threading_t* threading, thread_task_t task, void* data) {
+    pthread_internal_t* internal = threading->internal;
+    return submit_to_queue(threading, &internal->background_queue, task, data);
+}
+
+static bool pthread_wait(threading_t* threading, thread_fence_t* fence) {
+    pthread_internal_t* internal = threading->internal;
+    pthread_mutex_lock(&internal->task_mutex);
+    while (!fence->done)
+        pthread_cond_wait(&internal->done_cond, &internal->task_mutex);
+    pthread_mutex_unlock(&internal->task_mutex);
     
+    bool res = fence->res;
+    free(fence);
     return res;
 }
 
+static bool pthread_poll(threading_t* threading, thread_fence_t* fence) {
+    pthread_internal_t* internal = threading->internal;
+    pthread_mutex_lock(&internal->task_mutex);
+    bool done = fence->done;
+    pthread_mutex_unlock(&internal->task_mutex);
+    return done;
+}
+
 static void* pthread_create_mutex(threading_t* threading) {
     pthread_mutex_t* mut = malloc(sizeof(pthread_mutex_t));
     
@@ -182,49 +494,119 @@ static void pthread_unlock_mutex(threading_t* threading, void* mut) {
     pthread_mutex_unlock(mut);
 }
 
-bool create_builtin_threading(threading_t* threading, size_t count) {
-    if (!count) count = sysconf(_SC_NPROCESSORS_ONLN)*2;
+//Stores one logical CPU of each physical core the process may run on and
+//returns the number of cores
+static size_t get_physical_cores(int* cpus) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+    
+    int packages[CPU_SETSIZE];
+    int cores[CPU_SETSIZE];
+    size_t count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        
+        int ids[2] = {0, cpu};
+        const char* names[2] = {"physical_package_id", "core_id"};
+        for (size_t i = 0; i < 2; i++) {
+            char path[128];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+                     cpu, names[i]);
+            FILE* f = fopen(path, "r");
+            if (!f) continue;
+            if (fscanf(f, "%d", ids+i) != 1) ids[i] = i ? cpu : 0;
+            fclose(f);
+        }
+        
+        size_t i = 0;
+        while (i<count && (packages[i]!=ids[0] || cores[i]!=ids[1])) i++;
+        if (i < count) continue;
+        packages[count] = ids[0];
+        cores[count] = ids[1];
+        cpus[count++] = cpu;
+    }
+    
+    return count;
+}
+
+//By default there is one worker per physical core except the calling
+//thread's. If pin is true, worker i only runs on physical core i+1.
+bool create_builtin_threading(threading_t* threading, size_t count, bool pin) {
+    int cpus[CPU_SETSIZE];
+    size_t cores = get_physical_cores(cpus);
+    if (!count) count = cores>1 ? cores-1 : 0;
+    if (!cores && !count) count = sysconf(_SC_NPROCESSORS_ONLN) - 1;
     if (count > MAX_THREADS) count = MAX_THREADS;
     
     memset(threading->error, 0, sizeof(threading->error));
     threading->destroy = &pthread_destroy;
     threading->run = &pthread_run;
+    threading->submit = &pthread_submit;
+    threading->submit_background = &pthread_submit_background;
+    threading->wait = &pthread_wait;
+    threading->poll = &pthread_poll;
     threading->create_mutex = &pthread_create_mutex;
     threading->destroy_mutex = &pthread_destroy_mutex;
     threading->lock_mutex = &pthread_lock_mutex;
     threading->unlock_mutex = &pthread_unlock_mutex;
-    threading->internal = malloc(sizeof(pthread_internal_t));
-    if (!threading->internal) 
+    threading->internal = aligned_alloc(64, sizeof(pthread_internal_t));
+    if (!threading->internal)
         return set_error(threading, "Failed to allocate threading internal data");
     
     pthread_internal_t* internal = threading->internal;
-    internal->count = count;
-    
-    for (size_t i = 0; i < count; i++) {
-        if (sem_init(internal->end_sems+i, 0, 0) < 0) {
-            free(internal);
-            threading->internal = NULL;
-            return set_error(threading, "Failed to create semaphore");
-        }
-        if (sem_init(internal->begin_sems+i, 0, 0) < 0) {
+    internal->count = 0;
+    internal->generation = 0;
+    internal->generation_waiters = 0;
+    internal->destroy = false;
+    internal->remaining = 0;
+    internal->remaining_waiters = 0;
+    internal->stop_drivers = false;
+    pthread_mutex_init(&internal->run_mutex, NULL);
+    pthread_mutex_init(&internal->task_mutex, NULL);
+    pthread_cond_init(&internal->done_cond, NULL);
+    pthread_queue_t* queues[] = {&internal->queue, &internal->background_queue};
+    for (size_t i = 0; i < 2; i++) {
+        queues[i]->internal = internal;
+        queues[i]->first_task = NULL;
+        queues[i]->last_task = NULL;
+        pthread_cond_init(&queues[i]->task_cond, NULL);
+        if (pthread_create(&queues[i]->driver, NULL, &pthread_driver_func, queues[i])) {
+            pthread_cond_destroy(&queues[i]->task_cond);
+            stop_drivers(internal, i);
             free(internal);
             threading->internal = NULL;
-            return set_error(threading, "Failed to create semaphore");
+            return set_error(threading, "Failed to create driver thread");
         }
     }
     
-    for (size_t i = 0; i < internal->count; i++) {
-        internal->data[i].begin_sem = internal->begin_sems + i;
-        internal->data[i].end_sem = internal->end_sems + i;
-        internal->data[i].destroy = false;
+    for (size_t i = 0; i <= count; i++) {
+        internal->data[i].internal = internal;
+        internal->data[i].job = &internal->job;
+        internal->data[i].index = i;
+        internal->data[i].ran = false;
+        internal->data[i].spins = 1024;
     }
     
-    for (size_t i = 0; i < count; i++)
-        if (pthread_create(internal->threads+i, NULL, &pthread_func, internal->data+i)) {
-            free(internal);
+    for (size_t i = 0; i < count; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (pin && cores) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[(i+1)%cores], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        
+        pthread_data_t* data = internal->data + i + 1;
+        bool success = !pthread_create(internal->threads+i, &attr, &pthread_func, data);
+        pthread_attr_destroy(&attr);
+        if (!success) {
+            pthread_destroy(threading);
             threading->internal = NULL;
             return set_error(threading, "Failed to create thread");
         }
+        internal->count++;
+    }
     
     return true;
 }
@@ -0,0 +1,143 @@
+#ifndef VM_H
+#define VM_H
+#include "runtime.h"
+#include "rand.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VM_COMPUTED_GOTO
+
+//A loop running for longer than this fails the simulation instead of stalling
+//every other particle in its block
+#define VM_MAX_LOOP_ITERATIONS 1048576
+
+//Larger values of system_t::tile_size are clamped to this
+#define VM_MAX_TILE_SIZE 1024
+
+//Converts a block of the kernel's width between an attribute and a register
+typedef void (*vm_load_func_t)(void* dest, const void* attribute, size_t offset);
+typedef void (*vm_store_func_t)(void* attribute, const void* src, size_t offset);
+typedef void (*vm_store_column_func_t)(void* attribute, const float* src, size_t offset,
+                                       size_t count);
+
+//Pre-decoded instruction. Programs are translated into these by
+//vm_create_program().
+typedef struct vm_inst_t {
+    void* handler; //Set by the kernel's resolve_handlers()
+    uint8_t op;
+    //The operand registers in bytecode order. For BC_OP_COND_BEGIN this is
+    //the condition followed by the range of registers written by the body and
+    //for BC_OP_WHILE_BEGIN the condition followed by the ranges written by the
+    //condition and the body.
+    uint8_t r[5];
+    union {
+        float imm; //BC_OP_MOVF
+        struct {
+            const struct vm_inst_t* body; //BC_OP_WHILE_BEGIN
+            const struct vm_inst_t* end; //The instruction after the block
+        };
+    };
+} vm_inst_t;
+
+//Stored in program_t::backend_internal
+typedef struct vm_program_t {
+    size_t reg_count; //One more than the highest register used
+    //Most registers the SIMD interpreter saves at once around masked blocks
+    size_t save_count;
+    vm_inst_t insts[];
+} vm_program_t;
+
+typedef struct vm_kernel_t {
+    const char* name;
+    size_t width;
+    thread_func_t simulate;
+    void (*resolve_handlers)(vm_inst_t* insts, size_t count);
+    vm_load_func_t load[ATTR_FLOAT64+1];
+    vm_store_func_t store[ATTR_FLOAT64+1];
+    vm_store_column_func_t store_column[ATTR_FLOAT64+1];
+} vm_kernel_t;
+
+typedef struct vm_attr_funcs_t {
+    uint8_t index;
+    vm_load_func_t load;
+    vm_store_func_t store;
+} vm_attr_funcs_t;
+
+//Larger bursts of emitted particles are stored by the thread pool
+#define VM_PARALLEL_EMIT_COUNT 4096
+
+//Stored in system_t::backend_internal. Resolved once in create_system.
+typedef struct vm_system_t {
+    vm_attr_funcs_t sim_attrs[256];
+    //Attribute values of the particles emitted by the current frame. They are
+    //spawned and stored together once the emitter has finished.
+    float* emit_columns[256];
+    size_t emit_count;
+    size_t emit_capacity;
+    void* jit; //Used by the LLVM backend, which runs systems in the VM until they are compiled
+} vm_system_t;
+
+//One instance of vm_simd.c is compiled per instruction set
+extern const vm_kernel_t vm_kernel_generic;
+extern const vm_kernel_t vm_kernel_sse;
+extern const vm_kernel_t vm_kernel_avx;
+extern const vm_kernel_t vm_kernel_avx2;
+extern const vm_kernel_t vm_kernel_avx512;
+
+typedef struct vm_rand_t {
+    uint32_t key;
+    uint32_t counter;
+} vm_rand_t;
+
+//Also used by the LLVM backend
+bool vm_backend(backend_t* backend);
+
+float load_attr1(void* attribute, attr_dtype_t dtype, size_t index);
+void store_attr1(float val, void* attribute, attr_dtype_t dtype, size_t index);
+//live_bits is NULL for emitter programs
+bool vm_execute1(const uint8_t* bc, const uint64_t* live_bits, size_t index,
+                 system_t* system, float* regs, vm_rand_t* rand, bool cond);
+
+#ifdef VM_COMPUTED_GOTO
+#define DISPATCH goto* dispatch_table[*bc++]
+#define BEGIN_CASE(op) op: {
+#define END_CASE DISPATCH; }
+#else
+#define BEGIN_CASE(op) case op: {
+#define END_CASE break;}
+#endif
+
+#define DT static void* dispatch_table[] = {\
+    [BC_OP_ADD]=&&BC_OP_ADD,\
+    [BC_OP_SUB]=&&BC_OP_SUB,\
+    [BC_OP_MUL]=&&BC_OP_MUL,\
+    [BC_OP_DIV]=&&BC_OP_DIV,\
+    [BC_OP_POW]=&&BC_OP_POW,\
+    [BC_OP_MOVF]=&&BC_OP_MOVF,\
+    [BC_OP_SQRT]=&&BC_OP_SQRT,\
+    [BC_OP_DELETE]=&&BC_OP_DELETE,\
+    [BC_OP_LESS]=&&BC_OP_LESS,\
+    [BC_OP_GREATER]=&&BC_OP_GREATER,\
+    [BC_OP_EQUAL]=&&BC_OP_EQUAL,\
+    [BC_OP_BOOL_AND]=&&BC_OP_BOOL_AND,\
+    [BC_OP_BOOL_OR]=&&BC_OP_BOOL_OR,\
+    [BC_OP_BOOL_NOT]=&&BC_OP_BOOL_NOT,\
+    [BC_OP_SEL]=&&BC_OP_SEL,\
+    [BC_OP_COND_BEGIN]=&&BC_OP_COND_BEGIN,\
+    [BC_OP_COND_END]=&&BC_OP_COND_END,\
+    [BC_OP_WHILE_BEGIN]=&&BC_OP_WHILE_BEGIN,\
+    [BC_OP_WHILE_END_COND]=&&BC_OP_WHILE_END_COND,\
+    [BC_OP_WHILE_END]=&&BC_OP_WHILE_END,\
+    [BC_OP_END]=&&BC_OP_END,\
+    [BC_OP_EMIT]=&&BC_OP_EMIT,\
+    [BC_OP_RAND]=&&BC_OP_RAND,\
+    [BC_OP_FLOOR]=&&BC_OP_FLOOR,\
+    [BC_OP_MOV]=&&BC_OP_MOV,\
+    [BC_OP_FMA]=&&BC_OP_FMA,\
+    [BC_OP_FMS]=&&BC_OP_FMS,\
+    [BC_OP_FNMA]=&&BC_OP_FNMA,\
+    [BC_OP_SEL_LESS]=&&BC_OP_SEL_LESS,\
+    [BC_OP_SEL_GREATER]=&&BC_OP_SEL_GREATER};
+#endif
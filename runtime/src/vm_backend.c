@@ -1,249 +1,12 @@
-#define VM_COMPUTED_GOTO
-#define VM_AVX
-
-#if !defined(__AVX__) && defined(VM_AVX)
-#undef VM_AVX
-#endif
-
-#include "runtime.h"
+#include "vm.h"
 
 #include <string.h>
 #include <endian.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
-#ifdef VM_AVX
-#include <immintrin.h>
-#endif
-
-float randf() {
-    return rand() / (float)RAND_MAX;
-}
-
-#ifdef VM_AVX
-typedef __m256 simd8f_t;
-
-static void simd8f_add(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    *dest = _mm256_add_ps(a, b);
-}
-
-static void simd8f_sub(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    *dest = _mm256_sub_ps(a, b);
-}
-
-static void simd8f_mul(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    *dest = _mm256_mul_ps(a, b);
-}
-
-static void simd8f_div(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    *dest = _mm256_div_ps(a, b);
-}
-
-static void simd8f_pow(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    //*dest = _mm256_pow_ps(a, b);
-    float af[8];
-    _mm256_storeu_ps(af, a);
-    float bf[8];
-    _mm256_storeu_ps(bf, b);
-    float df[8];
-    for (uint_fast8_t i = 0; i < 8; i++) df[i] = powf(af[i], bf[i]);
-    *dest = _mm256_loadu_ps(df);
-}
-
-static void simd8f_less(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    *dest = _mm256_cmp_ps(a, b, _CMP_LT_OQ);
-}
-
-static void simd8f_greater(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    *dest = _mm256_cmp_ps(a, b, _CMP_GT_OQ);
-}
-
-static void simd8f_equal(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    *dest = _mm256_cmp_ps(a, b, _CMP_EQ_OQ);
-}
-
-static void simd8f_sqrt(simd8f_t* dest, simd8f_t a) {
-    *dest = _mm256_sqrt_ps(a);
-}
-
-static void simd8f_bool_and(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    uint32_t ai[8];
-    _mm256_storeu_ps((float*)ai, a);
-    uint32_t bi[8];
-    _mm256_storeu_ps((float*)bi, b);
-    uint32_t di[8];
-    for (uint_fast8_t i = 0; i < 8; i++) di[i] = ai[i] && bi[i];
-    *dest = _mm256_loadu_ps((float*)di);
-}
-
-static void simd8f_bool_or(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    uint32_t ai[8];
-    _mm256_storeu_ps((float*)ai, a);
-    uint32_t bi[8];
-    _mm256_storeu_ps((float*)bi, b);
-    uint32_t di[8];
-    for (uint_fast8_t i = 0; i < 8; i++) di[i] = ai[i] || bi[i];
-    *dest = _mm256_loadu_ps((float*)di);
-}
-
-static void simd8f_bool_not(simd8f_t* dest, simd8f_t a) {
-    uint32_t ai[8];
-    _mm256_storeu_ps((float*)ai, a);
-    uint32_t di[8];
-    for (uint_fast8_t i = 0; i < 8; i++) di[i] = !ai[i];
-    *dest = _mm256_loadu_ps((float*)di);
-}
-
-static void simd8f_sel(simd8f_t* dest, simd8f_t a, simd8f_t b, simd8f_t cond) {
-    //__mmask8 mask = _mm256_cmp_epu32_mask(*(__m256i*)&cond, _mm256_set1_epi32(0), /*_MM_CMPINT_NEQ*/4);
-    //*dest = _mm256_mask_blend_ps(mask, a, b);
-    *dest = _mm256_or_ps(_mm256_and_ps(*(__m256*)&a, *(__m256*)&cond),
-                         _mm256_andnot_ps(*(__m256*)&cond, *(__m256*)&b));
-    /*uint32_t* condi = (uint32_t*)&cond;
-    float* af = (float*)&a;
-    float* bf = (float*)&b;
-    float destf[8];
-    for (uint_fast8_t i = 0; i < 8; i++) destf[i] = condi[i] ? af[i] : bf[i];
-    *dest = _mm256_loadu_ps(destf);*/
-}
-
-static void simd8f_floor(simd8f_t* dest, simd8f_t a) {
-    *dest = _mm256_floor_ps(a);
-}
-
-static void simd8f_init1(simd8f_t* dest, float v) {
-    *dest = _mm256_set1_ps(v);
-}
-
-static void simd8f_init(simd8f_t* dest, const float* v) {
-    *dest = _mm256_loadu_ps(v);
-}
-
-static void simd8f_get(simd8f_t v, float* dest) {
-    _mm256_storeu_ps(dest, v);
-}
-#else
-typedef struct {union {float v[8]; uint32_t i[8];};} simd8f_t;
-
-static void simd8f_add(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->v[i] = a.v[i] + b.v[i];
-}
 
-static void simd8f_sub(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->v[i] = a.v[i] - b.v[i];
-}
-
-static void simd8f_mul(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->v[i] = a.v[i] * b.v[i];
-}
-
-static void simd8f_div(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->v[i] = a.v[i] / b.v[i];
-}
-
-static void simd8f_pow(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->v[i] = powf(a.v[i], b.v[i]);
-}
-
-static void simd8f_sqrt(simd8f_t* dest, simd8f_t a) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->v[i] = sqrt(a.v[i]);
-}
-
-static void simd8f_less(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->i[i] = a.v[i] < b.v[i];
-}
-
-static void simd8f_greater(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->i[i] = a.v[i] > b.v[i];
-}
-
-static void simd8f_equal(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->i[i] = a.v[i] == b.v[i];
-}
-
-static void simd8f_bool_and(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->i[i] = a.i[i] && b.i[i];
-}
-
-static void simd8f_bool_or(simd8f_t* dest, simd8f_t a, simd8f_t b) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->i[i] = a.i[i] || b.i[i];
-}
-
-static void simd8f_bool_not(simd8f_t* dest, simd8f_t a) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->i[i] = !a.i[i];
-}
-
-static void simd8f_sel(simd8f_t* dest, simd8f_t a, simd8f_t b, simd8f_t cond) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->v[i] = cond.i[i] ? a.v[i] : b.v[i];
-}
-
-static void simd8f_floor(simd8f_t* dest, simd8f_t a) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->v[i] = floorf(a.v[i]);
-}
-
-static void simd8f_init1(simd8f_t* dest, float v) {
-    for (uint_fast8_t i = 0; i < 8; i++) dest->v[i] = v;
-}
-
-static void simd8f_init(simd8f_t* dest, const float* v) {
-    memcpy(dest, v, sizeof(float)*8);
-}
-
-static void simd8f_get(simd8f_t v, float* dest) {
-    memcpy(dest, &v, sizeof(float)*8);
-}
-#endif
-
-static void simd8f_rand(simd8f_t *dest) {
-    for (uint_fast8_t i = 0; i < 8; i++) ((float*)dest)[i] = randf();
-}
-
-#ifdef VM_COMPUTED_GOTO
-#define DISPATCH goto* dispatch_table[*bc++]
-#define BEGIN_CASE(op) op: {
-#define END_CASE DISPATCH; }
-#else
-#define BEGIN_CASE(op) case op: {
-#define END_CASE break;}
-#endif
-
-static void load_attr(float* val, void* attribute, attr_dtype_t dtype, size_t offset) {
-    switch (dtype) {
-    case ATTR_UINT8:
-        for (size_t i = 0; i < 8; i++)
-            val[i] = ((uint8_t*)attribute)[i+offset] / 255.0f;
-        break;
-    case ATTR_INT8:
-        for (size_t i = 0; i < 8; i++)
-            val[i] = ((int8_t*)attribute)[i+offset] / 127.0f;
-        break;
-    case ATTR_UINT16:
-        for (size_t i = 0; i < 8; i++)
-            val[i] = ((uint16_t*)attribute)[i+offset] / 65535.0f;
-        break;
-    case ATTR_INT16:
-        for (size_t i = 0; i < 8; i++)
-            val[i] = ((int16_t*)attribute)[i+offset] / 32767.0f;
-        break;
-    case ATTR_UINT32:
-        for (size_t i = 0; i < 8; i++)
-            val[i] = ((uint32_t*)attribute)[i+offset] / 4294967295.0;
-        break;
-    case ATTR_INT32:
-        for (size_t i = 0; i < 8; i++)
-            val[i] = ((int32_t*)attribute)[i+offset] / 2147483647.0;
-        break;
-    case ATTR_FLOAT32:
-        memcpy(val, ((float*)attribute)+offset, sizeof(float)*8);
-        break;
-    case ATTR_FLOAT64:
-        for (size_t i = 0; i < 8; i++)
-            val[i] = ((double*)attribute)[i+offset];
-        break;
-    }
-}
-
-static float load_attr1(void* attribute, attr_dtype_t dtype, size_t index) {
+float load_attr1(void* attribute, attr_dtype_t dtype, size_t index) {
     switch (dtype) {
     case ATTR_UINT8:
         return ((uint8_t*)attribute)[index] / 255.0f;
@@ -268,61 +31,36 @@ static float load_attr1(void* attribute, attr_dtype_t dtype, size_t index) {
     return 0.0f;
 }
 
-static void store_attr(const float* val, void* attribute, attr_dtype_t dtype, size_t offset) {
-    switch (dtype) {
-    case ATTR_UINT8:
-        for (size_t i = 0; i < 8; i++)
-            ((uint8_t*)attribute)[i+offset] = val[i] * 255.0f;
-        break;
-    case ATTR_INT8:
-        for (size_t i = 0; i < 8; i++)
-            ((int8_t*)attribute)[i+offset] = val[i] * 127.0f;
-        break;
-    case ATTR_UINT16:
-        for (size_t i = 0; i < 8; i++)
-            ((uint16_t*)attribute)[i+offset] = val[i] * 65535.0f;
-        break;
-    case ATTR_INT16:
-        for (size_t i = 0; i < 8; i++)
-            ((int16_t*)attribute)[i+offset] = val[i] * 32767.0f;
-        break;
-    case ATTR_UINT32:
-        for (size_t i = 0; i < 8; i++)
-            ((uint32_t*)attribute)[i+offset] = val[i] * 4294967295.0;
-        break;
-    case ATTR_INT32:
-        for (size_t i = 0; i < 8; i++)
-            ((int32_t*)attribute)[i+offset] = val[i] * 2147483647.0;
-        break;
-    case ATTR_FLOAT32:
-        memcpy(((float*)attribute)+offset, val, sizeof(float)*8);
-        break;
-    case ATTR_FLOAT64:
-        for (size_t i = 0; i < 8; i++)
-            ((double*)attribute)[i+offset] = val[i];
-        break;
-    }
+static float clampf(float v, float min, float max) {
+    v = v < min ? min : v;
+    return v > max ? max : v;
+}
+
+static double clamp(double v, double min, double max) {
+    v = v < min ? min : v;
+    return v > max ? max : v;
 }
 
-static void store_attr1(float val, void* attribute, attr_dtype_t dtype, size_t index) {
+//Values outside of the range of the dtype saturate
+void store_attr1(float val, void* attribute, attr_dtype_t dtype, size_t index) {
     switch (dtype) {
     case ATTR_UINT8:
-        ((uint8_t*)attribute)[index] = val * 255.0f;
+        ((uint8_t*)attribute)[index] = clampf(val*255.0f, 0.0f, 255.0f);
         break;
     case ATTR_INT8:
-        ((int8_t*)attribute)[index] = val * 127.0f;
+        ((int8_t*)attribute)[index] = clampf(val*127.0f, -128.0f, 127.0f);
         break;
     case ATTR_UINT16:
-        ((uint16_t*)attribute)[index] = val * 65535.0f;
+        ((uint16_t*)attribute)[index] = clampf(val*65535.0f, 0.0f, 65535.0f);
         break;
     case ATTR_INT16:
-        ((int16_t*)attribute)[index] = val * 32767.0f;
+        ((int16_t*)attribute)[index] = clampf(val*32767.0f, -32768.0f, 32767.0f);
         break;
     case ATTR_UINT32:
-        ((uint32_t*)attribute)[index] = val * 4294967295.0;
+        ((uint32_t*)attribute)[index] = clamp(val*4294967295.0, 0.0, 4294967295.0);
         break;
     case ATTR_INT32:
-        ((int32_t*)attribute)[index] = val * 2147483647.0;
+        ((int32_t*)attribute)[index] = clamp(val*2147483647.0, -2147483648.0, 2147483647.0);
         break;
     case ATTR_FLOAT32:
         ((float*)attribute)[index] = val;
@@ -333,34 +71,40 @@ static void store_attr1(float val, void* attribute, attr_dtype_t dtype, size_t i
     }
 }
 
-#define DT static void* dispatch_table[] = {\
-    [BC_OP_ADD]=&&BC_OP_ADD,\
-    [BC_OP_SUB]=&&BC_OP_SUB,\
-    [BC_OP_MUL]=&&BC_OP_MUL,\
-    [BC_OP_DIV]=&&BC_OP_DIV,\
-    [BC_OP_POW]=&&BC_OP_POW,\
-    [BC_OP_MOVF]=&&BC_OP_MOVF,\
-    [BC_OP_SQRT]=&&BC_OP_SQRT,\
-    [BC_OP_DELETE]=&&BC_OP_DELETE,\
-    [BC_OP_LESS]=&&BC_OP_LESS,\
-    [BC_OP_GREATER]=&&BC_OP_GREATER,\
-    [BC_OP_EQUAL]=&&BC_OP_EQUAL,\
-    [BC_OP_BOOL_AND]=&&BC_OP_BOOL_AND,\
-    [BC_OP_BOOL_OR]=&&BC_OP_BOOL_OR,\
-    [BC_OP_BOOL_NOT]=&&BC_OP_BOOL_NOT,\
-    [BC_OP_SEL]=&&BC_OP_SEL,\
-    [BC_OP_COND_BEGIN]=&&BC_OP_COND_BEGIN,\
-    [BC_OP_COND_END]=&&BC_OP_COND_END,\
-    [BC_OP_WHILE_BEGIN]=&&BC_OP_WHILE_BEGIN,\
-    [BC_OP_WHILE_END_COND]=&&BC_OP_WHILE_END_COND,\
-    [BC_OP_WHILE_END]=&&BC_OP_WHILE_END,\
-    [BC_OP_END]=&&BC_OP_END,\
-    [BC_OP_EMIT]=&&BC_OP_EMIT,\
-    [BC_OP_RAND]=&&BC_OP_RAND,\
-    [BC_OP_FLOOR]=&&BC_OP_FLOOR,\
-    [BC_OP_MOV]=&&BC_OP_MOV};
+//Appends a particle to the emit columns. Attributes not written by the
+//instruction are zero.
+static bool emit_particle(system_t* system, const float* regs, const uint8_t* operands,
+                          uint8_t count) {
+    vm_system_t* vm_system = system->backend_internal;
+    particles_t* particles = system->particles;
+    size_t attribute_count = system->emit_program->attribute_count;
+    
+    if (vm_system->emit_count == particles->pool_size-particles->pool_usage)
+        return set_error(system->runtime, "Pool is full");
+    
+    if (vm_system->emit_count == vm_system->emit_capacity) {
+        size_t capacity = vm_system->emit_capacity ? vm_system->emit_capacity*2 : 256;
+        for (size_t i = 0; i < attribute_count; i++) {
+            float* column = realloc(vm_system->emit_columns[i], capacity*sizeof(float));
+            if (!column) return set_error(system->runtime, "Failed to allocate emitted particles");
+            vm_system->emit_columns[i] = column;
+        }
+        vm_system->emit_capacity = capacity;
+    }
+    
+    size_t index = vm_system->emit_count++;
+    for (size_t i = 0; i < attribute_count; i++)
+        vm_system->emit_columns[i][index] = i<count ? regs[operands[i]] : 0.0f;
+    
+    return true;
+}
+
+//A particle can delete itself while it is simulated
+static bool is_deleted(const uint64_t* live_bits, size_t index) {
+    return live_bits && !(__atomic_load_n(&live_bits[index/64], __ATOMIC_RELAXED)>>index%64 & 1);
+}
 
-static bool vm_execute1(const uint8_t* bc, const uint8_t* deleted_flags, size_t index, system_t* system, float* regs, bool cond) {
+bool vm_execute1(const uint8_t* bc, const uint64_t* live_bits, size_t index, system_t* system, float* regs, vm_rand_t* rand, bool cond) {
     #ifdef VM_COMPUTED_GOTO
     DT
     DISPATCH;
@@ -418,36 +162,36 @@ static bool vm_execute1(const uint8_t* bc, const uint8_t* deleted_flags, size_t
             uint8_t d = *bc++;
             uint8_t a = *bc++;
             uint8_t b = *bc++;
-            ((uint32_t*)regs)[d] = regs[a] < regs[b];
+            ((uint32_t*)regs)[d] = regs[a] < regs[b] ? UINT32_MAX : 0;
         END_CASE
         BEGIN_CASE(BC_OP_GREATER)
             uint8_t d = *bc++;
             uint8_t a = *bc++;
             uint8_t b = *bc++;
-            ((uint32_t*)regs)[d] = regs[a] > regs[b];
+            ((uint32_t*)regs)[d] = regs[a] > regs[b] ? UINT32_MAX : 0;
         END_CASE
         BEGIN_CASE(BC_OP_EQUAL)
             uint8_t d = *bc++;
             uint8_t a = *bc++;
             uint8_t b = *bc++;
-            ((uint32_t*)regs)[d] = regs[a] == regs[b];
+            ((uint32_t*)regs)[d] = regs[a] == regs[b] ? UINT32_MAX : 0;
         END_CASE
         BEGIN_CASE(BC_OP_BOOL_AND)
             uint8_t d = *bc++;
             uint8_t a = *bc++;
             uint8_t b = *bc++;
-            ((uint32_t*)regs)[d] = ((uint32_t*)regs)[a] && ((uint32_t*)regs)[b];
+            ((uint32_t*)regs)[d] = ((uint32_t*)regs)[a] && ((uint32_t*)regs)[b] ? UINT32_MAX : 0;
         END_CASE
         BEGIN_CASE(BC_OP_BOOL_OR)
             uint8_t d = *bc++;
             uint8_t a = *bc++;
             uint8_t b = *bc++;
-            ((uint32_t*)regs)[d] = ((uint32_t*)regs)[a] || ((uint32_t*)regs)[b];
+            ((uint32_t*)regs)[d] = ((uint32_t*)regs)[a] || ((uint32_t*)regs)[b] ? UINT32_MAX : 0;
         END_CASE
         BEGIN_CASE(BC_OP_BOOL_NOT)
             uint8_t d = *bc++;
             uint8_t a = *bc++;
-            ((uint32_t*)regs)[d] = !((uint32_t*)regs)[a];
+            ((uint32_t*)regs)[d] = ((uint32_t*)regs)[a] ? 0 : UINT32_MAX;
         END_CASE
         BEGIN_CASE(BC_OP_SEL)
             uint8_t d = *bc++;
@@ -460,7 +204,7 @@ static bool vm_execute1(const uint8_t* bc, const uint8_t* deleted_flags, size_t
             uint8_t c = *bc++;
             uint32_t count = *(uint32_t*)bc;
             bc += 6;
-            if (deleted_flags[index] || !((uint32_t*)regs)[c])
+            if (is_deleted(live_bits, index) || !((uint32_t*)regs)[c])
                 bc += le32toh(count);
         END_CASE
         BEGIN_CASE(BC_OP_COND_END)
@@ -475,12 +219,14 @@ static bool vm_execute1(const uint8_t* bc, const uint8_t* deleted_flags, size_t
             
             const uint8_t* body_bc = bc + cond_count;
             
-            if (!deleted_flags[index])
-                while (true) {
-                    if (!vm_execute1(bc, deleted_flags, index, system, regs, true))
+            if (!is_deleted(live_bits, index))
+                for (uint_fast32_t iter = 0;; iter++) {
+                    if (!vm_execute1(bc, live_bits, index, system, regs, rand, true))
                         return false;
                     if (!((uint32_t*)regs)[c]) break;
-                    if (!vm_execute1(body_bc, deleted_flags, index, system, regs, true))
+                    if (iter == VM_MAX_LOOP_ITERATIONS)
+                        return set_error(system->runtime, "Loop iteration limit exceeded");
+                    if (!vm_execute1(body_bc, live_bits, index, system, regs, rand, true))
                         return false;
                 }
             
@@ -496,19 +242,11 @@ static bool vm_execute1(const uint8_t* bc, const uint8_t* deleted_flags, size_t
             return true;
         END_CASE
         BEGIN_CASE(BC_OP_EMIT)
-            int particle_index = spawn_particle(system->particles);
-            if (particle_index < 0) return false;
-            
-            uint8_t count = *bc++;
-            for (size_t i = 0; i < count; i++) { //TODO: Use sim_attribute_indices with simulation programs
-                int attr_index = system->emit_attribute_indices[i];
-                store_attr1(regs[*bc++], system->particles->attributes[attr_index],
-                            system->particles->attribute_dtypes[attr_index],
-                            particle_index);
-            }
+            if (!emit_particle(system, regs, bc+1, *bc)) return false;
+            bc += *bc + 1;
         END_CASE
         BEGIN_CASE(BC_OP_RAND)
-            regs[*bc++] = randf();
+            regs[*bc++] = rand_float(rand->key, index, rand->counter++);
         END_CASE
         BEGIN_CASE(BC_OP_FLOOR)
             uint8_t d = *bc++;
@@ -519,273 +257,31 @@ static bool vm_execute1(const uint8_t* bc, const uint8_t* deleted_flags, size_t
             regs[bc[0]] = regs[bc[1]];
             bc += 2;
         END_CASE
-    #ifndef VM_COMPUTED_GOTO
-        default: {break;}
-        }
-    }
-    #endif
-}
-
-static bool vm_execute8(const program_t* program, size_t offset, system_t* system, uint8_t* attr_indices, float* uniforms) {
-    bool deleted = true;
-    for (uint_fast8_t i = 0; i < 8; i++)
-        deleted = deleted && system->particles->deleted_flags[offset+i];
-    if (deleted) return true;
-    
-    const uint8_t* bc = program->bc;
-    simd8f_t regs[256];
-    
-    for (size_t i = 0; i < program->attribute_count; i++) {
-        float val[8];
-        int index = attr_indices[i];
-        load_attr(val, system->particles->attributes[index],
-                  system->particles->attribute_dtypes[index], offset);
-        simd8f_init(regs+program->attribute_load_regs[i], val);
-    }
-    
-    for (size_t i = 0; i < program->uniform_count; i++)
-        simd8f_init1(regs+program->uniform_regs[i], uniforms[i]);
-    
-    #ifdef VM_COMPUTED_GOTO
-    DT
-    DISPATCH;
-    #else
-    while (true) {
-        bc_op_t op = *bc++;
-        switch (op) {
-    #endif
-        BEGIN_CASE(BC_OP_ADD)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            simd8f_add(regs+d, regs[a], regs[b]);
-        END_CASE
-        BEGIN_CASE(BC_OP_SUB)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            simd8f_sub(regs+d, regs[a], regs[b]);
-        END_CASE
-        BEGIN_CASE(BC_OP_MUL)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            simd8f_mul(regs+d, regs[a], regs[b]);
-        END_CASE
-        BEGIN_CASE(BC_OP_DIV)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            simd8f_div(regs+d, regs[a], regs[b]);
-        END_CASE
-        BEGIN_CASE(BC_OP_POW)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            simd8f_pow(regs+d, regs[a], regs[b]);
-        END_CASE
-        BEGIN_CASE(BC_OP_MOVF)
-            uint8_t d = *bc++;
-            float f = *(const float*)bc;
+        BEGIN_CASE(BC_OP_FMA)
+            regs[bc[0]] = regs[bc[1]]*regs[bc[2]] + regs[bc[3]];
             bc += 4;
-            simd8f_init1(regs+d, f);
-        END_CASE
-        BEGIN_CASE(BC_OP_SQRT)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            simd8f_sqrt(regs+d, regs[a]);
-        END_CASE
-        BEGIN_CASE(BC_OP_DELETE)
-            for (uint_fast8_t i = 0; i < 8; i++)
-                if (!system->particles->deleted_flags[i])
-                    delete_particle(system->particles, offset+i);
-            goto end;
-        END_CASE
-        BEGIN_CASE(BC_OP_LESS)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            simd8f_less(regs+d, regs[a], regs[b]);
-        END_CASE
-        BEGIN_CASE(BC_OP_GREATER)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            simd8f_greater(regs+d, regs[a], regs[b]);
-        END_CASE
-        BEGIN_CASE(BC_OP_EQUAL)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            simd8f_equal(regs+d, regs[a], regs[b]);
         END_CASE
-        BEGIN_CASE(BC_OP_BOOL_AND)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            simd8f_bool_and(regs+d, regs[a], regs[b]);
-        END_CASE
-        BEGIN_CASE(BC_OP_BOOL_OR)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            simd8f_bool_or(regs+d, regs[a], regs[b]);
-        END_CASE
-        BEGIN_CASE(BC_OP_BOOL_NOT)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            simd8f_bool_not(regs+d, regs[a]);
-        END_CASE
-        BEGIN_CASE(BC_OP_SEL)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            uint8_t b = *bc++;
-            uint8_t cond = *bc++;
-            simd8f_sel(regs+d, regs[a], regs[b], regs[cond]);
-        END_CASE
-        BEGIN_CASE(BC_OP_COND_BEGIN)
-            uint8_t c = *bc++;
-            uint32_t count = *(uint32_t*)bc;
+        BEGIN_CASE(BC_OP_FMS)
+            regs[bc[0]] = regs[bc[1]]*regs[bc[2]] - regs[bc[3]];
             bc += 4;
-            unsigned int rmin = *bc++;
-            unsigned int rmax = *bc++;
-            
-            uint32_t v[8];
-            simd8f_get(regs[c], (float*)v);
-            for (uint_fast8_t i = 0; i < 8; i++) {
-                if (system->particles->deleted_flags[offset+i]) continue;
-                if (!v[i]) continue;
-                
-                float fregs[256];
-                for (uint_fast16_t j = rmin; j < rmax+1; j++)
-                    fregs[j] = ((float*)(regs+j))[i];
-                if (!vm_execute1(bc, system->particles->deleted_flags,
-                                 offset+i, system, fregs, true))
-                    return false;
-                for (uint_fast16_t j = rmin; j < rmax+1; j++)
-                    ((float*)(regs+j))[i] = fregs[j];
-            }
-            bc += le32toh(count);
-        END_CASE
-        BEGIN_CASE(BC_OP_WHILE_END_COND)
-        END_CASE
-        BEGIN_CASE(BC_OP_COND_END)
         END_CASE
-        BEGIN_CASE(BC_OP_WHILE_BEGIN)
-            uint8_t c = *bc++;
-            
-            uint32_t cond_count = *(uint32_t*)bc;
+        BEGIN_CASE(BC_OP_FNMA)
+            regs[bc[0]] = regs[bc[3]] - regs[bc[1]]*regs[bc[2]];
             bc += 4;
-            unsigned int crmin = *bc++;
-            unsigned int crmax = *bc++;
-            
-            uint32_t body_count = *(uint32_t*)bc;
-            bc += 4;
-            unsigned int brmin = *bc++;
-            unsigned int brmax = *bc++;
-            
-            const uint8_t* body_bc = bc + cond_count;
-            
-            for (uint_fast8_t i = 0; i < 8; i++) {
-                if (system->particles->deleted_flags[offset+i]) continue;
-                
-                while (true) {
-                    float fregs[256];
-                    for (uint_fast16_t j = crmin; j < crmax+1; j++)
-                        fregs[j] = ((float*)(regs+j))[i];
-                    if (!vm_execute1(bc, system->particles->deleted_flags,
-                                     offset+i, system, fregs, true))
-                        return false;
-                    for (uint_fast16_t j = crmin; j < crmax+1; j++)
-                        ((float*)(regs+j))[i] = fregs[j];
-                    
-                    if (!((uint32_t*)fregs)[c]) break;
-                    
-                    for (uint_fast16_t j = brmin; j < brmax+1; j++)
-                        fregs[j] = ((float*)(regs+j))[i];
-                    if (!vm_execute1(body_bc, system->particles->deleted_flags,
-                                     offset+i, system, fregs, true))
-                        return false;
-                    for (uint_fast16_t j = brmin; j < brmax+1; j++)
-                        ((float*)(regs+j))[i] = fregs[j];
-                }
-            }
-            
-            bc = body_bc + body_count;
         END_CASE
-        BEGIN_CASE(BC_OP_WHILE_END)
+        BEGIN_CASE(BC_OP_SEL_LESS)
+            regs[bc[0]] = regs[bc[3]] < regs[bc[4]] ? regs[bc[1]] : regs[bc[2]];
+            bc += 5;
         END_CASE
-        BEGIN_CASE(BC_OP_END)
-            goto end;
-        END_CASE
-        BEGIN_CASE(BC_OP_EMIT)
-            //TODO: Not implemented
-        END_CASE
-        BEGIN_CASE(BC_OP_RAND)
-            simd8f_rand(regs + *bc++);
-        END_CASE
-        BEGIN_CASE(BC_OP_FLOOR)
-            uint8_t d = *bc++;
-            uint8_t a = *bc++;
-            simd8f_floor(regs+d, regs[a]);
-        END_CASE
-        BEGIN_CASE(BC_OP_MOV)
-            regs[bc[0]] = regs[bc[1]];
-            bc += 2;
+        BEGIN_CASE(BC_OP_SEL_GREATER)
+            regs[bc[0]] = regs[bc[3]] > regs[bc[4]] ? regs[bc[1]] : regs[bc[2]];
+            bc += 5;
         END_CASE
     #ifndef VM_COMPUTED_GOTO
         default: {break;}
         }
     }
     #endif
-    
-    end:
-    for (size_t i = 0; i < program->attribute_count; i++) {
-        int index = attr_indices[i];
-        store_attr((const float*)(regs+program->attribute_store_regs[i]),
-                   system->particles->attributes[index],
-                   system->particles->attribute_dtypes[index], offset);
-    }
-    return true;
-}
-
-static void* thread_func(size_t begin, size_t count, void* userdata) {
-    system_t* system = userdata;
-    const program_t* p = system->sim_program;
-    
-    size_t end = begin + count;
-    size_t i = begin;
-    for (; (end-i) >= 8; i+=8)
-        if (!vm_execute8(p, i, system, system->sim_attribute_indices, system->sim_uniforms))
-            return (void*)false;
-    
-    for (; i<end; i++) {
-        if (system->particles->deleted_flags[i]) continue;
-        
-        float regs[256];
-        
-        for (size_t j = 0; j < p->attribute_count; j++) {
-            int index = system->sim_attribute_indices[j];
-            void* attr = system->particles->attributes[index];
-            attr_dtype_t dtype = system->particles->attribute_dtypes[index];
-            regs[p->attribute_load_regs[j]] = load_attr1(attr, dtype, i);
-        }
-        
-        for (size_t i = 0; i < p->uniform_count; i++)
-            regs[p->uniform_regs[i]] = system->sim_uniforms[i];
-        
-        if (!vm_execute1(p->bc, system->particles->deleted_flags, i, system, regs, false))
-            return (void*)false;
-        
-        for (size_t j = 0; j < p->attribute_count; j++) {
-            int index = system->sim_attribute_indices[j];
-            store_attr1(regs[p->attribute_store_regs[j]],
-                        system->particles->attributes[index],
-                        system->particles->attribute_dtypes[index], i);
-        }
-    }
-    
-    return (void*)true;
 }
 
 #ifdef VM_COMPUTED_GOTO
@@ -794,7 +290,23 @@ static void* thread_func(size_t begin, size_t count, void* userdata) {
 #undef BEGIN_CASE
 #undef END_CASE
 
+static const vm_kernel_t* select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+        return &vm_kernel_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return &vm_kernel_avx2;
+    if (__builtin_cpu_supports("avx"))
+        return &vm_kernel_avx;
+    return &vm_kernel_sse;
+#else
+    return &vm_kernel_generic;
+#endif
+}
+
 static bool vm_create(runtime_t* runtime) {
+    runtime->backend.internal = (void*)select_kernel();
     return true;
 }
 
@@ -802,47 +314,311 @@ static bool vm_destroy(runtime_t* runtime) {
     return true;
 }
 
+//Returns the number of register operands of instructions without other operands
+static size_t get_reg_count(bc_op_t op) {
+    switch (op) {
+    case BC_OP_RAND: return 1;
+    case BC_OP_SQRT:
+    case BC_OP_BOOL_NOT:
+    case BC_OP_MOV:
+    case BC_OP_FLOOR: return 2;
+    case BC_OP_ADD:
+    case BC_OP_SUB:
+    case BC_OP_MUL:
+    case BC_OP_DIV:
+    case BC_OP_POW:
+    case BC_OP_LESS:
+    case BC_OP_GREATER:
+    case BC_OP_EQUAL:
+    case BC_OP_BOOL_AND:
+    case BC_OP_BOOL_OR: return 3;
+    case BC_OP_FMA:
+    case BC_OP_FMS:
+    case BC_OP_FNMA:
+    case BC_OP_SEL: return 4;
+    case BC_OP_SEL_LESS:
+    case BC_OP_SEL_GREATER: return 5;
+    default: return 0;
+    }
+}
+
+static size_t get_inst_size(const uint8_t* bc) {
+    switch ((bc_op_t)bc[0]) {
+    case BC_OP_MOVF: return 6;
+    case BC_OP_COND_BEGIN: return 8;
+    case BC_OP_WHILE_BEGIN: return 14;
+    case BC_OP_EMIT: return 2 + bc[1];
+    default: return 1 + get_reg_count(bc[0]);
+    }
+}
+
+//Returns the instruction starting at a byte offset if it directly follows an
+//end_op instruction
+static const vm_inst_t* get_target(const program_t* program, const vm_inst_t* insts,
+                                   const uint32_t* indices, size_t offset, bc_op_t end_op) {
+    if (offset<1 || offset>=program->bc_size) return NULL;
+    if (indices[offset]==UINT32_MAX || indices[offset-1]==UINT32_MAX) return NULL;
+    if (program->bc[offset-1] != end_op) return NULL;
+    return insts + indices[offset];
+}
+
+//Returns the most registers saved at once by the blocks in begin..end-1 and
+//the blocks nested in them
+static size_t get_save_count(const vm_inst_t* begin, const vm_inst_t* end) {
+    size_t res = 0;
+    for (const vm_inst_t* inst = begin; inst < end; inst++) {
+        size_t count;
+        if (inst->op == BC_OP_COND_BEGIN) {
+            count = inst->r[2]-inst->r[1]+1 + get_save_count(inst+1, inst->end);
+        } else if (inst->op == BC_OP_WHILE_BEGIN) {
+            size_t cond = get_save_count(inst+1, inst->body);
+            size_t body = get_save_count(inst->body, inst->end);
+            count = inst->r[2]-inst->r[1]+1 + inst->r[4]-inst->r[3]+1 + (cond>body ? cond : body);
+        } else {
+            continue;
+        }
+        res = count>res ? count : res;
+        inst = inst->end - 1;
+    }
+    return res;
+}
+
+//Translates the bytecode so that blocks do not have to decode operands,
+//immediates and branch offsets every time they run it
 static bool vm_create_program(program_t* program) {
+    const vm_kernel_t* kernel = program->runtime->backend.internal;
+    const uint8_t* bc = program->bc;
+    
+    //Index of the instruction starting at each byte or UINT32_MAX
+    uint32_t* indices = malloc(program->bc_size*sizeof(uint32_t));
+    if (!indices && program->bc_size)
+        return set_error(program->runtime, "Failed to allocate instruction indices");
+    
+    size_t count = 0;
+    for (size_t i = 0; i < program->bc_size;) {
+        size_t size = get_inst_size(bc+i);
+        for (size_t j = 0; j < size; j++) indices[i+j] = UINT32_MAX;
+        indices[i] = count++;
+        i += size;
+    }
+    
+    vm_program_t* vm_program = calloc(1, sizeof(vm_program_t)+count*sizeof(vm_inst_t));
+    if (!vm_program) {
+        free(indices);
+        return set_error(program->runtime, "Failed to allocate internal VM program data");
+    }
+    program->backend_internal = vm_program;
+    vm_inst_t* insts = vm_program->insts;
+    
+    bool success = true;
+    vm_inst_t* inst = insts;
+    for (size_t i = 0; i < program->bc_size; i += get_inst_size(bc+i), inst++) {
+        const uint8_t* ops = bc + i + 1;
+        inst->op = bc[i];
+        switch (inst->op) {
+        case BC_OP_MOVF:
+            inst->r[0] = ops[0];
+            memcpy(&inst->imm, ops+1, 4);
+            break;
+        case BC_OP_COND_BEGIN: {
+            uint32_t body_count;
+            memcpy(&body_count, ops+1, 4);
+            inst->r[0] = ops[0];
+            inst->r[1] = ops[5];
+            inst->r[2] = ops[6];
+            size_t end = i + 8 + le32toh(body_count) + 1;
+            inst->end = get_target(program, insts, indices, end, BC_OP_COND_END);
+            success = success && inst->end;
+            break;
+        }
+        case BC_OP_WHILE_BEGIN: {
+            uint32_t cond_count, body_count;
+            memcpy(&cond_count, ops+1, 4);
+            memcpy(&body_count, ops+7, 4);
+            inst->r[0] = ops[0];
+            inst->r[1] = ops[5];
+            inst->r[2] = ops[6];
+            inst->r[3] = ops[11];
+            inst->r[4] = ops[12];
+            size_t body = i + 14 + le32toh(cond_count);
+            inst->body = get_target(program, insts, indices, body, BC_OP_WHILE_END_COND);
+            inst->end = get_target(program, insts, indices, body+le32toh(body_count)+1,
+                                   BC_OP_WHILE_END);
+            success = success && inst->body && inst->end;
+            break;
+        }
+        case BC_OP_EMIT: //Not supported by the SIMD interpreter
+            break;
+        default:
+            memcpy(inst->r, ops, get_reg_count(inst->op));
+            break;
+        }
+    }
+    free(indices);
+    
+    if (!success) {
+        free(vm_program);
+        return set_error(program->runtime, "Invalid branch target");
+    }
+    
+    //Unused operands are zero
+    size_t max_reg = 0;
+    for (size_t i = 0; i < count; i++)
+        for (size_t j = 0; j < 5; j++)
+            max_reg = insts[i].r[j]>max_reg ? insts[i].r[j] : max_reg;
+    for (size_t i = 0; i < program->attribute_count; i++) {
+        max_reg = program->attribute_load_regs[i]>max_reg ? program->attribute_load_regs[i] : max_reg;
+        max_reg = program->attribute_store_regs[i]>max_reg ? program->attribute_store_regs[i] : max_reg;
+    }
+    for (size_t i = 0; i < program->uniform_count; i++)
+        max_reg = program->uniform_regs[i]>max_reg ? program->uniform_regs[i] : max_reg;
+    vm_program->reg_count = max_reg + 1;
+    vm_program->save_count = get_save_count(insts, insts+count);
+    
+    kernel->resolve_handlers(insts, count);
+    
     return true;
 }
 
 static bool vm_destroy_program(program_t* program) {
+    free(program->backend_internal);
     return true;
 }
 
-static bool vm_simulate_system(system_t* system) {
-    const program_t* p = system->emit_program;
-    if (p) {
-        uint8_t d = 0;
-        float regs[256];
-        for (size_t i = 0; i < p->uniform_count; i++)
-            regs[p->uniform_regs[i]] = system->emit_uniforms[i];
-        if (!vm_execute1(p->bc, &d, 0, system, regs, false)) return false;
+static bool vm_create_system(system_t* system) {
+    vm_system_t* vm_system = malloc(sizeof(vm_system_t));
+    if (!vm_system)
+        return set_error(system->runtime, "Failed to allocate internal VM system data");
+    system->backend_internal = vm_system;
+    memset(vm_system->emit_columns, 0, sizeof(vm_system->emit_columns));
+    vm_system->emit_count = 0;
+    vm_system->emit_capacity = 0;
+    vm_system->jit = NULL;
+    
+    const vm_kernel_t* kernel = system->runtime->backend.internal;
+    const program_t* p = system->sim_program;
+    for (size_t i = 0; p && i < p->attribute_count; i++) {
+        uint8_t index = system->sim_attribute_indices[i];
+        attr_dtype_t dtype = system->particles->attribute_dtypes[index];
+        vm_system->sim_attrs[i].index = index;
+        vm_system->sim_attrs[i].load = kernel->load[dtype];
+        vm_system->sim_attrs[i].store = kernel->store[dtype];
     }
     
-    if (system->sim_program) {
+    return true;
+}
+
+static bool vm_destroy_system(system_t* system) {
+    vm_system_t* vm_system = system->backend_internal;
+    for (size_t i = 0; i < 256; i++) free(vm_system->emit_columns[i]);
+    free(vm_system);
+    return true;
+}
+
+typedef struct emit_data_t {
+    system_t* system;
+    const particle_range_t* ranges;
+} emit_data_t;
+
+//Stores emitted particles. Each range of particles is stored together.
+static void* store_emitted_func(size_t begin, size_t count, void* userdata) {
+    emit_data_t* data = userdata;
+    system_t* system = data->system;
+    const vm_system_t* vm_system = system->backend_internal;
+    const vm_kernel_t* kernel = system->runtime->backend.internal;
+    
+    const particle_range_t* range = data->ranges;
+    size_t offset = 0;
+    for (; offset+range->count <= begin; range++) offset += range->count;
+    
+    size_t end = begin + count;
+    for (size_t i = begin; i < end; range++) {
+        size_t run = offset+range->count<end ? offset+range->count-i : end-i;
+        for (size_t j = 0; j < system->emit_program->attribute_count; j++) {
+            int index = system->emit_attribute_indices[j];
+            attr_dtype_t dtype = system->particles->attribute_dtypes[index];
+            kernel->store_column[dtype](system->particles->attributes[index],
+                                        vm_system->emit_columns[j]+i,
+                                        range->begin+i-offset, run);
+        }
+        offset += range->count;
+        i += run;
+    }
+    
+    return (void*)true;
+}
+
+static bool spawn_emitted(system_t* system, bool parallel) {
+    vm_system_t* vm_system = system->backend_internal;
+    size_t count = vm_system->emit_count;
+    if (!count) return true;
+    
+    //emit_particle() does not emit more particles than the pool has room for
+    particle_range_t* ranges = malloc(count*sizeof(particle_range_t));
+    if (!ranges) return set_error(system->runtime, "Failed to allocate emitted particle ranges");
+    for (size_t i = 0, spawned = 0; spawned < count; i++) {
+        if (!spawn_particles(system->particles, count-spawned, &ranges[i])) {
+            free(ranges);
+            return false;
+        }
+        spawned += ranges[i].count;
+    }
+    
+    emit_data_t data = {.system = system, .ranges = ranges};
+    if (count<VM_PARALLEL_EMIT_COUNT || !parallel) {
+        store_emitted_func(0, count, &data);
+    } else {
         threading_t* threading = &system->runtime->threading;
-        thread_run_t run = (thread_run_t){.func = &thread_func,
-                                          .count=system->particles->pool_size,
-                                          .data=system};
-        thread_res_t res = threading_run(threading, run);
+        thread_res_t res = threading_run(threading, (thread_run_t){.func = &store_emitted_func,
+                                                                   .count = count,
+                                                                   .data = &data});
         if (!res.success) {
             strncpy(system->runtime->error, threading->error, sizeof(system->runtime->error)-1);
+            free(ranges);
             return false;
         }
-        
-        for (size_t i = 0; i < res.count; i++)
-            if (!res.res[i]) return false;
     }
     
+    free(ranges);
     return true;
 }
 
+static bool vm_begin_frame(system_t* system) {
+    system->sim_tier = KERNEL_TIER_VM;
+    system->emit_tier = KERNEL_TIER_VM;
+    return true;
+}
+
+static bool vm_emit_system(system_t* system, bool parallel) {
+    const program_t* p = system->emit_program;
+    float regs[256];
+    for (size_t i = 0; i < p->uniform_count; i++)
+        regs[p->uniform_regs[i]] = system->emit_uniforms[i];
+    vm_rand_t rand = {.key = rand_key(system->seed, system->frame, RAND_STREAM_EMIT),
+                      .counter = 0};
+    
+    flush_deletions(system->particles);
+    vm_system_t* vm_system = system->backend_internal;
+    vm_system->emit_count = 0;
+    //Particles emitted before an error are still spawned
+    bool success = vm_execute1(p->bc, NULL, 0, system, regs, &rand, false);
+    return spawn_emitted(system, parallel) && success;
+}
+
+static bool vm_simulate_range(system_t* system, size_t begin, size_t count) {
+    const vm_kernel_t* kernel = system->runtime->backend.internal;
+    return kernel->simulate(begin, count, system);
+}
+
 bool vm_backend(backend_t* backend) {
     backend->create = &vm_create;
     backend->destroy = &vm_destroy;
     backend->create_program = &vm_create_program;
     backend->destroy_program = &vm_destroy_program;
-    backend->simulate_system = &vm_simulate_system;
+    backend->create_system = &vm_create_system;
+    backend->destroy_system = &vm_destroy_system;
+    backend->begin_frame = &vm_begin_frame;
+    backend->emit_system = &vm_emit_system;
+    backend->simulate_range = &vm_simulate_range;
     return true;
 }
@@ -0,0 +1,960 @@
+//Compiled once per instruction set. The Makefile defines one of VM_TIER_SSE,
+//VM_TIER_AVX, VM_TIER_AVX2 or VM_TIER_AVX512 together with the matching
+//-m flags. Without one of them a portable implementation is built.
+#include "vm.h"
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(VM_TIER_AVX512)
+#define VM_TIER avx512
+#define VM_WIDTH 16
+#elif defined(VM_TIER_AVX2)
+#define VM_TIER avx2
+#define VM_WIDTH 8
+#elif defined(VM_TIER_AVX)
+#define VM_TIER avx
+#define VM_WIDTH 8
+#elif defined(VM_TIER_SSE)
+#define VM_TIER sse
+#define VM_WIDTH 4
+#else
+#define VM_TIER generic
+#define VM_WIDTH 8
+#endif
+
+#if defined(VM_TIER_AVX512) && !(defined(__AVX512F__) && defined(__AVX512DQ__))
+#error "VM_TIER_AVX512 requires -mavx512f -mavx512dq"
+#elif defined(VM_TIER_AVX2) && !(defined(__AVX2__) && defined(__FMA__))
+#error "VM_TIER_AVX2 requires -mavx2 -mfma"
+#elif defined(VM_TIER_AVX) && !defined(__AVX__)
+#error "VM_TIER_AVX requires -mavx"
+#elif defined(VM_TIER_SSE) && !defined(__SSE2__)
+#error "VM_TIER_SSE requires -msse2"
+#endif
+
+#if !defined(VM_TIER_SSE) && !defined(VM_TIER_AVX) &&\
+    !defined(VM_TIER_AVX2) && !defined(VM_TIER_AVX512)
+#define VM_TIER_GENERIC
+#else
+#include <immintrin.h>
+#endif
+
+#define VM_JOIN_(a, b) a##b
+#define VM_JOIN(a, b) VM_JOIN_(a, b)
+#define VM_STR_(a) #a
+#define VM_STR(a) VM_STR_(a)
+#define VM_KERNEL VM_JOIN(vm_kernel_, VM_TIER)
+#define VM_EXECUTE VM_JOIN(vm_execute, VM_WIDTH)
+
+#ifdef VM_COMPUTED_GOTO
+#undef DISPATCH
+#define DISPATCH goto* (in = inst++)->handler
+#endif
+
+#if defined(VM_TIER_AVX512)
+typedef __m512 simdf_t;
+
+static void simdf_add(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm512_add_ps(a, b);
+}
+
+static void simdf_sub(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm512_sub_ps(a, b);
+}
+
+static void simdf_mul(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm512_mul_ps(a, b);
+}
+
+static void simdf_div(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm512_div_ps(a, b);
+}
+
+static void simdf_fma(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm512_fmadd_ps(a, b, c);
+}
+
+static void simdf_fms(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm512_fmsub_ps(a, b, c);
+}
+
+static void simdf_fnma(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm512_fnmadd_ps(a, b, c);
+}
+
+static void simdf_from_mask(simdf_t* dest, __mmask16 mask) {
+    *dest = _mm512_castsi512_ps(_mm512_movm_epi32(mask));
+}
+
+static __mmask16 simdf_to_mask(simdf_t a) {
+    return _mm512_test_epi32_mask(_mm512_castps_si512(a), _mm512_castps_si512(a));
+}
+
+static void simdf_less(simdf_t* dest, simdf_t a, simdf_t b) {
+    simdf_from_mask(dest, _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ));
+}
+
+static void simdf_greater(simdf_t* dest, simdf_t a, simdf_t b) {
+    simdf_from_mask(dest, _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ));
+}
+
+static void simdf_equal(simdf_t* dest, simdf_t a, simdf_t b) {
+    simdf_from_mask(dest, _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ));
+}
+
+static void simdf_sqrt(simdf_t* dest, simdf_t a) {
+    *dest = _mm512_sqrt_ps(a);
+}
+
+static void simdf_bool_and(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm512_and_ps(a, b);
+}
+
+static void simdf_bool_or(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm512_or_ps(a, b);
+}
+
+static void simdf_bool_not(simdf_t* dest, simdf_t a) {
+    simdf_from_mask(dest, _knot_mask16(simdf_to_mask(a)));
+}
+
+static void simdf_sel(simdf_t* dest, simdf_t a, simdf_t b, simdf_t cond) {
+    *dest = _mm512_mask_blend_ps(simdf_to_mask(cond), b, a);
+}
+
+static void simdf_floor(simdf_t* dest, simdf_t a) {
+    *dest = _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF|_MM_FROUND_NO_EXC);
+}
+
+static void simdf_init1(simdf_t* dest, float v) {
+    *dest = _mm512_set1_ps(v);
+}
+
+static void simdf_init(simdf_t* dest, const float* v) {
+    *dest = _mm512_loadu_ps(v);
+}
+
+static void simdf_get(simdf_t v, float* dest) {
+    _mm512_storeu_ps(dest, v);
+}
+
+static unsigned int simdf_mask_bits(simdf_t a) {
+    return simdf_to_mask(a);
+}
+
+static void simdf_from_bits(simdf_t* dest, unsigned int bits) {
+    simdf_from_mask(dest, bits);
+}
+#elif defined(VM_TIER_AVX2) || defined(VM_TIER_AVX)
+typedef __m256 simdf_t;
+
+static void simdf_add(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm256_add_ps(a, b);
+}
+
+static void simdf_sub(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm256_sub_ps(a, b);
+}
+
+static void simdf_mul(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm256_mul_ps(a, b);
+}
+
+static void simdf_div(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm256_div_ps(a, b);
+}
+
+#ifdef VM_TIER_AVX2
+static void simdf_fma(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm256_fmadd_ps(a, b, c);
+}
+
+static void simdf_fms(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm256_fmsub_ps(a, b, c);
+}
+
+static void simdf_fnma(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm256_fnmadd_ps(a, b, c);
+}
+#else
+static void simdf_fma(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm256_add_ps(_mm256_mul_ps(a, b), c);
+}
+
+static void simdf_fms(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm256_sub_ps(_mm256_mul_ps(a, b), c);
+}
+
+static void simdf_fnma(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm256_sub_ps(c, _mm256_mul_ps(a, b));
+}
+#endif
+
+static void simdf_less(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+}
+
+static void simdf_greater(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm256_cmp_ps(a, b, _CMP_GT_OQ);
+}
+
+static void simdf_equal(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm256_cmp_ps(a, b, _CMP_EQ_OQ);
+}
+
+static void simdf_sqrt(simdf_t* dest, simdf_t a) {
+    *dest = _mm256_sqrt_ps(a);
+}
+
+static void simdf_bool_and(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm256_and_ps(a, b);
+}
+
+static void simdf_bool_or(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm256_or_ps(a, b);
+}
+
+static void simdf_bool_not(simdf_t* dest, simdf_t a) {
+    *dest = _mm256_xor_ps(a, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+}
+
+static void simdf_sel(simdf_t* dest, simdf_t a, simdf_t b, simdf_t cond) {
+    *dest = _mm256_blendv_ps(b, a, cond);
+}
+
+static void simdf_floor(simdf_t* dest, simdf_t a) {
+    *dest = _mm256_floor_ps(a);
+}
+
+static void simdf_init1(simdf_t* dest, float v) {
+    *dest = _mm256_set1_ps(v);
+}
+
+static void simdf_init(simdf_t* dest, const float* v) {
+    *dest = _mm256_loadu_ps(v);
+}
+
+static void simdf_get(simdf_t v, float* dest) {
+    _mm256_storeu_ps(dest, v);
+}
+
+static unsigned int simdf_mask_bits(simdf_t a) {
+    return _mm256_movemask_ps(a);
+}
+
+#ifdef VM_TIER_AVX2
+static void simdf_from_bits(simdf_t* dest, unsigned int bits) {
+    __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i v = _mm256_and_si256(_mm256_set1_epi32(bits), lanes);
+    *dest = _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, lanes));
+}
+#else
+static void simdf_from_bits(simdf_t* dest, unsigned int bits) {
+    __m128i lo_lanes = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i hi_lanes = _mm_setr_epi32(16, 32, 64, 128);
+    __m128i v = _mm_set1_epi32(bits);
+    __m128i lo = _mm_cmpeq_epi32(_mm_and_si128(v, lo_lanes), lo_lanes);
+    __m128i hi = _mm_cmpeq_epi32(_mm_and_si128(v, hi_lanes), hi_lanes);
+    *dest = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_castsi128_ps(lo)),
+                                 _mm_castsi128_ps(hi), 1);
+}
+#endif
+#elif defined(VM_TIER_SSE)
+typedef __m128 simdf_t;
+
+static void simdf_add(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm_add_ps(a, b);
+}
+
+static void simdf_sub(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm_sub_ps(a, b);
+}
+
+static void simdf_mul(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm_mul_ps(a, b);
+}
+
+static void simdf_div(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm_div_ps(a, b);
+}
+
+static void simdf_fma(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm_add_ps(_mm_mul_ps(a, b), c);
+}
+
+static void simdf_fms(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm_sub_ps(_mm_mul_ps(a, b), c);
+}
+
+static void simdf_fnma(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    *dest = _mm_sub_ps(c, _mm_mul_ps(a, b));
+}
+
+static void simdf_less(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm_cmplt_ps(a, b);
+}
+
+static void simdf_greater(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm_cmpgt_ps(a, b);
+}
+
+static void simdf_equal(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm_cmpeq_ps(a, b);
+}
+
+static void simdf_sqrt(simdf_t* dest, simdf_t a) {
+    *dest = _mm_sqrt_ps(a);
+}
+
+static void simdf_bool_and(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm_and_ps(a, b);
+}
+
+static void simdf_bool_or(simdf_t* dest, simdf_t a, simdf_t b) {
+    *dest = _mm_or_ps(a, b);
+}
+
+static void simdf_bool_not(simdf_t* dest, simdf_t a) {
+    *dest = _mm_xor_ps(a, _mm_castsi128_ps(_mm_set1_epi32(-1)));
+}
+
+static void simdf_sel(simdf_t* dest, simdf_t a, simdf_t b, simdf_t cond) {
+    *dest = _mm_or_ps(_mm_and_ps(cond, a), _mm_andnot_ps(cond, b));
+}
+
+static void simdf_floor(simdf_t* dest, simdf_t a) {
+    //SSE2 has no roundps. Values of 2^23 and above are already integral.
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+    t = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1.0f)));
+    __m128 abs = _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+    __m128 small = _mm_cmplt_ps(abs, _mm_set1_ps(8388608.0f));
+    *dest = _mm_or_ps(_mm_and_ps(small, t), _mm_andnot_ps(small, a));
+}
+
+static void simdf_init1(simdf_t* dest, float v) {
+    *dest = _mm_set1_ps(v);
+}
+
+static void simdf_init(simdf_t* dest, const float* v) {
+    *dest = _mm_loadu_ps(v);
+}
+
+static void simdf_get(simdf_t v, float* dest) {
+    _mm_storeu_ps(dest, v);
+}
+
+static unsigned int simdf_mask_bits(simdf_t a) {
+    return _mm_movemask_ps(a);
+}
+
+static void simdf_from_bits(simdf_t* dest, unsigned int bits) {
+    __m128i lanes = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i v = _mm_and_si128(_mm_set1_epi32(bits), lanes);
+    *dest = _mm_castsi128_ps(_mm_cmpeq_epi32(v, lanes));
+}
+#else
+typedef struct {union {float v[VM_WIDTH]; uint32_t i[VM_WIDTH];};} simdf_t;
+
+static void simdf_add(simdf_t* dest, simdf_t a, simdf_t b) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = a.v[i] + b.v[i];
+}
+
+static void simdf_sub(simdf_t* dest, simdf_t a, simdf_t b) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = a.v[i] - b.v[i];
+}
+
+static void simdf_mul(simdf_t* dest, simdf_t a, simdf_t b) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = a.v[i] * b.v[i];
+}
+
+static void simdf_div(simdf_t* dest, simdf_t a, simdf_t b) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = a.v[i] / b.v[i];
+}
+
+static void simdf_fma(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = a.v[i]*b.v[i] + c.v[i];
+}
+
+static void simdf_fms(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = a.v[i]*b.v[i] - c.v[i];
+}
+
+static void simdf_fnma(simdf_t* dest, simdf_t a, simdf_t b, simdf_t c) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = c.v[i] - a.v[i]*b.v[i];
+}
+
+static void simdf_sqrt(simdf_t* dest, simdf_t a) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = sqrt(a.v[i]);
+}
+
+static void simdf_less(simdf_t* dest, simdf_t a, simdf_t b) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->i[i] = a.v[i] < b.v[i] ? UINT32_MAX : 0;
+}
+
+static void simdf_greater(simdf_t* dest, simdf_t a, simdf_t b) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->i[i] = a.v[i] > b.v[i] ? UINT32_MAX : 0;
+}
+
+static void simdf_equal(simdf_t* dest, simdf_t a, simdf_t b) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->i[i] = a.v[i] == b.v[i] ? UINT32_MAX : 0;
+}
+
+static void simdf_bool_and(simdf_t* dest, simdf_t a, simdf_t b) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->i[i] = a.i[i] & b.i[i];
+}
+
+static void simdf_bool_or(simdf_t* dest, simdf_t a, simdf_t b) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->i[i] = a.i[i] | b.i[i];
+}
+
+static void simdf_bool_not(simdf_t* dest, simdf_t a) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->i[i] = ~a.i[i];
+}
+
+static void simdf_sel(simdf_t* dest, simdf_t a, simdf_t b, simdf_t cond) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = cond.i[i] ? a.v[i] : b.v[i];
+}
+
+static void simdf_floor(simdf_t* dest, simdf_t a) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = floorf(a.v[i]);
+}
+
+static void simdf_init1(simdf_t* dest, float v) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->v[i] = v;
+}
+
+static void simdf_init(simdf_t* dest, const float* v) {
+    memcpy(dest, v, sizeof(float)*VM_WIDTH);
+}
+
+static void simdf_get(simdf_t v, float* dest) {
+    memcpy(dest, &v, sizeof(float)*VM_WIDTH);
+}
+
+static unsigned int simdf_mask_bits(simdf_t a) {
+    unsigned int bits = 0;
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) bits |= (a.i[i]>>31) << i;
+    return bits;
+}
+
+static void simdf_from_bits(simdf_t* dest, unsigned int bits) {
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest->i[i] = bits>>i & 1 ? UINT32_MAX : 0;
+}
+#endif
+
+static void simdf_pow(simdf_t* dest, simdf_t a, simdf_t b) {
+    float af[VM_WIDTH];
+    simdf_get(a, af);
+    float bf[VM_WIDTH];
+    simdf_get(b, bf);
+    float df[VM_WIDTH];
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) df[i] = powf(af[i], bf[i]);
+    simdf_init(dest, df);
+}
+
+//A tile is a run of blocks of VM_WIDTH particles which are interpreted
+//together: each instruction is applied to every block of the tile before the
+//next one is dispatched. Registers are stored as columns of blocks.
+typedef struct vm_tile_t {
+    system_t* system;
+    size_t offset;
+    size_t blocks;
+    unsigned int* alive; //One lane mask per block
+    uint32_t rand_key;
+    uint32_t* rand_counters; //One per particle
+    simdf_t* saved; //Free space for saving registers around masked blocks
+} vm_tile_t;
+
+//Lanes only advance their counter when they are active
+static void simdf_rand(simdf_t* dest, uint32_t key, size_t offset, uint32_t* counters,
+                       unsigned int mask) {
+    float df[VM_WIDTH];
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++)
+        df[i] = rand_float(key, offset+i, counters[i]);
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++)
+        counters[i] += mask>>i & 1;
+    simdf_init(dest, df);
+}
+
+//Conversion kernels between attribute storage and registers. The loops have
+//a fixed trip count of VM_WIDTH so that they are vectorized for each tier:
+//widen, convert and scale on load and scale, clamp and narrow on store. The
+//column variants store count floats, such as the particles of an emitter.
+#define CONVERT_FUNCS(name, type, scale_type, scale, min, max)\
+static void load_##name(void* dest, const void* attribute, size_t offset) {\
+    const type* src = (const type*)attribute + offset;\
+    float val[VM_WIDTH];\
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++)\
+        val[i] = src[i] / (scale_type)scale;\
+    simdf_init(dest, val);\
+}\
+\
+static void store_##name(void* attribute, const void* src, size_t offset) {\
+    type* dest = (type*)attribute + offset;\
+    float val[VM_WIDTH];\
+    simdf_get(*(const simdf_t*)src, val);\
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) {\
+        scale_type v = val[i] * (scale_type)scale;\
+        v = v < (scale_type)min ? (scale_type)min : v;\
+        dest[i] = v > (scale_type)max ? (scale_type)max : v;\
+    }\
+}\
+\
+static void store_column_##name(void* attribute, const float* src, size_t offset, size_t count) {\
+    type* dest = (type*)attribute + offset;\
+    for (size_t i = 0; i < count; i++) {\
+        scale_type v = src[i] * (scale_type)scale;\
+        v = v < (scale_type)min ? (scale_type)min : v;\
+        dest[i] = v > (scale_type)max ? (scale_type)max : v;\
+    }\
+}
+
+CONVERT_FUNCS(uint8, uint8_t, float, 255, 0, 255)
+CONVERT_FUNCS(int8, int8_t, float, 127, -128, 127)
+CONVERT_FUNCS(uint16, uint16_t, float, 65535, 0, 65535)
+CONVERT_FUNCS(int16, int16_t, float, 32767, -32768, 32767)
+CONVERT_FUNCS(uint32, uint32_t, double, 4294967295.0, 0, 4294967295.0)
+CONVERT_FUNCS(int32, int32_t, double, 2147483647.0, -2147483648.0, 2147483647.0)
+
+static void load_float32(void* dest, const void* attribute, size_t offset) {
+    simdf_init(dest, (const float*)attribute+offset);
+}
+
+static void store_float32(void* attribute, const void* src, size_t offset) {
+    simdf_get(*(const simdf_t*)src, (float*)attribute+offset);
+}
+
+static void store_column_float32(void* attribute, const float* src, size_t offset, size_t count) {
+    memcpy((float*)attribute+offset, src, count*sizeof(float));
+}
+
+static void store_column_float64(void* attribute, const float* src, size_t offset, size_t count) {
+    double* dest = (double*)attribute + offset;
+    for (size_t i = 0; i < count; i++) dest[i] = src[i];
+}
+
+static void load_float64(void* dest, const void* attribute, size_t offset) {
+    const double* src = (const double*)attribute + offset;
+    float val[VM_WIDTH];
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) val[i] = src[i];
+    simdf_init(dest, val);
+}
+
+static void store_float64(void* attribute, const void* src, size_t offset) {
+    double* dest = (double*)attribute + offset;
+    float val[VM_WIDTH];
+    simdf_get(*(const simdf_t*)src, val);
+    for (uint_fast8_t i = 0; i < VM_WIDTH; i++) dest[i] = val[i];
+}
+
+//Restores count registers of each block from saved for the lanes not set in
+//keep. The registers are in tile layout.
+static void blend_regs(simdf_t* regs, size_t count, const simdf_t* saved,
+                       const unsigned int* keep, size_t blocks) {
+    for (size_t i = 0; i < blocks; i++) {
+        simdf_t keep_mask;
+        simdf_from_bits(&keep_mask, keep[i]);
+        for (size_t j = i; j < count*blocks; j += blocks)
+            simdf_sel(regs+j, regs[j], saved[j], keep_mask);
+    }
+}
+
+static bool any_lanes(const unsigned int* mask, size_t blocks) {
+    unsigned int res = 0;
+    for (size_t i = 0; i < blocks; i++) res |= mask[i];
+    return res;
+}
+
+//Set by vm_run() when it is called without a tile
+static void** handlers;
+
+//The blocks of the tile with active lanes
+#define FOR_BLOCKS for (size_t i = 0; i < n; i++) if (mask[i])
+//The column of the instruction's jth register
+#define REG(j) (regs + in->r[j]*n)
+
+//Runs instructions for the lanes set in mask. Nested regions return at their
+//BC_OP_COND_END, BC_OP_WHILE_END_COND or BC_OP_WHILE_END. Register writes
+//are not masked here: the caller restores the lanes outside of the mask from
+//the region's register range.
+static bool vm_run(vm_tile_t* tile, const vm_inst_t* inst, simdf_t* regs,
+                   const unsigned int* region_mask, bool nested) {
+    const vm_inst_t* in;
+    #ifdef VM_COMPUTED_GOTO
+    DT
+    if (!tile) {
+        handlers = dispatch_table;
+        return true;
+    }
+    #endif
+    
+    size_t n = tile->blocks;
+    unsigned int mask[n];
+    memcpy(mask, region_mask, sizeof(mask));
+    
+    #ifdef VM_COMPUTED_GOTO
+    DISPATCH;
+    #else
+    while (true) {
+        in = inst++;
+        switch (in->op) {
+    #endif
+        BEGIN_CASE(BC_OP_ADD)
+            FOR_BLOCKS simdf_add(REG(0)+i, REG(1)[i], REG(2)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_SUB)
+            FOR_BLOCKS simdf_sub(REG(0)+i, REG(1)[i], REG(2)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_MUL)
+            FOR_BLOCKS simdf_mul(REG(0)+i, REG(1)[i], REG(2)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_DIV)
+            FOR_BLOCKS simdf_div(REG(0)+i, REG(1)[i], REG(2)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_POW)
+            FOR_BLOCKS simdf_pow(REG(0)+i, REG(1)[i], REG(2)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_MOVF)
+            FOR_BLOCKS simdf_init1(REG(0)+i, in->imm);
+        END_CASE
+        BEGIN_CASE(BC_OP_SQRT)
+            FOR_BLOCKS simdf_sqrt(REG(0)+i, REG(1)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_DELETE)
+            for (size_t i = 0; i < n; i++) {
+                unsigned int lanes = mask[i] & tile->alive[i];
+                for (uint_fast8_t j = 0; j < VM_WIDTH; j++)
+                    if (lanes>>j & 1)
+                        delete_particle(tile->system->particles, tile->offset+i*VM_WIDTH+j);
+                tile->alive[i] &= ~lanes;
+            }
+            return true;
+        END_CASE
+        BEGIN_CASE(BC_OP_LESS)
+            FOR_BLOCKS simdf_less(REG(0)+i, REG(1)[i], REG(2)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_GREATER)
+            FOR_BLOCKS simdf_greater(REG(0)+i, REG(1)[i], REG(2)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_EQUAL)
+            FOR_BLOCKS simdf_equal(REG(0)+i, REG(1)[i], REG(2)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_BOOL_AND)
+            FOR_BLOCKS simdf_bool_and(REG(0)+i, REG(1)[i], REG(2)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_BOOL_OR)
+            FOR_BLOCKS simdf_bool_or(REG(0)+i, REG(1)[i], REG(2)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_BOOL_NOT)
+            FOR_BLOCKS simdf_bool_not(REG(0)+i, REG(1)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_SEL)
+            FOR_BLOCKS simdf_sel(REG(0)+i, REG(1)[i], REG(2)[i], REG(3)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_COND_BEGIN)
+            unsigned int rmin = in->r[1];
+            unsigned int rmax = in->r[2];
+            
+            unsigned int cond[n];
+            bool all = true;
+            for (size_t i = 0; i < n; i++) {
+                cond[i] = mask[i] & simdf_mask_bits(REG(0)[i]);
+                all = all && cond[i]==mask[i];
+            }
+            
+            if (all) {
+                if (!vm_run(tile, inst, regs, cond, true)) return false;
+            } else if (any_lanes(cond, n)) {
+                //Only registers in rmin..rmax are written by the body
+                simdf_t* saved = tile->saved;
+                tile->saved += (rmax-rmin+1) * n;
+                memcpy(saved, regs+rmin*n, (rmax-rmin+1)*n*sizeof(simdf_t));
+                if (!vm_run(tile, inst, regs, cond, true)) return false;
+                blend_regs(regs+rmin*n, rmax-rmin+1, saved, cond, n);
+                tile->saved = saved;
+            }
+            
+            for (size_t i = 0; i < n; i++) mask[i] &= tile->alive[i];
+            if (!any_lanes(mask, n)) return true;
+            
+            inst = in->end;
+        END_CASE
+        BEGIN_CASE(BC_OP_WHILE_END_COND)
+            if (nested) return true;
+        END_CASE
+        BEGIN_CASE(BC_OP_COND_END)
+            if (nested) return true;
+        END_CASE
+        BEGIN_CASE(BC_OP_WHILE_BEGIN)
+            unsigned int crmin = in->r[1];
+            unsigned int crmax = in->r[2];
+            unsigned int brmin = in->r[3];
+            unsigned int brmax = in->r[4];
+            
+            //Lanes leave the loop once their condition is false. Registers
+            //are only saved and blended once some lanes have left.
+            unsigned int active[n];
+            memcpy(active, mask, sizeof(active));
+            simdf_t* saved_cond = tile->saved;
+            simdf_t* saved_body = saved_cond + (crmax-crmin+1)*n;
+            tile->saved = saved_body + (brmax-brmin+1)*n;
+            for (uint_fast32_t iter = 0;; iter++) {
+                bool partial = memcmp(active, mask, sizeof(active)) != 0;
+                if (partial) memcpy(saved_cond, regs+crmin*n, (crmax-crmin+1)*n*sizeof(simdf_t));
+                if (!vm_run(tile, inst, regs, active, true)) return false;
+                if (partial) blend_regs(regs+crmin*n, crmax-crmin+1, saved_cond, active, n);
+                
+                for (size_t i = 0; i < n; i++)
+                    active[i] &= tile->alive[i] & simdf_mask_bits(REG(0)[i]);
+                if (!any_lanes(active, n)) break;
+                if (iter == VM_MAX_LOOP_ITERATIONS)
+                    return set_error(tile->system->runtime, "Loop iteration limit exceeded");
+                
+                partial = memcmp(active, mask, sizeof(active)) != 0;
+                if (partial) memcpy(saved_body, regs+brmin*n, (brmax-brmin+1)*n*sizeof(simdf_t));
+                if (!vm_run(tile, in->body, regs, active, true)) return false;
+                if (partial) blend_regs(regs+brmin*n, brmax-brmin+1, saved_body, active, n);
+                
+                for (size_t i = 0; i < n; i++) active[i] &= tile->alive[i];
+            }
+            tile->saved = saved_cond;
+            
+            for (size_t i = 0; i < n; i++) mask[i] &= tile->alive[i];
+            if (!any_lanes(mask, n)) return true;
+            
+            inst = in->end;
+        END_CASE
+        BEGIN_CASE(BC_OP_WHILE_END)
+            if (nested) return true;
+        END_CASE
+        BEGIN_CASE(BC_OP_END)
+            return true;
+        END_CASE
+        BEGIN_CASE(BC_OP_EMIT)
+            //validate_program() only allows this in emitter programs, which
+            //are run by vm_execute1() instead
+            assert(false);
+        END_CASE
+        BEGIN_CASE(BC_OP_RAND)
+            FOR_BLOCKS simdf_rand(REG(0)+i, tile->rand_key, tile->offset+i*VM_WIDTH,
+                                  tile->rand_counters+i*VM_WIDTH, mask[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_FLOOR)
+            FOR_BLOCKS simdf_floor(REG(0)+i, REG(1)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_MOV)
+            FOR_BLOCKS REG(0)[i] = REG(1)[i];
+        END_CASE
+        BEGIN_CASE(BC_OP_FMA)
+            FOR_BLOCKS simdf_fma(REG(0)+i, REG(1)[i], REG(2)[i], REG(3)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_FMS)
+            FOR_BLOCKS simdf_fms(REG(0)+i, REG(1)[i], REG(2)[i], REG(3)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_FNMA)
+            FOR_BLOCKS simdf_fnma(REG(0)+i, REG(1)[i], REG(2)[i], REG(3)[i]);
+        END_CASE
+        BEGIN_CASE(BC_OP_SEL_LESS)
+            FOR_BLOCKS {
+                simdf_t cond;
+                simdf_less(&cond, REG(3)[i], REG(4)[i]);
+                simdf_sel(REG(0)+i, REG(1)[i], REG(2)[i], cond);
+            }
+        END_CASE
+        BEGIN_CASE(BC_OP_SEL_GREATER)
+            FOR_BLOCKS {
+                simdf_t cond;
+                simdf_greater(&cond, REG(3)[i], REG(4)[i]);
+                simdf_sel(REG(0)+i, REG(1)[i], REG(2)[i], cond);
+            }
+        END_CASE
+    #ifndef VM_COMPUTED_GOTO
+        default: {break;}
+        }
+    }
+    #endif
+}
+
+#undef FOR_BLOCKS
+#undef REG
+
+static void resolve_handlers(vm_inst_t* insts, size_t count) {
+    #ifdef VM_COMPUTED_GOTO
+    vm_run(NULL, NULL, NULL, NULL, false);
+    for (size_t i = 0; i < count; i++) insts[i].handler = handlers[insts[i].op];
+    #endif
+}
+
+//Returns the live bits of the VM_WIDTH particles starting at index
+static unsigned int get_live_lanes(const uint64_t* live_bits, size_t index) {
+    const uint64_t* word = live_bits + index/64;
+    uint64_t bits = __atomic_load_n(word, __ATOMIC_RELAXED) >> index%64;
+    if (index%64 > 64-VM_WIDTH)
+        bits |= __atomic_load_n(word+1, __ATOMIC_RELAXED) << (64-index%64);
+    return bits & ((1ull<<VM_WIDTH)-1);
+}
+
+//Runs the program for blocks*VM_WIDTH particles starting at offset. regs
+//holds the program's registers for a tile of that many blocks followed by
+//room for saving the program's save_count registers.
+static bool VM_EXECUTE(const program_t* program, size_t offset, size_t blocks, system_t* system,
+                       const vm_attr_funcs_t* attrs, float* uniforms, uint32_t key,
+                       simdf_t* regs) {
+    const vm_program_t* vm_program = program->backend_internal;
+    
+    unsigned int alive[blocks];
+    uint32_t rand_counters[blocks*VM_WIDTH];
+    vm_tile_t tile;
+    tile.system = system;
+    tile.offset = offset;
+    tile.blocks = blocks;
+    tile.alive = alive;
+    tile.rand_key = key;
+    tile.rand_counters = rand_counters;
+    tile.saved = regs + vm_program->reg_count*blocks;
+    
+    for (size_t i = 0; i < blocks; i++)
+        alive[i] = get_live_lanes(system->particles->live_bits, offset+i*VM_WIDTH);
+    if (!any_lanes(alive, blocks)) return true;
+    memset(rand_counters, 0, sizeof(rand_counters));
+    
+    for (size_t i = 0; i < program->attribute_count; i++) {
+        void* attr = system->particles->attributes[attrs[i].index];
+        simdf_t* reg = regs + program->attribute_load_regs[i]*blocks;
+        for (size_t j = 0; j < blocks; j++)
+            if (alive[j]) attrs[i].load(reg+j, attr, offset+j*VM_WIDTH);
+    }
+    
+    if (system->instance_attribute < 0) {
+        for (size_t i = 0; i < program->uniform_count; i++) {
+            simdf_t* reg = regs + program->uniform_regs[i]*blocks;
+            for (size_t j = 0; j < blocks; j++) simdf_init1(reg+j, uniforms[i]);
+        }
+    } else {
+        //Each lane loads the uniforms of its particle's instance
+        for (size_t j = 0; j < blocks; j++) {
+            const float* rows[VM_WIDTH];
+            for (size_t k = 0; k < VM_WIDTH; k++)
+                rows[k] = get_particle_uniforms(system, offset+j*VM_WIDTH+k);
+            for (size_t i = 0; i < program->uniform_count; i++) {
+                float lanes[VM_WIDTH];
+                for (size_t k = 0; k < VM_WIDTH; k++) lanes[k] = rows[k][i];
+                load_float32(regs+program->uniform_regs[i]*blocks+j, lanes, 0);
+            }
+        }
+    }
+    
+    unsigned int mask[blocks];
+    memcpy(mask, alive, sizeof(mask));
+    if (!vm_run(&tile, vm_program->insts, regs, mask, false)) return false;
+    
+    //Blocks which were entirely deleted before the program ran are not stored
+    for (size_t i = 0; i < program->attribute_count; i++) {
+        void* attr = system->particles->back_attributes[attrs[i].index];
+        attr = attr ? attr : system->particles->attributes[attrs[i].index];
+        simdf_t* reg = regs + program->attribute_store_regs[i]*blocks;
+        for (size_t j = 0; j < blocks; j++)
+            if (mask[j]) attrs[i].store(attr, reg+j, offset+j*VM_WIDTH);
+    }
+    return true;
+}
+
+static void* thread_func(size_t begin, size_t count, void* userdata) {
+    system_t* system = userdata;
+    const program_t* p = system->sim_program;
+    const vm_program_t* vm_program = p->backend_internal;
+    const vm_system_t* vm_system = system->backend_internal;
+    uint32_t key = rand_key(system->seed, system->frame, RAND_STREAM_SIM);
+    
+    size_t tile_blocks = system->tile_size / VM_WIDTH;
+    tile_blocks = tile_blocks ? tile_blocks : 1;
+    tile_blocks = tile_blocks<VM_MAX_TILE_SIZE/VM_WIDTH ? tile_blocks : VM_MAX_TILE_SIZE/VM_WIDTH;
+    
+    size_t reg_count = vm_program->reg_count + vm_program->save_count;
+    size_t regs_size = reg_count * tile_blocks * sizeof(simdf_t);
+    simdf_t* regs = aligned_alloc(sizeof(simdf_t), regs_size);
+    if (!regs && regs_size) {
+        set_error(system->runtime, "Failed to allocate VM registers");
+        return (void*)false;
+    }
+    
+    //Tiles start at the block containing the next live particle
+    size_t end = begin + count;
+    size_t i = begin;
+    while (true) {
+        size_t next = next_live_particle(system->particles, i, end) / VM_WIDTH * VM_WIDTH;
+        i = next>i ? next : i;
+        if ((end-i) < VM_WIDTH) break;
+        
+        size_t blocks = (end-i) / VM_WIDTH;
+        blocks = blocks<tile_blocks ? blocks : tile_blocks;
+        if (!VM_EXECUTE(p, i, blocks, system, vm_system->sim_attrs, system->sim_uniforms, key, regs)) {
+            free(regs);
+            return (void*)false;
+        }
+        i += blocks * VM_WIDTH;
+    }
+    free(regs);
+    
+    for (i = next_live_particle(system->particles, i, end); i < end;
+         i = next_live_particle(system->particles, i+1, end)) {
+        float regs[256];
+        
+        for (size_t j = 0; j < p->attribute_count; j++) {
+            int index = system->sim_attribute_indices[j];
+            void* attr = system->particles->attributes[index];
+            attr_dtype_t dtype = system->particles->attribute_dtypes[index];
+            regs[p->attribute_load_regs[j]] = load_attr1(attr, dtype, i);
+        }
+        
+        const float* uniforms = get_particle_uniforms(system, i);
+        for (size_t i = 0; i < p->uniform_count; i++)
+            regs[p->uniform_regs[i]] = uniforms[i];
+        
+        vm_rand_t rand = {.key = key, .counter = 0};
+        if (!vm_execute1(p->bc, system->particles->live_bits, i, system, regs, &rand, false))
+            return (void*)false;
+        
+        for (size_t j = 0; j < p->attribute_count; j++) {
+            int index = system->sim_attribute_indices[j];
+            void* attr = system->particles->back_attributes[index];
+            store_attr1(regs[p->attribute_store_regs[j]],
+                        attr ? attr : system->particles->attributes[index],
+                        system->particles->attribute_dtypes[index], i);
+        }
+    }
+    
+    return (void*)true;
+}
+
+const vm_kernel_t VM_KERNEL = {.name = VM_STR(VM_TIER),
+                               .width = VM_WIDTH,
+                               .simulate = &thread_func,
+                               .resolve_handlers = &resolve_handlers,
+                               .load = {[ATTR_UINT8] = &load_uint8,
+                                        [ATTR_INT8] = &load_int8,
+                                        [ATTR_UINT16] = &load_uint16,
+                                        [ATTR_INT16] = &load_int16,
+                                        [ATTR_UINT32] = &load_uint32,
+                                        [ATTR_INT32] = &load_int32,
+                                        [ATTR_FLOAT32] = &load_float32,
+                                        [ATTR_FLOAT64] = &load_float64},
+                               .store = {[ATTR_UINT8] = &store_uint8,
+                                         [ATTR_INT8] = &store_int8,
+                                         [ATTR_UINT16] = &store_uint16,
+                                         [ATTR_INT16] = &store_int16,
+                                         [ATTR_UINT32] = &store_uint32,
+                                         [ATTR_INT32] = &store_int32,
+                                         [ATTR_FLOAT32] = &store_float32,
+                                         [ATTR_FLOAT64] = &store_float64},
+                               .store_column = {[ATTR_UINT8] = &store_column_uint8,
+                                                [ATTR_INT8] = &store_column_int8,
+                                                [ATTR_UINT16] = &store_column_uint16,
+                                                [ATTR_INT16] = &store_column_int16,
+                                                [ATTR_UINT32] = &store_column_uint32,
+                                                [ATTR_INT32] = &store_column_int32,
+                                                [ATTR_FLOAT32] = &store_column_float32,
+                                                [ATTR_FLOAT64] = &store_column_float64}};
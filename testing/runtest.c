@@ -4,9 +4,42 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #define MAX_DIFF 0.0001f
 #define MAX_ULP_DIFF 100
+#define MAX_SYSTEMS 8
+
+static const char* dtype_names[] = {"uint8", "int8", "uint16", "int16",
+                                    "uint32", "int32", "float32", "float64"};
+static const char* tier_names[] = {"vm", "compiled", "specialized"};
+
+//Arguments after the source file and the particle count:
+//p <attribute> <input> <expected> <particle>
+//u <uniform> <value>
+//d <particle> (expected to be deleted)
+//k <compact_moves> <compact_threshold>
+//b (double buffered)
+//m <system count> (simulated with simulate_systems())
+//a (simulated with simulate_system_async())
+//t <worker thread count>
+//i <instance attribute> <instance count>
+//r <instance> <uniform> <value> (instance uniform)
+//f <frame count> <milliseconds to sleep between frames>
+//e <frame> <uniform> <value> (changes a uniform before the frame)
+//s <specialize_frames>
+//y <attribute> <dtype> (float32 if not given)
+//g <emitter source>
+//v <uniform> <value> (emitter uniform)
+//n <particle count> (spawned before the first frame instead of all of them)
+//x <error> (expected to be reported by a frame)
+//w <frame> <sim|emit> <tier> (kernel the frame is expected to run on)
+//c <frame> <uniform> <value> (changes an emitter uniform before the frame)
+typedef struct test_t {
+    int count;
+    int argc;
+    char** argv;
+} test_t;
 
 static int32_t get_floati(float f) {
     union {
@@ -31,133 +64,431 @@ static bool float_equal(float a, float b) {
     return false;
 }
 
-int main(int argc, char** argv) {
-    runtime_t runtime;
-    if (!create_runtime(&runtime, NULL)) {
-        fprintf(stderr, "Failed to create runtime: %s\n", runtime.error);
-        return 1;
+//Returns the number of arguments after an option or -1 if it is unknown
+static int get_arg_count(const char* option) {
+    switch (option[0]) {
+    case 'p': return 4;
+    case 'u': return 2;
+    case 'd': return 1;
+    case 'k': return 2;
+    case 'b': return 0;
+    case 'm': return 1;
+    case 'a': return 0;
+    case 't': return 1;
+    case 'i': return 2;
+    case 'r': return 3;
+    case 'f': return 2;
+    case 'e': return 3;
+    case 's': return 1;
+    case 'y': return 2;
+    case 'g': return 1;
+    case 'v': return 2;
+    case 'n': return 1;
+    case 'x': return 1;
+    case 'w': return 3;
+    case 'c': return 3;
+    default: return -1;
+    }
+}
+
+static bool check_args(const test_t* test) {
+    for (int i = 0; i < test->argc; i += get_arg_count(test->argv[i])+1) {
+        int count = get_arg_count(test->argv[i]);
+        if (count<0 || i+count>=test->argc) {
+            fprintf(stderr, "Invalid option \"%s\"\n", test->argv[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+//Returns the arguments of the first occurrence of option or NULL
+static char** find_option(const test_t* test, char option) {
+    for (int i = 0; i < test->argc; i += get_arg_count(test->argv[i])+1)
+        if (test->argv[i][0] == option) return test->argv + i + 1;
+    return NULL;
+}
+
+//Returns the dtype given to the attribute or -1 if the name is unknown
+static int get_dtype(const test_t* test, const char* attribute) {
+    for (int i = 0; i < test->argc; i += get_arg_count(test->argv[i])+1) {
+        if (test->argv[i][0]!='y' || strcmp(test->argv[i+1], attribute)) continue;
+        for (int dtype = 0; dtype <= ATTR_FLOAT64; dtype++)
+            if (!strcmp(test->argv[i+2], dtype_names[dtype])) return dtype;
+        fprintf(stderr, "Unknown dtype \"%s\"\n", test->argv[i+2]);
+        return -1;
+    }
+    return ATTR_FLOAT32;
+}
+
+//Reads a value the same way the simulation loads it
+static double read_value(const particles_t* particles, int attribute, size_t index) {
+    const void* data = particles->attributes[attribute];
+    switch (particles->attribute_dtypes[attribute]) {
+    case ATTR_UINT8: return ((const uint8_t*)data)[index] / 255.0;
+    case ATTR_INT8: return ((const int8_t*)data)[index] / 127.0;
+    case ATTR_UINT16: return ((const uint16_t*)data)[index] / 65535.0;
+    case ATTR_INT16: return ((const int16_t*)data)[index] / 32767.0;
+    case ATTR_UINT32: return ((const uint32_t*)data)[index] / 4294967295.0;
+    case ATTR_INT32: return ((const int32_t*)data)[index] / 2147483647.0;
+    case ATTR_FLOAT32: return ((const float*)data)[index];
+    case ATTR_FLOAT64: return ((const double*)data)[index];
+    }
+    return 0.0;
+}
+
+//Returns the difference between two adjacent values of the dtype. Both the
+//input and the result are truncated, so they may be off by two steps.
+static double get_dtype_step(attr_dtype_t dtype) {
+    switch (dtype) {
+    case ATTR_UINT8: return 1.0 / 255.0;
+    case ATTR_INT8: return 1.0 / 127.0;
+    case ATTR_UINT16: return 1.0 / 65535.0;
+    case ATTR_INT16: return 1.0 / 32767.0;
+    case ATTR_UINT32: return 1.0 / 4294967295.0;
+    case ATTR_INT32: return 1.0 / 2147483647.0;
+    default: return 0.0;
+    }
+}
+
+static int find_attribute(const particles_t* particles, const char* name) {
+    for (size_t i = 0; i < 256; i++)
+        if (particles->attribute_names[i] && !strcmp(particles->attribute_names[i], name))
+            return i;
+    return -1;
+}
+
+//Adds the attributes, spawns the particles and writes the inputs to them
+static bool init_particles(const test_t* test, particles_t* particles) {
+    for (int i = 0; i < test->argc; i += get_arg_count(test->argv[i])+1) {
+        if (test->argv[i][0] != 'p') continue;
+        const char* name = test->argv[i+1];
+        int dtype = get_dtype(test, name);
+        if (dtype < 0) return false;
+        int index;
+        if (find_attribute(particles, name)<0 && !add_attribute(particles, name, dtype, &index)) {
+            fprintf(stderr, "Failed to add attribute \"%s\"\n", name);
+            return false;
+        }
+    }
+    
+    char** spawn_args = find_option(test, 'n');
+    size_t count = spawn_args ? atoi(spawn_args[0]) : test->count;
+    particle_range_t range;
+    if (!spawn_particles(particles, count, &range) || range.count != count) {
+        fprintf(stderr, "Failed to spawn particles: %s\n", particles->runtime->error);
+        return false;
+    }
+    
+    float* values = calloc(test->count+1, sizeof(float));
+    for (size_t index = 0; index < 256; index++) {
+        if (!particles->attribute_names[index]) continue;
+        memset(values, 0, test->count*sizeof(float));
+        for (int i = 0; i < test->argc; i += get_arg_count(test->argv[i])+1) {
+            if (test->argv[i][0]!='p' || strcmp(test->argv[i+1], particles->attribute_names[index])) continue;
+            values[atoi(test->argv[i+4])] = atof(test->argv[i+2]);
+        }
+        if (!write_attribute(particles, index, range, ATTR_FLOAT32, values)) {
+            fprintf(stderr, "Failed to write attribute: %s\n", particles->runtime->error);
+            free(values);
+            return false;
+        }
+    }
+    free(values);
+    
+    //The particles are live in the first snapshot
+    if (find_option(test, 'b') && !set_double_buffered(particles, true)) {
+        fprintf(stderr, "Failed to double buffer particles: %s\n", particles->runtime->error);
+        return false;
+    }
+    
+    return true;
+}
+
+//Sets the uniforms, the emitter uniforms and the instance uniforms, which are
+//allocated and must be freed after the system is destroyed
+static bool set_uniforms(const test_t* test, system_t* system) {
+    char** instance_args = find_option(test, 'i');
+    float* instance_uniforms = NULL;
+    if (instance_args) {
+        system->instance_attribute = find_attribute(system->particles, instance_args[0]);
+        system->instance_count = atoi(instance_args[1]);
+        instance_uniforms = calloc(system->instance_count*system->sim_program->uniform_count+1, sizeof(float));
+        system->instance_uniforms = instance_uniforms;
+    }
+    
+    for (int i = 0; i < test->argc; i += get_arg_count(test->argv[i])+1) {
+        bool instance = test->argv[i][0] == 'r';
+        bool emitter = test->argv[i][0] == 'v';
+        if (test->argv[i][0]!='u' && !instance && !emitter) continue;
+        const char* name = test->argv[i+1+instance];
+        
+        const program_t* program = emitter ? system->emit_program : system->sim_program;
+        int index = program ? get_uniform_index(program, name) : -1;
+        if (index < 0) {
+            fprintf(stderr, "Failed to find uniform \"%s\"\n", name);
+            return false;
+        }
+        
+        float value = atof(test->argv[i+2+instance]);
+        if (emitter) {
+            system->emit_uniforms[index] = value;
+            continue;
+        } else if (!instance) {
+            system->sim_uniforms[index] = value;
+            continue;
+        }
+        size_t row = atoi(test->argv[i+1]);
+        if (!instance_uniforms || row>=system->instance_count) {
+            fprintf(stderr, "Invalid instance %zu\n", row);
+            return false;
+        }
+        instance_uniforms[row*system->sim_program->uniform_count+index] = value;
+    }
+    return true;
+}
+
+static bool is_deleted(const test_t* test, int particle) {
+    for (int i = 0; i < test->argc; i += get_arg_count(test->argv[i])+1)
+        if (test->argv[i][0]=='d' && atoi(test->argv[i+1])==particle) return true;
+    return false;
+}
+
+static bool check_particles(const test_t* test, const particles_t* particles) {
+    size_t usage = test->count;
+    for (int i = 0; i < test->count; i++) {
+        bool live = next_live_particle(particles, i, i+1) == i;
+        if (live == is_deleted(test, i)) {
+            fprintf(stderr, "Particle %d should %s\n", i, live?"have been deleted":"not have been deleted");
+            return false;
+        }
+        usage -= !live;
+        
+        if (particles->double_buffered && (particles->front_live_bits[i/64]>>i%64&1)!=live) {
+            fprintf(stderr, "Front occupancy of particle %d is out of date\n", i);
+            return false;
+        }
+    }
+    if (particles->pool_usage != usage) {
+        fprintf(stderr, "Incorrect pool usage. Expected %zu. Got %zu\n", usage, particles->pool_usage);
+        return false;
     }
     
+    for (int i = 0; i < test->argc; i += get_arg_count(test->argv[i])+1) {
+        if (test->argv[i][0]!='p' || is_deleted(test, atoi(test->argv[i+4]))) continue;
+        const char* name = test->argv[i+1];
+        const char* expected = test->argv[i+3];
+        int particle_index = atoi(test->argv[i+4]);
+        
+        int index = find_attribute(particles, name);
+        double val = read_value(particles, index, particle_index);
+        double step = get_dtype_step(particles->attribute_dtypes[index]);
+        if (!float_equal(val, atof(expected)) && fabs(val-atof(expected))>step*2.0) {
+            fprintf(stderr, "Incorrect value for attribute \"%s\" for particle %d. Expected %f. Got %f\n",
+                    name, particle_index, atof(expected), val);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool change_uniforms(const test_t* test, system_t* systems, size_t count, size_t frame) {
+    for (int i = 0; i < test->argc; i += get_arg_count(test->argv[i])+1) {
+        bool emitter = test->argv[i][0] == 'c';
+        if ((test->argv[i][0]!='e' && !emitter) || atoi(test->argv[i+1])!=frame) continue;
+        const char* name = test->argv[i+2];
+        
+        const program_t* program = emitter ? systems[0].emit_program : systems[0].sim_program;
+        int index = program ? get_uniform_index(program, name) : -1;
+        if (index < 0) {
+            fprintf(stderr, "Failed to find uniform \"%s\"\n", name);
+            return false;
+        }
+        
+        for (size_t j = 0; j < count; j++) {
+            float* uniforms = emitter ? systems[j].emit_uniforms : systems[j].sim_uniforms;
+            uniforms[index] = atof(test->argv[i+3]);
+        }
+    }
+    return true;
+}
+
+static bool check_tiers(const test_t* test, const system_t* systems, size_t count, size_t frame) {
+    for (int i = 0; i < test->argc; i += get_arg_count(test->argv[i])+1) {
+        if (test->argv[i][0]!='w' || atoi(test->argv[i+1])!=frame) continue;
+        bool emitter = !strcmp(test->argv[i+2], "emit");
+        const char* expected = test->argv[i+3];
+        
+        for (size_t j = 0; j < count; j++) {
+            kernel_tier_t tier = emitter ? systems[j].emit_tier : systems[j].sim_tier;
+            if (strcmp(tier_names[tier], expected)) {
+                fprintf(stderr, "Frame %zu should have been %s with the %s tier. Got the %s tier\n",
+                        frame, emitter?"emitted":"simulated", expected, tier_names[tier]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool simulate_frame(const test_t* test, system_t* systems, size_t count) {
+    runtime_t* runtime = systems[0].runtime;
+    if (find_option(test, 'a')) {
+        thread_fence_t* fences[MAX_SYSTEMS];
+        for (size_t i = 0; i < count; i++) {
+            fences[i] = simulate_system_async(&systems[i]);
+            if (!fences[i]) {
+                while (i) threading_wait(&runtime->threading, fences[--i]);
+                return false;
+            }
+        }
+        bool success = true;
+        for (size_t i = 0; i < count; i++)
+            success = threading_wait(&runtime->threading, fences[i]) && success;
+        return success;
+    } else if (find_option(test, 'm')) {
+        //The systems are simulated together to test simulate_systems()
+        system_t* system_ptrs[MAX_SYSTEMS];
+        for (size_t i = 0; i < count; i++) system_ptrs[i] = &systems[i];
+        return simulate_systems(system_ptrs, count);
+    } else {
+        return simulate_system(&systems[0]);
+    }
+}
+
+//Compiles the source as a program of the given type and opens it
+static bool compile_program(const char* source, const char* type, program_t* program) {
     char prog[1024];
-    snprintf(prog, sizeof(prog), "%s.bin", argv[1]);
+    snprintf(prog, sizeof(prog), "%s.bin", source);
     
     char cmd[1024];
-    snprintf(cmd, sizeof(cmd), "../compiler/compiler -I../compiler/ -i %s -o %s -t sim", argv[1], prog);
+    snprintf(cmd, sizeof(cmd), "../compiler/compiler -I../compiler/ -i %s -o %s -t %s", source, prog, type);
     system(cmd);
     
-    int count = atoi(argv[2]);
+    if (!open_program(prog, program)) {
+        fprintf(stderr, "Failed to open %s: %s\n", prog, program->runtime->error);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    test_t test;
+    test.count = atoi(argv[2]);
+    test.argc = argc - 3;
+    test.argv = argv + 3;
+    if (!check_args(&test)) return 1;
     
-    program_t program;
-    program.runtime = &runtime;
-    if (!open_program(prog, &program)) {
-        fprintf(stderr, "Failed to open %s: %s\n", prog, runtime.error);
+    threading_t threading;
+    char** thread_args = find_option(&test, 't');
+    if (thread_args && !create_builtin_threading(&threading, atoi(thread_args[0]), false)) {
+        fprintf(stderr, "Failed to create threading: %s\n", threading.error);
         return 1;
     }
     
-    particles_t particles;
-    particles.runtime = &runtime;
-    if (!create_particles(&particles, count)) {
-        fprintf(stderr, "Failed to create particles: %s\n", runtime.error);
+    runtime_t runtime;
+    if (!create_runtime(&runtime, thread_args?&threading:NULL)) {
+        fprintf(stderr, "Failed to create runtime: %s\n", runtime.error);
         return 1;
     }
     
-    for (int i = 3; i<argc;) {
-        if (argv[i][0] == 'p') {
-            i++;
-            const char* name = argv[i];
-            const char* input = argv[i+1];
-            int particle_index = atoi(argv[i+3]);
-            
-            int index = -1;
-            for (size_t i = 0; i < 256; i++)
-                if (particles.attribute_names[i] && !strcmp(particles.attribute_names[i], name)) {
-                    index = i;
-                    break;
-                }
-            if (index < 0)
-                if (!add_attribute(&particles, name, ATTR_FLOAT32, &index)) {
-                    fprintf(stderr, "Failed to add attribute \"%s\"\n", name);
-                    return 1;
-                }
-            
-            ((float*)particles.attributes[index])[particle_index] = atof(input);
-            i += 4;
-        } else if (argv[i][0] == 'u') i += 3;
-    }
+    program_t program;
+    program.runtime = &runtime;
+    if (!compile_program(argv[1], "sim", &program)) return 1;
     
-    for (size_t i = 0; i < count; i++)
-        if (spawn_particle(&particles) < 0) {
-            fprintf(stderr, "Failed to spawn particle: %s\n", runtime.error);
-            return 1;
-        }
+    program_t emit_program;
+    emit_program.runtime = &runtime;
+    char** emitter_args = find_option(&test, 'g');
+    if (emitter_args && !compile_program(emitter_args[0], "emit", &emit_program)) return 1;
     
-    system_t system;
-    system.runtime = &runtime;
-    system.particles = &particles;
-    system.sim_program = &program;
-    system.emit_program = NULL;
-    if (!create_system(&system)) {
-        fprintf(stderr, "Failed to create particle system: %s\n", runtime.error);
+    size_t count = 1;
+    char** systems_args = find_option(&test, 'm');
+    if (systems_args) count = atoi(systems_args[0]);
+    if (count<1 || count>MAX_SYSTEMS) {
+        fprintf(stderr, "Invalid system count\n");
         return 1;
     }
-    for (int i = 3; i<argc;) {
-        if (argv[i][0] == 'p') i += 5;
-        else if (argv[i][0] == 'u') {
-            i++;
-            const char* name = argv[i];
-            const char* input = argv[i+1];
-            
-            int index = get_uniform_index(&program, name);
-            if (index < 0) {
-                fprintf(stderr, "Failed to find uniform \"%s\"\n", name);
-                return 1;
-            }
-            
-            system.sim_uniforms[index] = atof(input);
-            i += 2;
+    
+    particles_t particles[MAX_SYSTEMS];
+    system_t systems[MAX_SYSTEMS];
+    for (size_t i = 0; i < count; i++) {
+        particles[i].runtime = &runtime;
+        if (!create_particles(&particles[i], test.count)) {
+            fprintf(stderr, "Failed to create particles: %s\n", runtime.error);
+            return 1;
+        }
+        
+        if (!init_particles(&test, &particles[i])) return 1;
+        char** compact_args = find_option(&test, 'k');
+        if (compact_args) {
+            particles[i].compact_moves = atoi(compact_args[0]);
+            particles[i].compact_threshold = atof(compact_args[1]);
         }
+        
+        system_t* system = &systems[i];
+        system->runtime = &runtime;
+        system->particles = &particles[i];
+        system->sim_program = &program;
+        system->emit_program = emitter_args ? &emit_program : NULL;
+        if (!create_system(system)) {
+            fprintf(stderr, "Failed to create particle system: %s\n", runtime.error);
+            return 1;
+        }
+        if (!set_uniforms(&test, system)) return 1;
+        char** specialize_args = find_option(&test, 's');
+        if (specialize_args) system->specialize_frames = atoi(specialize_args[0]);
     }
     
-    if (!simulate_system(&system)) {
-        fprintf(stderr, "Failed to execute program: %s\n", runtime.error);
-        destroy_program(&program);
-        return 1;
+    //Sleeping between frames gives the LLVM backend time to compile kernels
+    //in the background and switch to them
+    size_t frames = 1;
+    struct timespec frame_sleep = {0, 0};
+    char** frame_args = find_option(&test, 'f');
+    if (frame_args) {
+        frames = atoi(frame_args[0]);
+        frame_sleep.tv_sec = atoi(frame_args[1]) / 1000;
+        frame_sleep.tv_nsec = atoi(frame_args[1]) % 1000 * 1000000;
     }
     
-    for (int i = 3; i<argc;)
-        if (argv[i][0] == 'p') {
-            i++;
-            const char* name = argv[i];
-            const char* expected = argv[i+2];
-            int particle_index = atoi(argv[i+3]);
-            
-            int index = 0;
-            for (size_t i = 0; i < 256; i++)
-                if (particles.attribute_names[i] && !strcmp(particles.attribute_names[i], name)) {
-                    index = i;
-                    break;
-                }
-            
-            float val = ((float*)particles.attributes[index])[particle_index];
-            if (!float_equal(val, atof(expected))) {
-                fprintf(stderr, "Incorrect value for attribute \"%s\" for particle %d. Expected %f. Got %f\n",
-                        name, particle_index, atof(expected), val);
-                return 1;
-            }
-            i += 4;
-        } else if (argv[i][0] == 'u') i += 3;
-    
-    if (!destroy_system(&system)) {
-        fprintf(stderr, "Failed to destroy program: %s\n", runtime.error);
+    char** error_args = find_option(&test, 'x');
+    bool failed = false;
+    for (size_t frame = 0; frame < frames; frame++) {
+        if (frame) nanosleep(&frame_sleep, NULL);
+        if (!change_uniforms(&test, systems, count, frame)) return 1;
+        bool success = simulate_frame(&test, systems, count);
+        if (!check_tiers(&test, systems, count, frame)) return 1;
+        if (success) continue;
+        
+        //The particles the frame managed to spawn are still checked
+        failed = true;
+        if (!error_args || strcmp(runtime.error, error_args[0])) {
+            fprintf(stderr, "Failed to execute program: %s\n", runtime.error);
+            destroy_program(&program);
+            return 1;
+        }
+    }
+    if (error_args && !failed) {
+        fprintf(stderr, "Expected the error \"%s\"\n", error_args[0]);
         return 1;
     }
     
-    if (!destroy_particles(&particles)) {
-        fprintf(stderr, "Failed to destroy particles: %s\n", runtime.error);
-        return 1;
+    for (size_t i = 0; i < count; i++)
+        if (!check_particles(&test, &particles[i])) return 1;
+    
+    for (size_t i = 0; i < count; i++) {
+        if (!destroy_system(&systems[i])) {
+            fprintf(stderr, "Failed to destroy program: %s\n", runtime.error);
+            return 1;
+        }
+        free((float*)systems[i].instance_uniforms);
+        
+        if (!destroy_particles(&particles[i])) {
+            fprintf(stderr, "Failed to destroy particles: %s\n", runtime.error);
+            return 1;
+        }
     }
     
-    if (!destroy_program(&program)) {
+    if (!destroy_program(&program) || (emitter_args && !destroy_program(&emit_program))) {
         fprintf(stderr, "Failed to destroy program: %s\n", runtime.error);
         return 1;
     }
@@ -1,4 +1,5 @@
 import os
+import shutil
 import tempfile
 
 test_files = os.listdir('tests')
@@ -26,7 +27,77 @@ for testf in test_files:
         for name in test.get('uniforms', {}).keys():
             cmd += ' u %s %f' % (name, test['uniforms'][name])
         
-        os.system(cmd)
+        for i in test.get('deleted', []):
+            cmd += ' d %d' % i
+        
+        if 'compact' in test:
+            cmd += ' k %d %f' % tuple(test['compact'])
+        
+        if test.get('double_buffered', False):
+            cmd += ' b'
+        
+        if 'systems' in test:
+            cmd += ' m %d' % test['systems']
+        
+        if test.get('async', False):
+            cmd += ' a'
+        
+        if 'threads' in test:
+            cmd += ' t %d' % test['threads']
+        
+        if 'instances' in test:
+            cmd += ' i %s %d' % (test['instance_attribute'], len(test['instances']))
+            for i, uniforms in enumerate(test['instances']):
+                for name in uniforms.keys():
+                    cmd += ' r %d %s %f' % (i, name, uniforms[name])
+        
+        if 'frames' in test:
+            cmd += ' f %d %d' % (test['frames'], test.get('frame_sleep', 0))
+        
+        for frame, name, val in test.get('uniform_changes', []):
+            cmd += ' e %d %s %f' % (frame, name, val)
+        
+        for frame, name, val in test.get('emit_uniform_changes', []):
+            cmd += ' c %d %s %f' % (frame, name, val)
+        
+        if 'specialize_frames' in test:
+            cmd += ' s %d' % test['specialize_frames']
+        
+        for name in test.get('dtypes', {}).keys():
+            cmd += ' y %s %s' % (name, test['dtypes'][name])
+        
+        if 'emitter' in test:
+            f = open(".temp_emit", 'w')
+            f.write(test['emitter'])
+            f.close()
+            cmd += ' g .temp_emit'
+        
+        for name in test.get('emit_uniforms', {}).keys():
+            cmd += ' v %s %f' % (name, test['emit_uniforms'][name])
+        
+        if 'spawned' in test:
+            cmd += ' n %d' % test['spawned']
+        
+        if 'error' in test:
+            cmd += ' x "%s"' % test['error']
+        
+        for frame, program, tier in test.get('tiers', []):
+            cmd += ' w %d %s %s' % (frame, program, tier)
+        
+        #The second run loads the kernels the first one stored in the cache
+        if test.get('jit_cache', False):
+            cache_dir = tempfile.mkdtemp()
+            cmd = 'WIP26_JIT_CACHE=%s %s' % (cache_dir, cmd)
+            os.system(cmd)
+            if not os.listdir(cache_dir):
+                print 'No kernels were stored in the JIT cache'
+            os.system(cmd)
+            shutil.rmtree(cache_dir)
+        else:
+            os.system(cmd)
         
         os.remove(".temp")
         os.remove(".temp.bin")
+        if 'emitter' in test:
+            os.remove(".temp_emit")
+            os.remove(".temp_emit.bin")
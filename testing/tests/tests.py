@@ -596,4 +596,796 @@
         'v.y': [1.0],
         'v.z': [9.0]
     }
+},
+{
+    'name': 'test wide blocks',
+    'source':
+    '''include stdlib;
+    attribute v:vec3;
+    var a:float = floor(v.x * 0.5);
+    v.y = sel(a, -a, v.x > 20.0 && !(v.x > 40.0));
+    v.z = sqrt(v.x) * 2.0 - 1.0;
+    ''',
+    'count': 48,
+    'attributes': {
+        'v.x': [0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 16.0, 17.0, 18.0, 19.0, 20.0, 21.0, 22.0, 23.0, 24.0, 25.0, 26.0, 27.0, 28.0, 29.0, 30.0, 31.0, 32.0, 33.0, 34.0, 35.0, 36.0, 37.0, 38.0, 39.0, 40.0, 41.0, 42.0, 43.0, 44.0, 45.0, 46.0, 47.0],
+        'v.y': [0.0]*48,
+        'v.z': [0.0]*48
+    },
+    'expected': {
+        'v.x': [0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 16.0, 17.0, 18.0, 19.0, 20.0, 21.0, 22.0, 23.0, 24.0, 25.0, 26.0, 27.0, 28.0, 29.0, 30.0, 31.0, 32.0, 33.0, 34.0, 35.0, 36.0, 37.0, 38.0, 39.0, 40.0, 41.0, 42.0, 43.0, 44.0, 45.0, 46.0, 47.0],
+        'v.y': [0.0, 0.0, -1.0, -1.0, -2.0, -2.0, -3.0, -3.0, -4.0, -4.0, -5.0, -5.0, -6.0, -6.0, -7.0, -7.0, -8.0, -8.0, -9.0, -9.0, -10.0, 10.0, 11.0, 11.0, 12.0, 12.0, 13.0, 13.0, 14.0, 14.0, 15.0, 15.0, 16.0, 16.0, 17.0, 17.0, 18.0, 18.0, 19.0, 19.0, 20.0, -20.0, -21.0, -21.0, -22.0, -22.0, -23.0, -23.0],
+        'v.z': [-1.0, 1.0, 1.828427, 2.464102, 3.0, 3.472136, 3.898979, 4.291503, 4.656854, 5.0, 5.324555, 5.63325, 5.928203, 6.211103, 6.483315, 6.745967, 7.0, 7.246211, 7.485281, 7.717798, 7.944272, 8.165151, 8.380832, 8.591663, 8.797959, 9.0, 9.198039, 9.392305, 9.583005, 9.77033, 9.954451, 10.135529, 10.313708, 10.489125, 10.661904, 10.83216, 11.0, 11.165525, 11.328828, 11.489996, 11.649111, 11.806248, 11.961481, 12.114877, 12.266499, 12.416408, 12.56466, 12.711309]
+    }
+},
+{
+    'name': 'test divergent if',
+    'source':
+    '''attribute v:vec3;
+    if v.x > 10.0 {
+        v.y = v.x * 2.0;
+        if v.x > 30.0 {v.z = 1.0;}
+    }
+    if v.x < 5.0 {
+        var i:float = 0;
+        while i < v.x {
+            i = i + 1;
+            v.z = v.z + 2.0;
+        }
+    }
+    ''',
+    'count': 48,
+    'attributes': {
+        'v.x': [0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 16.0, 17.0, 18.0, 19.0, 20.0, 21.0, 22.0, 23.0, 24.0, 25.0, 26.0, 27.0, 28.0, 29.0, 30.0, 31.0, 32.0, 33.0, 34.0, 35.0, 36.0, 37.0, 38.0, 39.0, 40.0, 41.0, 42.0, 43.0, 44.0, 45.0, 46.0, 47.0],
+        'v.y': [0.0]*48,
+        'v.z': [0.0]*48
+    },
+    'expected': {
+        'v.x': [0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 16.0, 17.0, 18.0, 19.0, 20.0, 21.0, 22.0, 23.0, 24.0, 25.0, 26.0, 27.0, 28.0, 29.0, 30.0, 31.0, 32.0, 33.0, 34.0, 35.0, 36.0, 37.0, 38.0, 39.0, 40.0, 41.0, 42.0, 43.0, 44.0, 45.0, 46.0, 47.0],
+        'v.y': [0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 22.0, 24.0, 26.0, 28.0, 30.0, 32.0, 34.0, 36.0, 38.0, 40.0, 42.0, 44.0, 46.0, 48.0, 50.0, 52.0, 54.0, 56.0, 58.0, 60.0, 62.0, 64.0, 66.0, 68.0, 70.0, 72.0, 74.0, 76.0, 78.0, 80.0, 82.0, 84.0, 86.0, 88.0, 90.0, 92.0, 94.0],
+        'v.z': [0.0, 2.0, 4.0, 6.0, 8.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0]
+    }
+}, {
+    'name': 'test divergent loop',
+    'source':
+    '''attribute v:vec3;
+    for var i:float=0; i<v.x; i=i+1 {
+        v.y = v.y + i;
+        if i > 3.0 {v.z = v.z + 1.0;}
+    }
+    ''',
+    'count': 48,
+    'attributes': {
+        'v.x': [0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 16.0, 17.0, 18.0, 19.0, 0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 16.0, 17.0, 18.0, 19.0, 0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0],
+        'v.y': [0.0]*48,
+        'v.z': [0.0]*48
+    },
+    'expected': {
+        'v.x': [0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 16.0, 17.0, 18.0, 19.0, 0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 16.0, 17.0, 18.0, 19.0, 0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0],
+        'v.y': [0.0, 0.0, 1.0, 3.0, 6.0, 10.0, 15.0, 21.0, 28.0, 36.0, 45.0, 55.0, 66.0, 78.0, 91.0, 105.0, 120.0, 136.0, 153.0, 171.0, 0.0, 0.0, 1.0, 3.0, 6.0, 10.0, 15.0, 21.0, 28.0, 36.0, 45.0, 55.0, 66.0, 78.0, 91.0, 105.0, 120.0, 136.0, 153.0, 171.0, 0.0, 0.0, 1.0, 3.0, 6.0, 10.0, 15.0, 21.0],
+        'v.z': [0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 2.0, 3.0]
+    }
+}, {
+    'name': 'test rand range',
+    'source':
+    '''include stdlib;
+    attribute v:vec3;
+    v.x = floor(rand1());
+    v.y = floor(rand1() - 1.0);
+    v.z = floor(rand1() + 1.0);
+    ''',
+    'count': 48,
+    'attributes': {
+        'v.x': [0.0]*48,
+        'v.y': [0.0]*48,
+        'v.z': [0.0]*48
+    },
+    'expected': {
+        'v.x': [0.0]*48,
+        'v.y': [-1.0]*48,
+        'v.z': [1.0]*48
+    }
+}, {
+    'name': 'test fused multiply',
+    'source':
+    '''include stdlib;
+    attribute v:vec3;
+    var x:float = v.x;
+    var y:float = v.y;
+    var z:float = v.z;
+    v.x = x*y + z;
+    v.y = x*y - z;
+    v.z = lerp(x, y, z) - x*y;
+    ''',
+    'count': 48,
+    'attributes': {
+        'v.x': [-5.0, -4.75, -4.5, -4.25, -4.0, -3.75, -3.5, -3.25, -3.0, -2.75, -2.5, -2.25, -2.0, -1.75, -1.5, -1.25, -1.0, -0.75, -0.5, -0.25, 0.0, 0.25, 0.5, 0.75, 1.0, 1.25, 1.5, 1.75, 2.0, 2.25, 2.5, 2.75, 3.0, 3.25, 3.5, 3.75, 4.0, 4.25, 4.5, 4.75, 5.0, 5.25, 5.5, 5.75, 6.0, 6.25, 6.5, 6.75],
+        'v.y': [-3.0, 4.0, 0.0, 7.0, 3.0, -1.0, 6.0, 2.0, -2.0, 5.0, 1.0, -3.0, 4.0, 0.0, 7.0, 3.0, -1.0, 6.0, 2.0, -2.0, 5.0, 1.0, -3.0, 4.0, 0.0, 7.0, 3.0, -1.0, 6.0, 2.0, -2.0, 5.0, 1.0, -3.0, 4.0, 0.0, 7.0, 3.0, -1.0, 6.0, 2.0, -2.0, 5.0, 1.0, -3.0, 4.0, 0.0, 7.0],
+        'v.z': [0.0, 2.5, 5.0, 1.0, 3.5, 6.0, 2.0, 4.5, 0.5, 3.0, 5.5, 1.5, 4.0, 0.0, 2.5, 5.0, 1.0, 3.5, 6.0, 2.0, 4.5, 0.5, 3.0, 5.5, 1.5, 4.0, 0.0, 2.5, 5.0, 1.0, 3.5, 6.0, 2.0, 4.5, 0.5, 3.0, 5.5, 1.5, 4.0, 0.0, 2.5, 5.0, 1.0, 3.5, 6.0, 2.0, 4.5, 0.5]
+    },
+    'expected': {
+        'v.x': [15.0, -16.5, 5.0, -28.75, -8.5, 9.75, -19.0, -2.0, 6.5, -10.75, 3.0, 8.25, -4.0, 0.0, -8.0, 1.25, 2.0, -1.0, 5.0, 2.5, 4.5, 0.75, 1.5, 8.5, 1.5, 12.75, 4.5, 0.75, 17.0, 5.5, -1.5, 19.75, 5.0, -5.25, 14.5, 3.0, 33.5, 14.25, -0.5, 28.5, 12.5, -5.5, 28.5, 9.25, -12.0, 27.0, 4.5, 47.75],
+        'v.y': [15.0, -21.5, -5.0, -30.75, -15.5, -2.25, -23.0, -11.0, 5.5, -16.75, -8.0, 5.25, -12.0, 0.0, -13.0, -8.75, 0.0, -8.0, -7.0, -1.5, -4.5, -0.25, -4.5, -2.5, -1.5, 4.75, 4.5, -4.25, 7.0, 3.5, -8.5, 7.75, 1.0, -14.25, 13.5, -3.0, 22.5, 11.25, -8.5, 28.5, 7.5, -15.5, 26.5, 2.25, -24.0, 23.0, -4.5, 46.75],
+        'v.z': [-20.0, 36.125, 18.0, 36.75, 32.5, 9.0, 36.5, 26.875, -8.5, 34.25, 19.25, -10.125, 30.0, -1.75, 30.25, 23.75, -2.0, 27.375, 15.5, -4.25, 22.5, 0.375, -8.5, 15.625, -0.5, 15.5, -3.0, -3.375, 10.0, -2.5, -8.25, 2.5, -4.0, -15.125, -10.25, -7.5, -7.5, -10.375, -13.0, -23.75, -12.5, -20.5, -22.5, -16.625, -30.0, -23.25, -22.75, -40.375]
+    }
+}, {
+    'name': 'test fusions sharing an operand',
+    'source':
+    '''attribute v:vec4;
+    var x:float = v.x;
+    var a:float = v.y;
+    var b:float = v.z;
+    var c:float = v.w;
+    var p:float = x*a;
+    var q:float = x*b;
+    var r:float = p+c;
+    var s:float = q+c;
+    v.x = r;
+    v.y = s;
+    v.z = a+b+c;
+    ''',
+    'count': 2,
+    'attributes': {
+        'v.x': [2.0, -1.0],
+        'v.y': [3.0, 0.5],
+        'v.z': [4.0, 2.0],
+        'v.w': [1.0, 3.0]
+    },
+    'expected': {
+        'v.x': [7.0, 2.5],
+        'v.y': [9.0, 1.0],
+        'v.z': [8.0, 5.5],
+        'v.w': [1.0, 3.0]
+    }
+},
+{
+    'name': 'test fusing a multiply whose operand is redefined in a loop',
+    'source':
+    '''attribute v:vec2;
+    var acc:float = 0;
+    var i:float = 0;
+    while i < v.x {
+        var m:float = i * 2.0;
+        i = i + 1;
+        acc = m + acc;
+    }
+    v.y = acc;
+    ''',
+    'count': 2,
+    'attributes': {
+        'v.x': [3.0, 4.0],
+        'v.y': [0.0, 0.0]
+    },
+    'expected': {
+        'v.x': [3.0, 4.0],
+        'v.y': [6.0, 12.0]
+    }
+},
+{
+    'name': 'test fusing a multiply whose operand is redefined in an if',
+    'source':
+    '''attribute v:vec2;
+    if v.x > 0 {
+        var m:float = v.x * 2.0;
+        v.x = 10.0;
+        v.y = m + 1.0;
+    }
+    ''',
+    'count': 2,
+    'attributes': {
+        'v.x': [3.0, -1.0],
+        'v.y': [0.0, 0.0]
+    },
+    'expected': {
+        'v.x': [10.0, -1.0],
+        'v.y': [7.0, 0.0]
+    }
+},
+{
+    'name': 'test bulk spawn',
+    'source':
+    '''attribute v:float;
+    v.x = v.x * 2.0;
+    ''',
+    'count': 130,
+    'attributes': {
+        'v.x': [float(i) for i in range(130)]
+    },
+    'expected': {
+        'v.x': [float(i*2) for i in range(130)]
+    }
+},
+{
+    'name': 'test deletion',
+    'source':
+    '''include stdlib;
+    attribute v:vec2;
+    if v.x > 2.0 {
+        del();
+    }
+    v.y = v.y + 1.0;
+    ''',
+    'count': 6,
+    'attributes': {
+        'v.x': [1.0, 3.0, 2.0, 5.0, 0.0, 4.0],
+        'v.y': [1.0, 2.0, 3.0, 4.0, 5.0, 6.0]
+    },
+    'expected': {
+        'v.x': [1.0, 3.0, 2.0, 5.0, 0.0, 4.0],
+        'v.y': [2.0, 2.0, 4.0, 4.0, 6.0, 6.0]
+    },
+    'deleted': [1, 3, 5]
+},
+{
+    'name': 'test deleting whole bitmap words',
+    'source':
+    '''include stdlib;
+    attribute v:float;
+    if v.x < 128.0 {
+        del();
+    }
+    ''',
+    'count': 200,
+    'attributes': {
+        'v.x': [float(i) for i in range(200)]
+    },
+    'expected': {
+        'v.x': [float(i) for i in range(200)]
+    },
+    'deleted': range(128)
+},
+{
+    'name': 'test compaction',
+    'source':
+    '''include stdlib;
+    attribute v:vec2;
+    if v.x > 2.0 {
+        del();
+    }
+    v.y = v.y + 1.0;
+    ''',
+    'count': 6,
+    'attributes': {
+        'v.x': [1.0, 3.0, 2.0, 5.0, 0.0, 0.5],
+        'v.y': [1.0, 2.0, 3.0, 4.0, 5.0, 6.0]
+    },
+    'expected': {
+        'v.x': [1.0, 0.5, 2.0, 5.0, 0.0, 0.5],
+        'v.y': [2.0, 7.0, 4.0, 4.0, 6.0, 6.0]
+    },
+    'deleted': [3, 5],
+    'compact': [1, 0.0]
+},
+{
+    'name': 'test full compaction',
+    'source':
+    '''include stdlib;
+    attribute v:vec2;
+    if v.x > 2.0 {
+        del();
+    }
+    v.y = v.y + 1.0;
+    ''',
+    'count': 6,
+    'attributes': {
+        'v.x': [1.0, 3.0, 2.0, 5.0, 0.0, 0.5],
+        'v.y': [1.0, 2.0, 3.0, 4.0, 5.0, 6.0]
+    },
+    'expected': {
+        'v.x': [1.0, 0.5, 2.0, 0.0, 0.0, 0.5],
+        'v.y': [2.0, 7.0, 4.0, 6.0, 6.0, 6.0]
+    },
+    'deleted': [4, 5],
+    'compact': [6, 0.0]
+},
+{
+    'name': 'test double buffering',
+    'source':
+    '''include stdlib;
+    attribute v:vec3;
+    if v.x > 2.0 {
+        del();
+    }
+    v.y = v.y * 2.0;
+    ''',
+    'count': 70,
+    'attributes': {
+        'v.x': [float(i%4) for i in range(70)],
+        'v.y': [float(i) for i in range(70)],
+        'v.z': [float(-i) for i in range(70)]
+    },
+    'expected': {
+        'v.x': [float(i%4) for i in range(70)],
+        'v.y': [float(i*2) for i in range(70)],
+        'v.z': [float(-i) for i in range(70)]
+    },
+    'deleted': range(3, 70, 4),
+    'double_buffered': True
+},
+{
+    'name': 'test simulating several systems',
+    'source':
+    '''include stdlib;
+    attribute v:vec2;
+    uniform a:float;
+    if v.x > 2.0 {
+        del();
+    }
+    v.y = v.y * a;
+    ''',
+    'count': 100,
+    'attributes': {
+        'v.x': [float(i%5) for i in range(100)],
+        'v.y': [float(i) for i in range(100)]
+    },
+    'expected': {
+        'v.x': [float(i%5) for i in range(100)],
+        'v.y': [float(i*3) for i in range(100)]
+    },
+    'uniforms': {
+        'a.x': 3.0
+    },
+    'deleted': [i for i in range(100) if i%5 > 2],
+    'systems': 5
+},
+{
+    'name': 'test asynchronous simulation',
+    'source':
+    '''include stdlib;
+    attribute v:vec2;
+    if v.x > 2.0 {
+        del();
+    }
+    v.y = v.y + v.x;
+    ''',
+    'count': 300,
+    'attributes': {
+        'v.x': [float(i%4) for i in range(300)],
+        'v.y': [float(i) for i in range(300)]
+    },
+    'expected': {
+        'v.x': [float(i%4) for i in range(300)],
+        'v.y': [float(i+i%4) for i in range(300)]
+    },
+    'deleted': range(3, 300, 4),
+    'systems': 3,
+    'async': True,
+    'threads': 2
+},
+{
+    'name': 'test instance uniforms',
+    'source':
+    '''attribute v:float;
+    attribute instance:float;
+    uniform a:vec2;
+    v.x = v.x * a.x + a.y;
+    ''',
+    'count': 8,
+    'attributes': {
+        'v.x': [1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0],
+        'instance.x': [0.0, 1.0, 2.0, 1.0, 0.0, -1.0, 3.0, 2.0]
+    },
+    'expected': {
+        'v.x': [2.0, 4.0, 7.0, 4.0, 6.0, -5.0, -6.0, 17.0],
+        'instance.x': [0.0, 1.0, 2.0, 1.0, 0.0, -1.0, 3.0, 2.0]
+    },
+    'uniforms': {
+        'a.x': -1.0,
+        'a.y': 1.0
+    },
+    'instance_attribute': 'instance.x',
+    'instances': [
+        {'a.x': 1.0, 'a.y': 1.0},
+        {'a.x': 0.0, 'a.y': 4.0},
+        {'a.x': 2.0, 'a.y': 1.0}
+    ]
+},
+{
+    'name': 'test switching from the VM to compiled kernels',
+    'source':
+    '''include stdlib;
+    attribute v:vec3;
+    uniform a:float;
+    if v.z > 6.5 {
+        del();
+    }
+    v.x = v.x + a;
+    v.z = v.z + 1.0;
+    v.y = v.y * 2.0;
+    ''',
+    'count': 70,
+    'attributes': {
+        'v.x': [float(i) for i in range(70)],
+        'v.y': [1.0 for i in range(70)],
+        'v.z': [float(i%8) for i in range(70)]
+    },
+    'expected': {
+        'v.x': [i+6.0 for i in range(70)],
+        'v.y': [16.0 for i in range(70)],
+        'v.z': [i%8+4.0 for i in range(70)]
+    },
+    'uniforms': {
+        'a.x': 1.5
+    },
+    'deleted': [i for i in range(70) if i%8 > 3],
+    'frames': 4,
+    'frame_sleep': 250,
+    'tiers': [
+        (0, 'sim', 'vm'),
+        (2, 'sim', 'compiled'),
+        (3, 'sim', 'compiled')
+    ]
+},
+{
+    'name': 'test kernels specialized on uniforms',
+    'source':
+    '''attribute v:vec2;
+    uniform a:vec2;
+    v.x = v.x + a.x;
+    if v.y < a.y {
+        v.y = v.y + 1.0;
+    }
+    ''',
+    'count': 40,
+    'attributes': {
+        'v.x': [float(i) for i in range(40)],
+        'v.y': [float(i%10) for i in range(40)]
+    },
+    'expected': {
+        'v.x': [i+16.0 for i in range(40)],
+        'v.y': [float(max(i%10, 5)) for i in range(40)]
+    },
+    'uniforms': {
+        'a.x': 1.0,
+        'a.y': 5.0
+    },
+    'uniform_changes': [
+        (4, 'a.x', 3.0)
+    ],
+    'specialize_frames': 1,
+    'frames': 8,
+    'frame_sleep': 150,
+    'tiers': [
+        (2, 'sim', 'specialized'),
+        (3, 'sim', 'specialized'),
+        (4, 'sim', 'compiled'),
+        (7, 'sim', 'specialized')
+    ]
+},
+{
+    'name': 'test kernels loaded from the JIT cache',
+    'source':
+    '''include stdlib;
+    attribute v:vec2;
+    if v.x > 2.0 {
+        del();
+    }
+    v.y = v.y * 2.0 + v.x;
+    ''',
+    'count': 20,
+    'attributes': {
+        'v.x': [float(i%4) for i in range(20)],
+        'v.y': [float(i) for i in range(20)]
+    },
+    'expected': {
+        'v.x': [float(i%4) for i in range(20)],
+        'v.y': [i*8.0+7.0*(i%4) for i in range(20)]
+    },
+    'deleted': range(3, 20, 4),
+    'frames': 3,
+    'frame_sleep': 250,
+    'jit_cache': True,
+    'tiers': [
+        (2, 'sim', 'compiled')
+    ]
+},
+{
+    'name': 'test compacting double buffered particles',
+    'source':
+    '''include stdlib;
+    attribute v:vec2;
+    attribute w:float;
+    if v.x > 2.0 {
+        del();
+    }
+    v.y = v.y + 1.0;
+    ''',
+    'count': 6,
+    'attributes': {
+        'v.x': [1.0, 3.0, 2.0, 5.0, 0.0, 0.5],
+        'v.y': [1.0, 2.0, 3.0, 4.0, 5.0, 6.0],
+        'w.x': [1.0, 2.0, 3.0, 4.0, 5.0, 6.0]
+    },
+    'expected': {
+        'v.x': [1.0, 3.0, 2.0, 5.0, 0.0, 0.5],
+        'v.y': [2.0, 2.0, 4.0, 4.0, 6.0, 7.0],
+        'w.x': [1.0, 2.0, 3.0, 4.0, 5.0, 6.0]
+    },
+    'deleted': [1, 3],
+    'compact': [6, 0.0],
+    'double_buffered': True
+},
+{
+    'name': 'test compacting double buffered particles in the next frame',
+    'source':
+    '''include stdlib;
+    attribute v:vec2;
+    attribute w:float;
+    if v.x > 2.0 {
+        del();
+    }
+    v.y = v.y + 1.0;
+    ''',
+    'count': 6,
+    'attributes': {
+        'v.x': [1.0, 3.0, 2.0, 5.0, 0.0, 0.5],
+        'v.y': [1.0, 2.0, 3.0, 4.0, 5.0, 6.0],
+        'w.x': [1.0, 2.0, 3.0, 4.0, 5.0, 6.0]
+    },
+    'expected': {
+        'v.x': [1.0, 0.5, 2.0, 0.0, 0.0, 0.5],
+        'v.y': [3.0, 8.0, 5.0, 7.0, 6.0, 7.0],
+        'w.x': [1.0, 6.0, 3.0, 5.0, 5.0, 6.0]
+    },
+    'deleted': [4, 5],
+    'compact': [6, 0.0],
+    'double_buffered': True,
+    'frames': 2
+}
+,
+{
+    'name': 'test attribute dtypes',
+    'source':
+    '''attribute u8:float;
+    attribute i8:float;
+    attribute u16:float;
+    attribute i16:float;
+    attribute u32:float;
+    attribute i32:float;
+    attribute f32:float;
+    attribute f64:float;
+    u8.x = u8.x + 0.25;
+    i8.x = i8.x - 0.25;
+    u16.x = u16.x + 0.25;
+    i16.x = i16.x - 0.25;
+    u32.x = u32.x + 0.25;
+    i32.x = i32.x - 0.25;
+    f32.x = f32.x + 0.25;
+    f64.x = f64.x - 0.25;
+    ''',
+    'count': 3,
+    'attributes': {
+        'u8.x': [0.0, 0.2, 0.45],
+        'i8.x': [0.0, 0.2, -0.45],
+        'u16.x': [0.0, 0.2, 0.45],
+        'i16.x': [0.0, 0.2, -0.45],
+        'u32.x': [0.0, 0.2, 0.45],
+        'i32.x': [0.0, 0.2, -0.45],
+        'f32.x': [0.0, 0.2, -4.5],
+        'f64.x': [0.0, 0.2, -4.5]
+    },
+    'expected': {
+        'u8.x': [0.25, 0.45, 0.7],
+        'i8.x': [-0.25, -0.05, -0.7],
+        'u16.x': [0.25, 0.45, 0.7],
+        'i16.x': [-0.25, -0.05, -0.7],
+        'u32.x': [0.25, 0.45, 0.7],
+        'i32.x': [-0.25, -0.05, -0.7],
+        'f32.x': [0.25, 0.45, -4.25],
+        'f64.x': [-0.25, -0.05, -4.75]
+    },
+    'dtypes': {
+        'u8.x': 'uint8',
+        'i8.x': 'int8',
+        'u16.x': 'uint16',
+        'i16.x': 'int16',
+        'u32.x': 'uint32',
+        'i32.x': 'int32',
+        'f32.x': 'float32',
+        'f64.x': 'float64'
+    }
+},
+{
+    'name': 'test saturating attribute dtypes',
+    'source':
+    '''attribute u8:float;
+    attribute i8:float;
+    attribute u16:float;
+    attribute i16:float;
+    attribute u32:float;
+    attribute i32:float;
+    attribute f32:float;
+    attribute f64:float;
+    u8.x = u8.x * 2.0;
+    i8.x = i8.x * 2.0;
+    u16.x = u16.x * 2.0;
+    i16.x = i16.x * 2.0;
+    u32.x = u32.x * 2.0;
+    i32.x = i32.x * 2.0;
+    f32.x = f32.x * 2.0;
+    f64.x = f64.x * 2.0;
+    ''',
+    'count': 4,
+    'attributes': {
+        'u8.x': [0.8, -0.8, 3.0, -3.0],
+        'i8.x': [0.8, -0.8, 3.0, -3.0],
+        'u16.x': [0.8, -0.8, 3.0, -3.0],
+        'i16.x': [0.8, -0.8, 3.0, -3.0],
+        'u32.x': [0.8, -0.8, 3.0, -3.0],
+        'i32.x': [0.8, -0.8, 3.0, -3.0],
+        'f32.x': [0.8, -0.8, 3.0, -3.0],
+        'f64.x': [0.8, -0.8, 3.0, -3.0]
+    },
+    'expected': {
+        'u8.x': [1.0, 0.0, 1.0, 0.0],
+        'i8.x': [1.0, -128/127.0, 1.0, -128/127.0],
+        'u16.x': [1.0, 0.0, 1.0, 0.0],
+        'i16.x': [1.0, -32768/32767.0, 1.0, -32768/32767.0],
+        'u32.x': [1.0, 0.0, 1.0, 0.0],
+        'i32.x': [1.0, -1.0, 1.0, -1.0],
+        'f32.x': [1.6, -1.6, 6.0, -6.0],
+        'f64.x': [1.6, -1.6, 6.0, -6.0]
+    },
+    'dtypes': {
+        'u8.x': 'uint8',
+        'i8.x': 'int8',
+        'u16.x': 'uint16',
+        'i16.x': 'int16',
+        'u32.x': 'uint32',
+        'i32.x': 'int32',
+        'f32.x': 'float32',
+        'f64.x': 'float64'
+    }
+},
+{
+    'name': 'test for loop emitter',
+    'source':
+    '''include stdlib;
+    attribute v:vec2;
+    if v.y < 0.0 {
+        del();
+    }
+    v.x = v.x + 1.0;
+    ''',
+    'emitter':
+    '''include stdlib;
+    attribute v:vec2;
+    uniform n:float;
+    for var i:float=0; i<n; i=i+1 {
+        v.x = i;
+        v.y = i * 2.0;
+        emit();
+    }
+    ''',
+    'count': 8,
+    'attributes': {
+        'v.x': [10.0, 20.0, 30.0, 40.0, 0.0, 0.0, 0.0, 0.0],
+        'v.y': [1.0, -1.0, 1.0, -1.0, 0.0, 0.0, 0.0, 0.0]
+    },
+    'expected': {
+        'v.x': [12.0, 1.0, 32.0, 2.0, 2.0, 3.0, 4.0, 3.0],
+        'v.y': [1.0, 0.0, 1.0, 2.0, 0.0, 2.0, 4.0, 4.0]
+    },
+    'emit_uniforms': {
+        'n.x': 3.0
+    },
+    'spawned': 4,
+    'frames': 2
+},
+{
+    'name': 'test emitting a burst of particles',
+    'source': '',
+    'emitter':
+    '''include stdlib;
+    attribute v:vec2;
+    uniform n:float;
+    for var i:float=0; i<n; i=i+1 {
+        v.x = i;
+        v.y = -i;
+        emit();
+    }
+    ''',
+    'count': 5000,
+    'attributes': {
+        'v.x': [0.0 for i in range(5000)],
+        'v.y': [0.0 for i in range(5000)]
+    },
+    'expected': {
+        'v.x': [float(i) for i in range(5000)],
+        'v.y': [float(-i) for i in range(5000)]
+    },
+    'emit_uniforms': {
+        'n.x': 4500.0
+    },
+    'deleted': range(4500, 5000),
+    'spawned': 0,
+    'threads': 4
+},
+{
+    'name': 'test emitting more particles than the pool has room for',
+    'source': '',
+    'emitter':
+    '''include stdlib;
+    attribute v:float;
+    uniform n:float;
+    for var i:float=0; i<n; i=i+1 {
+        v.x = i;
+        emit();
+    }
+    ''',
+    'count': 10,
+    'attributes': {
+        'v.x': [0.0 for i in range(10)]
+    },
+    'expected': {
+        'v.x': [float(i) for i in range(10)]
+    },
+    'emit_uniforms': {
+        'n.x': 15.0
+    },
+    'spawned': 0,
+    'error': 'Pool is full'
+},
+{
+    'name': 'test saturating attribute dtypes on compiled kernels',
+    'source':
+    '''attribute u8:float;
+    attribute i16:float;
+    attribute i32:float;
+    u8.x = u8.x * 2.0;
+    i16.x = i16.x * 2.0;
+    i32.x = i32.x * 2.0;
+    ''',
+    'count': 3,
+    'attributes': {
+        'u8.x': [0.8, -0.8, 0.3],
+        'i16.x': [0.8, -0.8, 0.3],
+        'i32.x': [0.8, -0.8, 0.3]
+    },
+    'expected': {
+        'u8.x': [1.0, 0.0, 1.0],
+        'i16.x': [1.0, -32768/32767.0, 1.0],
+        'i32.x': [1.0, -1.0, 1.0]
+    },
+    'dtypes': {
+        'u8.x': 'uint8',
+        'i16.x': 'int16',
+        'i32.x': 'int32'
+    },
+    'frames': 4,
+    'frame_sleep': 250,
+    'tiers': [
+        (2, 'sim', 'compiled'),
+        (3, 'sim', 'compiled')
+    ]
+},
+{
+    'name': 'test filling the pool from a compiled emitter',
+    'source': '',
+    'emitter':
+    '''include stdlib;
+    attribute v:float;
+    uniform n:float;
+    for var i:float=0; i<n; i=i+1 {
+        v.x = i;
+        emit();
+    }
+    ''',
+    'count': 10,
+    'attributes': {
+        'v.x': [0.0 for i in range(10)]
+    },
+    'expected': {
+        'v.x': [float(i) for i in range(10)]
+    },
+    'emit_uniform_changes': [
+        (3, 'n.x', 15.0)
+    ],
+    'spawned': 0,
+    'error': 'Pool is full',
+    'frames': 4,
+    'frame_sleep': 250,
+    'tiers': [
+        (3, 'emit', 'compiled')
+    ]
 }